@@ -1,13 +1,53 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For copy_file_range
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h> // For offsetof
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h> // For variadic functions like log_error
+#include <malloc.h> // For malloc_usable_size in the allocation accounting
+#include <sys/resource.h> // For getrusage (peak RSS of codec child processes)
+#include <sys/mman.h> // For mmap and madvise on the archive data
+#include <fcntl.h>
+#include <pthread.h> // For the extraction workers (-j)
+#include <fnmatch.h> // For the --first patterns
+#include <dirent.h> // For walking directories in create mode (-c)
+#include <signal.h> // For ignoring SIGPIPE from departed --serve clients and an exited batch run
+#include <poll.h> // For feeding process_data.py its manifest while collecting its results
+#include <sys/wait.h> // For reaping the process_data.py batch run
+#include <sys/socket.h> // For the --serve socket and passing descriptors
+#include <sys/un.h>
+#include <time.h> // For pacing I/O under --io-limit and --iops-limit
+#ifdef HAVE_ZLIB
+#include <zlib.h> // Native ZLIB decoding (build with -DHAVE_ZLIB -lz)
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h> // Native LZMA decoding (build with -DHAVE_LZMA -llzma)
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h> // Native BROTLI decoding (build with -DHAVE_BROTLI -lbrotlidec -lbrotlienc)
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_BZIP2
+#include <bzlib.h> // Native BZIP2 decoding (build with -DHAVE_BZIP2 -lbz2)
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h> // Native FERNET decryption and encryption (build with -DHAVE_OPENSSL -lcrypto)
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h> // AVX2 filter kernels, chosen at run time
+#define HAVE_AVX2_KERNELS 1
+#endif
 
 // Define constants for maximum path length, line length, and magic number
 #define MAX_PATH 256
@@ -15,16 +55,341 @@
 #define MAGIC_NUMBER 0x41524348 // "ARCH" in hex
 #define LOG_FILE "archextract.log" // File for logging operations
 #define REPORT_FILE "metadata.txt" // File for metadata output
+#define RELEASE_CHUNK (1 << 20) // Minimum consumed range returned to the kernel at once
+#define MAX_WORKERS 64 // Upper bound for -j
+#define POOL_MIN_CLASS 12 // Smallest scratch buffer size class (4 KB)
+#define POOL_CLASSES 20 // Pooled size classes run from 4 KB to 2 GB
+#define POOL_CLASS_DEPTH 2 // Idle buffers a worker keeps per size class
+#define DEFAULT_POOL_BUDGET_MB 256 // Default cap on idle pooled memory (--pool-budget)
+#define SHARD_ENTRY_COST 4096 // Fixed per-file cost added to the size when balancing shards and roots
+#define MAX_ROOTS 16 // Upper bound for the number of -o output roots
+#define MANIFEST_FILE "manifest.txt" // File recording the root of each entry when striping
+#define INDEX_FOOTER_SIZE 24 // Size of the footer ending an indexed binary archive
+#define INDEX_RECORD_V2 16 // Bytes an index record gains in version 2 (modification time and hash)
+#define INDEX_RECORD_V3 64 // Bytes per fixed-width record of a version 3 index
+#define INDEX_ALIGN 8 // Alignment of the record table of a version 3 index
+#define INDEX_INLINE 0x01 // Flag of a version 3 index record whose payload is copied into the name pool
+#define INLINE_MAX_LIMIT 65536 // Largest payload size accepted by --inline-max
+#define FILTER_MAX 4 // Filters one FILTERED entry may chain
+#define CHAIN_MAX 4 // Methods one CHAIN entry may apply one after the other
+#define CHAIN_BUFFER (64 << 10) // Bytes passed at once between the stages of a CHAIN entry
+#define FERNET_KEY_LEN 44 // Base64 key at the start of a FERNET payload
+#define FERNET_HEAD 25 // Version, timestamp and IV at the start of a Fernet token
+#define FERNET_MAC 32 // HMAC-SHA256 at the end of a Fernet token
+#define FETCH_COALESCE_GAP (1 << 20) // Remote ranges closer than this are fetched as one
+#define FETCH_MAX_RANGE (32 << 20) // Larger remote ranges are split so they download in parallel
+#define DEFAULT_FETCH_JOBS 4 // Default number of parallel range requests (--fetch-jobs)
+#define CHECKPOINT_WINDOW 32768 // Deflate history needed to resume inflating mid-stream
+#define CHECKPOINT_PREFIX 4096 // Payload bytes hashed to recognize an entry in the sidecar
+#define DEFAULT_CHECKPOINT_SPAN_MB 4 // Default decoded distance between checkpoints (--checkpoint-span)
+#define CHECKPOINT_SUFFIX ".zidx" // Sidecar file holding the checkpoints of an archive
+#define ACCESS_SUFFIX ".access" // Sidecar file counting the reads of each entry of an archive
+#define DEFAULT_XZ_BLOCK_MB 8 // Default uncompressed size of the xz blocks written by create mode
+#define MAX_XZ_BLOCKS (1 << 20) // Upper bound on the blocks of one entry decoded in parallel
+#define BZIP2_BLOCK_MAGIC 0x314159265359ULL // 48 bits starting each bzip2 block (not byte-aligned)
+#define BZIP2_END_MAGIC 0x177245385090ULL // 48 bits ending a bzip2 stream, followed by its CRC
+#define BROTLI_CREATE_QUALITY 9 // Brotli quality of create mode (11 compresses a few percent better, several times slower)
+#define PACK_BATCH_ITEMS 256 // Files gathered before a create-mode batch is encoded in parallel
+#define PACK_BATCH_BYTES (256 << 20) // Input bytes gathered before a create-mode batch is encoded
+#define HEX_LINE_BYTES 16 // Archive bytes per line of hex and xxd output
+#define PACKFILE_ALIGN 4096 // Alignment of each entry's data in a --pack file
+#define PACKFILE_INDEX_SUFFIX ".idx" // Hash index written next to a --pack file
+#define PACKFILE_HEADER 32 // Bytes before the buckets of a pack index
+#define PACKFILE_RECORD 32 // Bytes per bucket of a pack index
+#define IO_CHUNK (1 << 20) // Largest read or write charged at once under --io-limit, so pacing stays smooth
+#define IO_BURST_SECONDS 0.1 // Unused I/O budget that can build up, in seconds of the limit
+#define DECODE_SLICE (64 << 20) // Output decoded between checks for a cancelled drain
+#define DEFAULT_DRAIN_TIMEOUT 10 // Seconds in-flight entries may take to finish after a stop signal (--drain-timeout)
+#define JOURNAL_FILE ".archex-journal" // Entries finished so far, for --resume
+#define PYTHON_BATCH_MIN 2 // Entries needing process_data.py that are handed over in one invocation
 
 // Enum for processing methods (compression/encryption types)
-typedef enum { NO_PROCESSING = 0x00, ZLIB = 0x01, LZMA = 0x02, FERNET = 0x03 } Method;
+typedef enum { NO_PROCESSING = 0x00, ZLIB = 0x01, LZMA = 0x02, FERNET = 0x03, FILTERED = 0x04, CHAIN = 0x05, BROTLI = 0x06,
+               BZIP2 = 0x07 } Method;
+// Enum for the filters a FILTERED entry applies before its inner codec
+typedef enum { FILTER_DELTA = 0x01, FILTER_SHUFFLE = 0x02, FILTER_BITSHUFFLE = 0x03, FILTER_BCJ_X86 = 0x04 } FilterId;
 // Enum for endianness (byte order)
 typedef enum { ENDIAN_LITTLE, ENDIAN_BIG } Endianness;
+// Enum for the subsystems that allocations are attributed to in --stats
+typedef enum {
+    MEM_INGEST, MEM_PARSE, MEM_CODEC_NONE, MEM_CODEC_ZLIB, MEM_CODEC_LZMA, MEM_CODEC_FERNET, MEM_CODEC_FILTERED,
+    MEM_CODEC_CHAIN, MEM_CODEC_BROTLI, MEM_CODEC_BZIP2, MEM_WRITER, MEM_LOGGER, MEM_CHECKPOINT, MEM_TAG_COUNT
+} MemTag;
+// Enum for the stages at which RSS is sampled in --stats
+typedef enum { STAGE_INGEST, STAGE_EXTRACT, STAGE_COUNT } Stage;
+
+// Structure holding the allocation counters of one subsystem
+typedef struct {
+    size_t live; // Bytes currently allocated
+    size_t peak; // Highest value of live
+    unsigned long allocs; // Number of allocations (reallocs included)
+    unsigned long frees; // Number of frees
+    long child_peak_kb; // Peak RSS of codec child processes (codec tags only)
+} MemStats;
+
+// Structure describing the archive bytes being extracted
+typedef struct {
+    uint8_t *data; // Archive bytes (heap buffer, or read-only mapping of a binary archive)
+    size_t len; // Number of valid bytes in data
+    int mapped; // 1 if data is an mmap of the input file
+    const char *path; // Input file of a mapped archive
+    size_t released; // Bytes at the front of data already returned to the kernel
+    int remote; // 1 if data is a sparse anonymous mapping filled by range requests
+    const char *url; // Location of a remote archive
+    Endianness endian; // Byte order of the archive
+    uint8_t version; // Version byte of the archive
+    size_t entries_end; // End of the entry region (start of the index, if any)
+    int has_index; // 1 if the archive ends with an index and footer
+    uint64_t index_offset; // Offset of the index (valid if has_index)
+    uint64_t index_count; // Number of index records (valid if has_index)
+    int index_version; // 1: offsets and headers, 2: also modification times and hashes, 3: fixed-width records and a name pool
+    uint64_t identity; // Hash telling this version of the archive from a rebuilt one, recorded in the journal
+} Archive;
+
+// Structure describing a byte range of a remote archive to download
+typedef struct {
+    uint64_t start; // Offset of the first byte
+    uint64_t len; // Number of bytes
+} FetchRange;
+
+// Structure describing one file entry found by the header scan
+typedef struct {
+    char filename[MAX_PATH]; // Path of the file relative to the output directory
+    uint64_t orig_size; // Size after processing (decompression/decryption)
+    uint64_t proc_size; // Size of the processed data stored in the archive
+    Method method; // Processing method applied to the data
+    size_t header_offset; // Offset of the entry header in the archive
+    size_t data_offset; // Offset of the processed data in the archive
+    long shadowed_by; // Index of a later entry with the same path (-1 if this is the last one)
+    long prev_copy; // Index of the previous entry with the same path (-1 if this is the first one)
+    int priority; // 1 if the entry matches --first and is extracted ahead of the rest
+    int shard; // Shard the entry belongs to (--shard)
+    int root; // Output root the entry is written under (-o)
+    int selected; // 0 if the entry does not match --only
+    uint64_t mtime; // Modification time of the source file in ns (index version 2, else 0)
+    uint64_t hash; // Hash of the decoded data (index version 2, else 0)
+    uint64_t pack_offset; // Offset of the decoded data in the --pack file
+    int failed; // 1 if the entry could not be extracted
+    uint64_t accesses; // Times the entry was read, from the access stats sidecar
+    int resumed; // 1 if an interrupted run already extracted the entry (--resume)
+    size_t inline_offset; // Offset of the copy of the payload kept in the index (0 if none)
+} Entry;
+
+// Structure describing the filter chain of a FILTERED entry. Its payload starts with the inner
+// method (1), the filter count (1) and an id and parameter byte per filter, then the inner stream.
+typedef struct {
+    Method inner; // Codec applied after the filters
+    int count; // Number of filters, in the order they are applied when encoding
+    uint8_t ids[FILTER_MAX]; // FilterId of each filter
+    uint8_t params[FILTER_MAX]; // Delta distance or element size (0 for BCJ)
+} FilterChain;
+
+// Structure describing the stages of a CHAIN entry. Its payload starts with the stage count (1) and
+// a method byte per stage, in the order they are undone when decoding, then the first stage's stream.
+typedef struct {
+    int count; // Number of stages
+    Method stages[CHAIN_MAX]; // ZLIB, LZMA or FERNET; the last stage may also be FILTERED
+} MethodChain;
+
+#ifdef HAVE_OPENSSL
+// Structure holding the state of a Fernet payload decrypted as it streams in
+typedef struct {
+    char key_text[FERNET_KEY_LEN]; // Base64 key read so far
+    size_t key_len; // Characters in key_text
+    uint8_t key[32]; // Signing key, then encryption key
+    uint8_t group[4]; // Values of the base64 characters of the group being decoded
+    int group_len; // Characters in group
+    int padded; // 1 once the token's '=' padding was seen
+    uint8_t head[FERNET_HEAD]; // Version, timestamp and IV
+    size_t head_len; // Bytes in head
+    uint8_t tail[FERNET_MAC]; // Last token bytes, held back until it is known whether they are the HMAC
+    size_t tail_len; // Bytes in tail
+    EVP_CIPHER_CTX *cipher; // AES-128-CBC decryption
+    EVP_MD_CTX *mac; // Inner digest of the HMAC-SHA256 over the token up to the HMAC
+    size_t plain_pos; // Decrypted bytes of plain already passed on
+    size_t plain_len; // Decrypted bytes in plain
+    int finished; // 1 once the HMAC and the padding were checked
+} FernetStream;
+#endif
+
+// Structure holding one stage of a CHAIN entry being decoded. Each stage pulls its input from the
+// stage before it through buf, so only the output of the last stage is ever held whole.
+typedef struct ChainStage {
+    Method method; // Method the stage undoes (a FILTERED stage turns into its inner method)
+    struct ChainStage *up; // Stage producing this stage's input (NULL: the payload)
+    const uint8_t *in; // Input not consumed yet
+    size_t in_len; // Bytes at in
+    int in_end; // 1 once the input is exhausted
+    int started; // 1 once the codec state is initialized
+    int done; // 1 once the stage has produced all of its output
+    FilterChain filters; // Filters of a FILTERED stage, undone on the whole output at the end
+    uint8_t desc[2 + 2 * FILTER_MAX]; // Descriptor of a FILTERED stage read so far
+    size_t desc_len; // Bytes in desc
+#ifdef HAVE_ZLIB
+    z_stream zs; // Inflate state of a ZLIB stage
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz; // Decoder of an LZMA stage
+#endif
+#ifdef HAVE_OPENSSL
+    FernetStream fernet; // Decryption state of a FERNET stage
+#endif
+    uint8_t buf[CHAIN_BUFFER]; // Output of up, consumed through in (the fields from here on are not cleared)
+#ifdef HAVE_OPENSSL
+    uint8_t raw[CHAIN_BUFFER]; // Token bytes decoded from one piece of the input of a FERNET stage
+    uint8_t plain[CHAIN_BUFFER + 4 * 16]; // Decrypted bytes of a FERNET stage not passed on yet
+#endif
+} ChainStage;
+
+// Structure describing an output root and the writes queued on its device
+typedef struct {
+    const char *path; // Directory entries are extracted under
+    uint64_t assigned; // Bytes assigned to this root by the placement
+    int inflight; // Writes currently in progress on this root
+    int max_inflight; // Highest value of inflight
+    unsigned long files; // Files written
+    uint64_t bytes; // Bytes written
+    pthread_mutex_t lock; // Guards the counters
+    pthread_cond_t slot; // Signalled when a write finishes
+} OutputRoot;
+
+// Structure holding a list of file name patterns (from --first)
+typedef struct {
+    char **items; // Glob patterns
+    size_t count; // Number of patterns
+} PatternList;
+
+// Structure holding one worker's idle scratch buffers, by power-of-two size class
+typedef struct {
+    void *bufs[POOL_CLASSES][POOL_CLASS_DEPTH]; // Idle buffers per size class
+    int count[POOL_CLASSES]; // Number of idle buffers per size class
+    pthread_mutex_t lock; // Taken by the owning worker and by a global trim
+} ScratchPool;
+
+// Structure holding the scratch pool counters reported by --stats
+typedef struct {
+    unsigned long hits; // Requests served from an idle buffer
+    unsigned long misses; // Requests that had to map a new buffer
+    unsigned long trims; // Idle buffers unmapped to stay within the budget
+    size_t cached; // Bytes currently idle in all pools
+    size_t cached_peak; // Highest value of cached
+} PoolStats;
+
+// Structure describing a point a ZLIB entry can be inflated from without decoding what precedes it
+typedef struct {
+    uint64_t out; // Decoded offset the checkpoint resumes at (a deflate block boundary)
+    uint64_t in; // Payload offset of the first byte not fully consumed
+    uint8_t bits; // Number of bits of the byte before in that belong to the next block
+    uint8_t *window; // The CHECKPOINT_WINDOW decoded bytes before out
+} Checkpoint;
+
+// Structure holding the checkpoints of one ZLIB entry, in decoded order
+typedef struct {
+    uint64_t data_offset; // Offset of the entry's payload in the archive
+    uint64_t proc_size; // Payload size
+    uint64_t orig_size; // Decoded size
+    uint32_t prefix_crc; // CRC-32 of the first CHECKPOINT_PREFIX payload bytes
+    size_t count; // Number of checkpoints
+    size_t capacity; // Allocated checkpoints
+    Checkpoint *points; // Checkpoints, ordered by out
+} EntryCheckpoints;
+
+// Structure holding the checkpoints of all entries of an archive, as kept in its sidecar file
+typedef struct {
+    EntryCheckpoints *items; // Checkpointed entries
+    size_t count; // Number of checkpointed entries
+    int dirty; // 1 if checkpoints were added since the sidecar was read
+    pthread_mutex_t lock; // Guards the table across workers
+} CheckpointTable;
+
+// Structure holding a token bucket pacing I/O (--io-limit, --iops-limit)
+typedef struct {
+    double rate; // Tokens added per second (0: unlimited)
+    double burst; // Most tokens that can build up while idle
+    double tokens; // Tokens available; negative while callers sleep off what they took
+    double last; // Time tokens were last added, in seconds
+} TokenBucket;
+
+// Structure holding the state shared by the extraction workers
+typedef struct {
+    Archive *ar; // Archive being extracted
+    Entry *entries; // Entries found by the header scan, in archive order
+    size_t count; // Number of entries
+    const size_t *order; // Entry indices in the order they are handed out
+    size_t order_count; // Number of scheduled entries
+    size_t next; // Next position in order to hand out to a worker
+    size_t priority_left; // Priority entries not yet finished
+    size_t priority_failed; // Priority entries that failed to extract
+    size_t first_pending; // Lowest entry index not yet finished (the low-water mark)
+    unsigned char *done; // Finished flag per entry
+    size_t *batch; // Entries decoded by one process_data.py invocation, next to the workers
+    size_t batch_count; // Number of entries in batch
+    pthread_cond_t finished; // Signalled when an entry finishes, for copies waiting on an earlier one
+    pthread_mutex_t lock; // Guards first_pending, done and the page release
+} Extraction;
+
+// Structure holding the per-thread state of an extraction worker
+typedef struct {
+    int id; // Worker number, used to name its temp file
+    Extraction *ex; // Shared extraction state
+    ScratchPool pool; // Output buffers recycled across this worker's entries
+    char temp_path[64]; // Temp file handed to process_data.py
+    pthread_t thread; // Thread running the worker (unused for -j 1)
+#ifdef HAVE_ZLIB
+    z_stream zs; // Inflate state and window, reset between entries
+    int zs_ready; // 1 once zs has been initialized
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz; // LZMA decoder; reinitializing it reuses the dictionary
+#endif
+} Worker;
 
 // Global file pointers for logging and reporting, and verbose mode flag
 FILE *log_fp = NULL; // File pointer for log file
 FILE *report_fp = NULL; // File pointer for metadata file
 int verbose = 0; // Verbose mode (0: off, 1: basic, 2: detailed)
+int keep_duplicates = 0; // Decode every entry even if a later one has the same path (--keep-duplicates)
+const char *notify_touch = NULL; // File created once the --first entries are on disk (--notify-touch)
+int notify_fd = -1; // Descriptor told once the --first entries are on disk (--notify-fd)
+int shard_index = 0; // Shard extracted by this process (--shard i/N)
+int shard_count = 1; // Number of shards the entries are split into
+int shard_by_size = 0; // Balance shards by size instead of hashing names (--shard-by size)
+OutputRoot output_roots[MAX_ROOTS]; // Output roots, one per -o (the first holds the reports)
+int output_root_count = 0; // Number of output roots
+int root_depth = 0; // Maximum writes in flight per root (--root-depth, 0: no limit)
+int fetch_jobs = DEFAULT_FETCH_JOBS; // Parallel range requests for remote archives (--fetch-jobs)
+size_t checkpoint_span = (size_t)DEFAULT_CHECKPOINT_SPAN_MB << 20; // Decoded bytes between checkpoints (0: off)
+CheckpointTable checkpoints = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER}; // Checkpoints of the input archive
+int xz_threads = 0; // Threads decoding the blocks of one xz or bzip2 entry and encoding xz (--xz-threads, 0: one per CPU)
+size_t xz_block_size = (size_t)DEFAULT_XZ_BLOCK_MB << 20; // Uncompressed xz block size in create mode (--block-size)
+int packfile_fd = -1; // Pack file entries are written into instead of a file tree (--pack, -1: off)
+int record_access = 1; // Count entry reads in the archive's access stats sidecar (--no-access-stats: 0)
+TokenBucket io_bytes = {0}; // Bytes read and written per second across all threads (--io-limit)
+TokenBucket io_ops = {0}; // Reads and writes per second across all threads (--iops-limit)
+pthread_mutex_t io_limit_lock = PTHREAD_MUTEX_INITIALIZER; // Guards io_bytes and io_ops
+volatile sig_atomic_t stop_signal = 0; // SIGINT or SIGTERM received during extraction (0: none)
+uint64_t drain_started_ns = 0; // When a decoder first saw stop_signal
+int drain_timeout = DEFAULT_DRAIN_TIMEOUT; // Seconds in-flight entries may take after a stop (--drain-timeout)
+FILE *journal_fp = NULL; // Journal of the entries finished by this run (NULL with --pack)
+int locality = 0; // Extract directory by directory, in name order, preallocating each file (--locality)
+size_t inline_max = 0; // Payloads up to this size are also copied into the index (--inline-max, 0: off)
+FilterChain filter_chain = {0}; // Filters create mode applies before --method (--filter, count 0: none)
+MethodChain method_chain = {0}; // Stages create mode applies for a --method list (count 0: a single method)
+int simd_kernels = 1; // Let the filter kernels use AVX2 when the CPU has it (0: scalar only)
+int stats_enabled = 0; // Collect and print memory statistics (--stats)
+MemStats mem_stats[MEM_TAG_COUNT]; // Allocation counters per subsystem
+long stage_rss_kb[STAGE_COUNT]; // Highest sampled RSS per stage
+const char *mem_tag_names[MEM_TAG_COUNT] = {
+    "ingest", "parse", "codec/none", "codec/zlib", "codec/lzma", "codec/fernet", "codec/filtered", "codec/chain", "codec/brotli",
+    "codec/bzip2", "writer", "logger", "checkpoint"
+};
+const char *stage_names[STAGE_COUNT] = {"ingest", "extract"};
+pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the statistics across workers
+int num_workers = 1; // Number of extraction workers (-j)
+size_t pool_budget = (size_t)DEFAULT_POOL_BUDGET_MB << 20; // Cap on idle pooled bytes
+PoolStats pool_stats; // Scratch pool counters (guarded by mem_lock)
+ScratchPool *pool_registry[MAX_WORKERS]; // Pools of all workers, for the global trim
+int pool_registry_count = 0; // Number of registered pools
 
 // Function to log a message to the log file and console (if verbose mode is on)
 void log_message(const char *msg) {
@@ -38,21 +403,141 @@ void log_message(const char *msg) {
     }
 }
 
+// Function to log a message to the log file and console regardless of verbose mode
+void log_message_always(const char *msg) {
+    if (log_fp) {
+        fprintf(log_fp, "%s\n", msg);
+        fflush(log_fp);
+    }
+    printf("%s\n", msg);
+    fflush(stdout);
+}
+
 // Function to log an error to both log file and stderr
 void log_error(const char *fmt, ...) {
+    char msg[MAX_LINE];
     va_list args;
     va_start(args, fmt); // Start variadic argument processing
+    vsnprintf(msg, sizeof(msg), fmt, args); // Format once; a va_list cannot be reused
+    va_end(args); // End variadic argument processing
+    // Each line is written with a single call so lines from different workers do not interleave
     if (log_fp) {
-        fprintf(log_fp, "ERROR: ");
-        vfprintf(log_fp, fmt, args);
-        fprintf(log_fp, "\n");
+        fprintf(log_fp, "ERROR: %s\n", msg);
         fflush(log_fp); // Flush to ensure immediate write
     }
-    fprintf(stderr, "ERROR: ");
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    fprintf(stderr, "ERROR: %s\n", msg);
     fflush(stderr); // Flush stderr output
-    va_end(args); // End variadic argument processing
+}
+
+// Function to account for a change in the bytes allocated by a subsystem
+void mem_account(MemTag tag, size_t added, size_t removed) {
+    pthread_mutex_lock(&mem_lock);
+    MemStats *st = &mem_stats[tag];
+    st->live = st->live + added - removed;
+    if (st->live > st->peak) st->peak = st->live;
+    if (added) st->allocs++;
+    else if (removed) st->frees++;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+// Function to allocate memory attributed to a subsystem
+void *mem_alloc(MemTag tag, size_t size) {
+    void *ptr = malloc(size);
+    if (ptr && stats_enabled) mem_account(tag, malloc_usable_size(ptr), 0);
+    return ptr;
+}
+
+// Function to resize memory attributed to a subsystem
+void *mem_realloc(MemTag tag, void *ptr, size_t size) {
+    size_t old_size = (ptr && stats_enabled) ? malloc_usable_size(ptr) : 0;
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr && stats_enabled) mem_account(tag, malloc_usable_size(new_ptr), old_size);
+    return new_ptr;
+}
+
+// Function to free memory attributed to a subsystem
+void mem_free(MemTag tag, void *ptr) {
+    if (ptr && stats_enabled) mem_account(tag, 0, malloc_usable_size(ptr));
+    free(ptr);
+}
+
+// Function to map a processing method to its codec allocation tag
+MemTag mem_codec_tag(Method method) {
+    switch (method) {
+        case ZLIB: return MEM_CODEC_ZLIB;
+        case LZMA: return MEM_CODEC_LZMA;
+        case FERNET: return MEM_CODEC_FERNET;
+        case FILTERED: return MEM_CODEC_FILTERED;
+        case CHAIN: return MEM_CODEC_CHAIN;
+        case BROTLI: return MEM_CODEC_BROTLI;
+        case BZIP2: return MEM_CODEC_BZIP2;
+        default: return MEM_CODEC_NONE;
+    }
+}
+
+// Function to read the resident set size of this process in KB
+long read_rss_kb(void) {
+    long pages_total = 0, pages_resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    if (fscanf(fp, "%ld %ld", &pages_total, &pages_resident) != 2) pages_resident = 0;
+    fclose(fp);
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Function to read the peak resident set size (VmHWM) of this process in KB
+long read_peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss; // Reported in KB on Linux
+}
+
+// Function to record the current RSS against a stage
+void sample_rss(Stage stage) {
+    if (!stats_enabled) return;
+    long rss = read_rss_kb();
+    pthread_mutex_lock(&mem_lock);
+    if (rss > stage_rss_kb[stage]) stage_rss_kb[stage] = rss;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+// Function to attribute the peak RSS of the codec child processes to a method
+void sample_child_rss(Method method) {
+    if (!stats_enabled) return;
+    struct rusage usage;
+    if (getrusage(RUSAGE_CHILDREN, &usage) != 0) return;
+    // ru_maxrss is the largest child so far, so a new maximum belongs to the child that just exited
+    MemStats *st = &mem_stats[mem_codec_tag(method)];
+    static long children_peak_kb = 0;
+    pthread_mutex_lock(&mem_lock);
+    if (usage.ru_maxrss > children_peak_kb) {
+        children_peak_kb = usage.ru_maxrss;
+        st->child_peak_kb = usage.ru_maxrss;
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+// Function to print the memory statistics collected with --stats
+void print_stats(void) {
+    char msg[256];
+    log_message_always("Memory statistics:");
+    snprintf(msg, sizeof(msg), "  %-14s %12s %12s %8s %8s %14s", "subsystem", "live", "peak", "allocs", "frees", "child peak KB");
+    log_message_always(msg);
+    for (int t = 0; t < MEM_TAG_COUNT; t++) {
+        MemStats *st = &mem_stats[t];
+        snprintf(msg, sizeof(msg), "  %-14s %12zu %12zu %8lu %8lu %14ld", mem_tag_names[t], st->live, st->peak,
+                 st->allocs, st->frees, st->child_peak_kb);
+        log_message_always(msg);
+    }
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        snprintf(msg, sizeof(msg), "  RSS after %-8s %ld KB", stage_names[s], stage_rss_kb[s]);
+        log_message_always(msg);
+    }
+    snprintf(msg, sizeof(msg), "  Peak RSS        %ld KB", read_peak_rss_kb());
+    log_message_always(msg);
+    snprintf(msg, sizeof(msg), "  Scratch pools   %lu hits, %lu misses, %lu trimmed, %zu bytes idle at peak",
+             pool_stats.hits, pool_stats.misses, pool_stats.trims, pool_stats.cached_peak);
+    log_message_always(msg);
 }
 
 // Function to read a 32-bit unsigned integer from a buffer with specified endianness
@@ -73,6 +558,21 @@ uint64_t read_uint64(const uint8_t *buf, Endianness endian) {
     return result;
 }
 
+// Function to write a 32-bit unsigned integer to a buffer with specified endianness
+void write_uint32(uint8_t *buf, uint32_t value, Endianness endian) {
+    for (int i = 0; i < 4; i++) buf[endian == ENDIAN_LITTLE ? i : 3 - i] = (uint8_t)(value >> (i * 8));
+}
+
+// Function to write a 64-bit unsigned integer to a buffer with specified endianness
+void write_uint64(uint8_t *buf, uint64_t value, Endianness endian) {
+    for (int i = 0; i < 8; i++) buf[endian == ENDIAN_LITTLE ? i : 7 - i] = (uint8_t)(value >> (i * 8));
+}
+
+// Function to check if an input is a remote archive URL
+int is_remote_url(const char *path) {
+    return strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0;
+}
+
 // Function to check if a file has a ".hex" extension
 int is_hex_file(const char *filename) {
     return strstr(filename, ".hex") != NULL;
@@ -83,6 +583,11 @@ int is_xxd_file(const char *filename) {
     return strstr(filename, ".txt") != NULL;
 }
 
+// Function to check if a file is a raw binary archive (".arch" or ".bin")
+int is_binary_file(const char *filename) {
+    return strstr(filename, ".arch") != NULL || strstr(filename, ".bin") != NULL;
+}
+
 // Function to read a line of hex data from a file and convert it to binary
 int read_hex_line(FILE *fp, uint8_t *buf, size_t *buf_len, int is_xxd) {
     char line[MAX_LINE];
@@ -135,250 +640,5809 @@ int create_directories(const char *path) {
     return 1; // Success
 }
 
-// Function to process a single file entry in the archive
-int process_file_entry(uint8_t *data, size_t *offset, size_t data_len, const char *output_dir, Endianness endian) {
-    // Check if there’s enough data for the header
-    if (*offset + 13 > data_len) {
-        log_error("Incomplete file entry header");
+// Function to build the output path of an entry under the output directory
+int build_output_path(char *out, size_t out_len, const char *output_dir, const char *filename) {
+    int n = snprintf(out, out_len, "%s/%s", output_dir, filename);
+    return n >= 0 && (size_t)n < out_len; // Return 0 if the path was truncated
+}
+
+// Function to read a hex or xxd archive into a heap buffer
+int load_hex_archive(FILE *fp, int is_xxd, Archive *ar) {
+    size_t data_capacity = 1024;
+    ar->data = mem_alloc(MEM_INGEST, data_capacity);
+    if (!ar->data) {
+        log_error("Memory allocation failed");
         return 0;
     }
 
-    // Read the length of the filename
-    uint32_t name_len = read_uint32(&data[*offset], endian);
-    *offset += 4;
-    if (*offset + name_len + 17 > data_len) {
-        log_error("Incomplete file entry");
+    // Read the archive data into memory
+    uint8_t buf[256];
+    size_t buf_len;
+    while (read_hex_line(fp, buf, &buf_len, is_xxd)) {
+        if (ar->len + buf_len > data_capacity) {
+            data_capacity *= 2; // Double the capacity if needed
+            uint8_t *new_data = mem_realloc(MEM_INGEST, ar->data, data_capacity);
+            if (!new_data) {
+                log_error("Memory reallocation failed");
+                mem_free(MEM_INGEST, ar->data);
+                ar->data = NULL;
+                return 0;
+            }
+            ar->data = new_data;
+        }
+        memcpy(&ar->data[ar->len], buf, buf_len);
+        ar->len += buf_len;
+    }
+    return 1;
+}
+
+// Function to map a binary archive read-only; pages are faulted in as entries are processed
+int load_binary_archive(const char *path, Archive *ar) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Failed to open input file");
         return 0;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        ar->len = 0; // Reported as too small by the caller
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file referenced
+    if (map == MAP_FAILED) {
+        log_error("Failed to map input file: %s", strerror(errno));
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL); // Entries are read front to back
+    ar->data = map;
+    ar->len = st.st_size;
+    ar->mapped = 1;
+    ar->path = path;
+    return 1;
+}
 
-    // Read the filename
-    char filename[MAX_PATH];
-    strncpy(filename, (char *)&data[*offset], name_len);
-    filename[name_len] = '\0'; // Null-terminate the string
-    *offset += name_len;
-
-    // Read original and processed sizes
-    uint64_t orig_size = read_uint64(&data[*offset], endian);
-    *offset += 8;
-    uint64_t proc_size = read_uint64(&data[*offset], endian);
-    *offset += 8;
-    Method method = data[*offset]; // Read the processing method
-    *offset += 1;
+// Function to load an archive in any supported format
+int load_archive(const char *path, Archive *ar) {
+    memset(ar, 0, sizeof(*ar));
+    if (is_binary_file(path)) return load_binary_archive(path, ar);
 
-    // Check if there’s enough data for the file content
-    if (*offset + proc_size > data_len) {
-        log_error("Processed data exceeds archive size");
+    int is_xxd = is_xxd_file(path);
+    if (!is_hex_file(path) && !is_xxd) {
+        log_error("Unsupported file format");
+        return 0;
+    }
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        log_error("Failed to open input file");
         return 0;
     }
+    int ok = load_hex_archive(fp, is_xxd, ar);
+    fclose(fp);
+    return ok;
+}
 
-    // Convert method to a string for reporting
-    char method_str[16];
-    switch (method) {
-        case NO_PROCESSING: strcpy(method_str, "none"); break;
-        case ZLIB: strcpy(method_str, "zlib"); break;
-        case LZMA: strcpy(method_str, "lzma"); break;
-        case FERNET: strcpy(method_str, "fernet"); break;
-        default: log_error("Unknown processing method"); return 0;
+// Function to free or unmap the archive data
+void unload_archive(Archive *ar) {
+    if (ar->mapped || ar->remote) munmap(ar->data, ar->len);
+    else mem_free(MEM_INGEST, ar->data);
+    ar->data = NULL;
+}
+
+// Function to return the archive pages below the low-water mark to the kernel.
+// low_water is the smallest offset any in-flight or pending entry still needs;
+// everything before it is never read again.
+void release_consumed(Archive *ar, size_t low_water) {
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t)ar->data;
+    // Only whole pages inside the buffer may be released
+    uintptr_t start = (base + ar->released + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = (base + low_water) & ~(uintptr_t)(page - 1);
+    if (end <= start || (end - start < RELEASE_CHUNK && low_water < ar->len)) return;
+
+    int advice = MADV_DONTNEED; // Heap pages are dropped outright
+#ifdef MADV_PAGEOUT
+    if (ar->mapped) advice = MADV_PAGEOUT; // File pages are reclaimed, also leaving the page cache
+#endif
+    if (madvise((void *)start, end - start, advice) != 0 && advice != MADV_DONTNEED)
+        madvise((void *)start, end - start, MADV_DONTNEED); // Kernels before 5.4 lack MADV_PAGEOUT
+    ar->released = end - base;
+}
+
+// Function to map a size to its scratch pool class (-1 if too large to pool)
+int pool_class(size_t size) {
+    int cls = 0;
+    while (((size_t)1 << (cls + POOL_MIN_CLASS)) < size) cls++;
+    return cls < POOL_CLASSES ? cls : -1;
+}
+
+// Function to unmap idle pooled buffers, largest classes first, until at most target bytes stay idle
+void pool_trim_all(size_t target) {
+    for (int cls = POOL_CLASSES - 1; cls >= 0; cls--) {
+        size_t class_size = (size_t)1 << (cls + POOL_MIN_CLASS);
+        for (int p = 0; p < pool_registry_count; p++) {
+            ScratchPool *pool = pool_registry[p];
+            pthread_mutex_lock(&pool->lock);
+            while (pool->count[cls] > 0) {
+                pthread_mutex_lock(&mem_lock);
+                int over = pool_stats.cached > target;
+                if (over) {
+                    pool_stats.cached -= class_size;
+                    pool_stats.trims++;
+                }
+                pthread_mutex_unlock(&mem_lock);
+                if (!over) break;
+                munmap(pool->bufs[cls][--pool->count[cls]], class_size);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
     }
+}
 
-    // Write file details to the metadata report
-    fprintf(report_fp, "%s\t%llu\t%llu\t%s\n", filename, orig_size, proc_size, method_str);
-    if (verbose >= 1) {
-        char msg[512];
-        snprintf(msg, 512, "Processing %s: method=%s, orig_size=%llu, proc_size=%llu", filename, method_str, orig_size, proc_size);
-        log_message(msg); // Log processing details
+// Function to take a scratch buffer of at least size bytes from a worker's pool.
+// New buffers are mapped with MAP_POPULATE so recycled ones never fault again.
+void *pool_get(ScratchPool *pool, size_t size, MemTag tag) {
+    int cls = pool_class(size);
+    size_t class_size = cls < 0 ? size : (size_t)1 << (cls + POOL_MIN_CLASS);
+    void *buf = NULL;
+    if (cls >= 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count[cls] > 0) buf = pool->bufs[cls][--pool->count[cls]];
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_lock(&mem_lock);
+    if (buf) {
+        pool_stats.hits++;
+        pool_stats.cached -= class_size;
+    } else {
+        pool_stats.misses++;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    if (!buf) {
+        buf = mmap(NULL, class_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (buf == MAP_FAILED) {
+            log_error("Failed to allocate %zu byte scratch buffer", class_size);
+            return NULL;
+        }
     }
+    if (stats_enabled) mem_account(tag, class_size, 0);
+    return buf;
+}
 
-    // Create the full output path and ensure directories exist
-    char output_path[MAX_PATH];
-    snprintf(output_path, MAX_PATH, "%s/%s", output_dir, filename);
-    create_directories(output_path);
+// Function to return a scratch buffer to a worker's pool, trimming all pools if they exceed the budget
+void pool_put(ScratchPool *pool, void *buf, size_t size, MemTag tag) {
+    if (!buf) return;
+    int cls = pool_class(size);
+    size_t class_size = cls < 0 ? size : (size_t)1 << (cls + POOL_MIN_CLASS);
+    if (stats_enabled) mem_account(tag, 0, class_size);
+    int cached = 0;
+    if (cls >= 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count[cls] < POOL_CLASS_DEPTH) {
+            pool->bufs[cls][pool->count[cls]++] = buf;
+            cached = 1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!cached) {
+        munmap(buf, class_size);
+        return;
+    }
+    pthread_mutex_lock(&mem_lock);
+    pool_stats.cached += class_size;
+    if (pool_stats.cached > pool_stats.cached_peak) pool_stats.cached_peak = pool_stats.cached;
+    int over_budget = pool_stats.cached > pool_budget;
+    pthread_mutex_unlock(&mem_lock);
+    if (over_budget) pool_trim_all(pool_budget);
+}
 
-    // Write file data to a temporary file for processing
-    FILE *temp_fp = fopen("temp.bin", "wb");
-    if (!temp_fp) {
-        log_error("Failed to create temp file");
-        return 0;
+// Function to unmap every idle buffer of a pool
+void pool_destroy(ScratchPool *pool) {
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        size_t class_size = (size_t)1 << (cls + POOL_MIN_CLASS);
+        while (pool->count[cls] > 0) munmap(pool->bufs[cls][--pool->count[cls]], class_size);
     }
-    if (method == FERNET) {
-        // For FERNET, write the key and data separately
-        fwrite(&data[*offset], 1, 44, temp_fp);
-        fwrite(&data[*offset + 44], 1, proc_size - 44, temp_fp);
-    } else {
-        // For other methods, write the data as-is
-        fwrite(&data[*offset], 1, proc_size, temp_fp);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Function to convert a method to its name for reporting (NULL if unknown)
+const char *method_name(Method method) {
+    switch (method) {
+        case NO_PROCESSING: return "none";
+        case ZLIB: return "zlib";
+        case LZMA: return "lzma";
+        case FERNET: return "fernet";
+        case FILTERED: return "filtered";
+        case CHAIN: return "chain";
+        case BROTLI: return "brotli";
+        case BZIP2: return "bzip2";
+        default: return NULL;
     }
-    fclose(temp_fp);
-    *offset += proc_size;
+}
 
-    // Run the Python script to process the temporary file
-    char cmd[512];
-    snprintf(cmd, 512, "python3 process_data.py %d temp.bin %s %llu 2>&1", method, output_path, orig_size);
-    FILE *pipe = popen(cmd, "r"); // Use popen to capture script output
-    if (!pipe) {
-        log_error("Failed to execute Python script");
-        unlink("temp.bin");
+// Function to parse the name, sizes and method of an entry header.
+// Returns the length of the header, or 0 if it is malformed.
+size_t parse_entry_fields(const uint8_t *buf, size_t avail, Endianness endian, Entry *e) {
+    // Check if there’s enough data for the header
+    if (avail < 13) {
+        log_error("Incomplete file entry header");
         return 0;
     }
 
-    // Read and log the Python script’s output
-    char line[MAX_LINE];
-    while (fgets(line, MAX_LINE, pipe)) {
-        line[strcspn(line, "\n")] = 0; // Remove newline
-        log_message(line); // Log each line of output
+    // Read the length of the filename
+    uint32_t name_len = read_uint32(buf, endian);
+    if (name_len >= MAX_PATH) {
+        log_error("Filename too long in file entry");
+        return 0;
+    }
+    if ((size_t)name_len + 21 > avail) {
+        log_error("Incomplete file entry");
+        return 0;
     }
 
-    // Check the Python script’s exit status
-    int ret = pclose(pipe);
-    if (ret != 0) {
-        log_error("Python processing failed with exit code %d", ret);
-        unlink("temp.bin");
+    // Read the filename
+    memcpy(e->filename, &buf[4], name_len);
+    e->filename[name_len] = '\0'; // Null-terminate the string
+
+    // Read original and processed sizes, then the processing method
+    e->orig_size = read_uint64(&buf[4 + name_len], endian);
+    e->proc_size = read_uint64(&buf[12 + name_len], endian);
+    e->method = buf[20 + name_len];
+    e->selected = 1;
+    e->mtime = e->hash = e->pack_offset = 0;
+    e->failed = 0;
+    e->accesses = 0;
+    e->resumed = 0;
+    e->inline_offset = 0;
+    e->shadowed_by = e->prev_copy = -1; // Until mark_shadowed_entries finds other copies
+    e->priority = e->shard = e->root = 0;
+    return 21 + name_len;
+}
+
+// Function to parse the entry header at *offset and advance past the entry's data
+int parse_entry_header(const uint8_t *data, size_t *offset, size_t data_len, Endianness endian, Entry *e) {
+    size_t header_len = parse_entry_fields(&data[*offset], data_len - *offset, endian, e);
+    if (!header_len) return 0;
+    e->header_offset = *offset;
+    *offset += header_len;
+
+    // Check if there’s enough data for the file content
+    if (e->proc_size > data_len - *offset) {
+        log_error("Processed data exceeds archive size");
         return 0;
     }
+    e->data_offset = *offset;
+    *offset += e->proc_size;
+    return 1;
+}
 
-    unlink("temp.bin"); // Remove temporary file
-    return 1; // Success
+// Function to scan all entry headers into a table before any data is decoded.
+// The scan stops at the first malformed header, since the next one cannot be located.
+int scan_entries(const Archive *ar, size_t offset, Endianness endian, Entry **entries, size_t *count) {
+    size_t capacity = 64;
+    *count = 0;
+    *entries = mem_alloc(MEM_PARSE, capacity * sizeof(Entry));
+    if (!*entries) {
+        log_error("Memory allocation failed");
+        return 0;
+    }
+    while (offset < ar->entries_end) {
+        if (*count == capacity) {
+            capacity *= 2; // Double the capacity if needed
+            Entry *grown = mem_realloc(MEM_PARSE, *entries, capacity * sizeof(Entry));
+            if (!grown) {
+                log_error("Memory reallocation failed");
+                mem_free(MEM_PARSE, *entries);
+                return 0;
+            }
+            *entries = grown;
+        }
+        if (!parse_entry_header(ar->data, &offset, ar->entries_end, endian, &(*entries)[*count])) {
+            log_message("Stopping at malformed file entry");
+            break;
+        }
+        (*count)++;
+    }
+    return 1;
 }
 
-// Main function to parse arguments and process the archive
-int main(int argc, char *argv[]) {
-    // Initialize default parameters
-    char *input_file = NULL;
-    char *output_dir = "./extracted";
-    verbose = 0;
+// Function to hash a string with 64-bit FNV-1a
+uint64_t hash_name(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *name; name++) h = (h ^ (uint8_t)*name) * 0x100000001b3ULL;
+    return h;
+}
 
-    // Parse command-line arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) input_file = argv[++i];
-        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_dir = argv[++i];
-        else if (strcmp(argv[i], "-v") == 0) verbose = (i + 1 < argc && isdigit(argv[i + 1][0])) ? atoi(argv[++i]) : 1;
+// Function to read 8 little-endian bytes as a 64-bit integer for hash_data
+static inline uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Function to mix one 8-byte lane into a hash_data accumulator
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * 0xC2B2AE3D27D4EB4FULL;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * 0x9E3779B185EBCA87ULL;
+}
+
+// Function to hash file data with XXH64 (seed 0). It runs at memory speed, so create mode can
+// recognize unchanged files for much less than the cost of encoding them.
+uint64_t hash_data(const uint8_t *data, size_t len) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL, p3 = 0x165667B19E3779F9ULL;
+    const uint64_t p4 = 0x85EBCA77C2B2AE63ULL, p5 = 0x27D4EB2F165667C5ULL;
+    const uint8_t *p = data, *end = data + len;
+    uint64_t h;
+    if (len >= 32) {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = p1 + p2, v2 = p2, v3 = 0, v4 = -p1;
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = ((v1 << 1) | (v1 >> 63)) + ((v2 << 7) | (v2 >> 57)) + ((v3 << 12) | (v3 >> 52)) + ((v4 << 18) | (v4 >> 46));
+        uint64_t lanes[4] = {v1, v2, v3, v4};
+        for (int i = 0; i < 4; i++) h = (h ^ hash_round(0, lanes[i])) * p1 + p4;
+    } else {
+        h = p5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = ((h << 27) | (h >> 37)) * p1 + p4;
+    }
+    if (end - p >= 4) {
+        uint32_t k = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        h ^= k * p1;
+        h = ((h << 23) | (h >> 41)) * p2 + p3;
+        p += 4;
     }
+    for (; p < end; p++) {
+        h ^= *p * p5;
+        h = ((h << 11) | (h >> 53)) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
 
-    // Check if input file is provided
-    if (!input_file) {
-        fprintf(stderr, "Usage: %s -i <input_file> [-o <output_dir>] [-v [0|1|2]]\n", argv[0]);
-        return 1;
+// Function to normalize an entry name so that names writing the same file compare equal
+// ("./a//b/./c" becomes "a/b/c")
+void normalize_name(const char *name, char *out) {
+    size_t len = 0;
+    while (*name) {
+        if (*name == '/') { name++; continue; } // Skip empty components
+        if (name[0] == '.' && (name[1] == '/' || name[1] == '\0')) { name++; continue; } // Skip "." components
+        if (len > 0) out[len++] = '/';
+        while (*name && *name != '/') out[len++] = *name++;
     }
+    out[len] = '\0';
+}
 
-    // Open log file in append mode
-    log_fp = fopen(LOG_FILE, "a");
-    if (!log_fp) {
-        fprintf(stderr, "Failed to open log file\n");
-        return 1;
+// Function to mark every entry whose output path is written again by a later entry.
+// Walking backwards, the first occurrence of a path is the one that survives; each copy is also
+// linked to the copy before it.
+int mark_shadowed_entries(Entry *entries, size_t count) {
+    size_t buckets = 16;
+    while (buckets < count * 2) buckets *= 2;
+    long *table = mem_alloc(MEM_PARSE, buckets * sizeof(long));
+    if (!table) {
+        log_error("Memory allocation failed");
+        return 0;
     }
+    for (size_t b = 0; b < buckets; b++) table[b] = -1;
 
-    // Create output directory if it doesn’t exist
-    if (mkdir(output_dir, 0755) && errno != EEXIST) {
-        log_error("Failed to create output directory");
-        fclose(log_fp);
-        return 1;
+    char key[MAX_PATH], other[MAX_PATH];
+    for (size_t i = count; i-- > 0;) {
+        entries[i].shadowed_by = entries[i].prev_copy = -1;
+        normalize_name(entries[i].filename, key);
+        for (size_t b = hash_name(key) & (buckets - 1);; b = (b + 1) & (buckets - 1)) {
+            if (table[b] < 0) {
+                table[b] = i; // First time this path is seen
+                break;
+            }
+            normalize_name(entries[table[b]].filename, other);
+            if (strcmp(key, other) == 0) {
+                // The bucket holds the copy after this one
+                Entry *next = &entries[table[b]];
+                entries[i].shadowed_by = next->shadowed_by >= 0 ? next->shadowed_by : table[b];
+                next->prev_copy = i;
+                table[b] = i;
+                break;
+            }
+        }
     }
+    mem_free(MEM_PARSE, table);
+    return 1;
+}
 
-    // Open metadata report file
-    char report_path[MAX_PATH];
-    snprintf(report_path, MAX_PATH, "%s/%s", output_dir, REPORT_FILE);
-    report_fp = fopen(report_path, "w");
-    if (!report_fp) {
-        log_error("Failed to open report file");
-        fclose(log_fp);
-        return 1;
+// Function to index entries by normalized name in an open-addressing table.
+// The last entry with a name wins, as it is the one extraction leaves on disk.
+long *build_name_table(const Entry *entries, size_t count, size_t *buckets) {
+    *buckets = 16;
+    while (*buckets < count * 2) *buckets *= 2;
+    long *table = mem_alloc(MEM_PARSE, *buckets * sizeof(long));
+    if (!table) {
+        log_error("Memory allocation failed");
+        return NULL;
+    }
+    char key[MAX_PATH], other[MAX_PATH];
+    for (size_t b = 0; b < *buckets; b++) table[b] = -1;
+    for (size_t i = 0; i < count; i++) {
+        normalize_name(entries[i].filename, key);
+        size_t b = hash_name(key) & (*buckets - 1);
+        for (; table[b] >= 0; b = (b + 1) & (*buckets - 1)) {
+            normalize_name(entries[table[b]].filename, other);
+            if (strcmp(key, other) == 0) break;
+        }
+        table[b] = i;
     }
+    return table;
+}
 
-    // Open the input archive file
-    FILE *fp = fopen(input_file, "r");
-    if (!fp) {
-        log_error("Failed to open input file");
-        fclose(log_fp);
-        fclose(report_fp);
-        return 1;
+// Function to look up the entry a name extracts to in a name table (-1 if there is none)
+long find_entry(const long *table, size_t buckets, const Entry *entries, const char *name) {
+    char key[MAX_PATH], other[MAX_PATH];
+    if (strlen(name) >= MAX_PATH) return -1;
+    normalize_name(name, key);
+    for (size_t b = hash_name(key) & (buckets - 1); table[b] >= 0; b = (b + 1) & (buckets - 1)) {
+        normalize_name(entries[table[b]].filename, other);
+        if (strcmp(key, other) == 0) return table[b];
     }
+    return -1;
+}
 
-    // Check if the file format is supported
-    int is_hex = is_hex_file(input_file);
-    int is_xxd = is_xxd_file(input_file);
-    if (!is_hex && !is_xxd) {
-        log_error("Unsupported file format");
-        fclose(fp);
-        fclose(log_fp);
-        fclose(report_fp);
-        return 1;
+// Function to log the entries that will not be decoded because a later entry replaces them
+size_t report_shadowed_entries(const Entry *entries, size_t count) {
+    size_t shadowed = 0;
+    char msg[3 * MAX_PATH];
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].shadowed_by < 0) continue;
+        snprintf(msg, sizeof(msg), "Skipping %s at offset %zu: superseded by entry %ld at offset %zu",
+                 entries[i].filename, entries[i].header_offset, entries[i].shadowed_by,
+                 entries[entries[i].shadowed_by].header_offset);
+        log_message(msg);
+        shadowed++;
+    }
+    if (shadowed > 0) {
+        snprintf(msg, sizeof(msg), "Skipped %zu shadowed duplicate entries", shadowed);
+        log_message(msg);
     }
+    return shadowed;
+}
 
-    // Allocate memory to store the archive data
-    uint8_t *data = NULL;
-    size_t data_len = 0, data_capacity = 1024;
-    data = malloc(data_capacity);
-    if (!data) {
+// Function to add a pattern to a pattern list
+int add_pattern(PatternList *list, const char *pattern, size_t len) {
+    if (len == 0) return 1;
+    char **grown = mem_realloc(MEM_PARSE, list->items, (list->count + 1) * sizeof(char *));
+    char *copy = mem_alloc(MEM_PARSE, len + 1);
+    if (!grown || !copy) {
         log_error("Memory allocation failed");
-        fclose(fp);
-        fclose(log_fp);
-        fclose(report_fp);
-        return 1;
+        if (grown) list->items = grown;
+        mem_free(MEM_PARSE, copy);
+        return 0;
     }
+    memcpy(copy, pattern, len);
+    copy[len] = '\0';
+    list->items = grown;
+    list->items[list->count++] = copy;
+    return 1;
+}
 
-    // Read the archive data into memory
-    uint8_t buf[256];
-    size_t buf_len;
-    while (read_hex_line(fp, buf, &buf_len, is_xxd)) {
-        if (data_len + buf_len > data_capacity) {
-            data_capacity *= 2; // Double the capacity if needed
-            uint8_t *new_data = realloc(data, data_capacity);
-            if (!new_data) {
-                log_error("Memory reallocation failed");
-                free(data);
+// Function to load patterns from a comma-separated list, or one per line from "@file"
+int load_patterns(const char *spec, PatternList *list) {
+    if (spec[0] == '@') {
+        FILE *fp = fopen(spec + 1, "r");
+        if (!fp) {
+            log_error("Failed to open pattern list %s", spec + 1);
+            return 0;
+        }
+        char line[MAX_LINE];
+        while (fgets(line, MAX_LINE, fp)) {
+            line[strcspn(line, "\r\n")] = 0; // Remove newline
+            if (!add_pattern(list, line, strlen(line))) {
                 fclose(fp);
-                fclose(log_fp);
-                fclose(report_fp);
-                return 1;
+                return 0;
             }
-            data = new_data;
         }
-        memcpy(&data[data_len], buf, buf_len);
-        data_len += buf_len;
-    }
-    fclose(fp);
-
-    // Check if the archive is large enough to contain a header
-    if (data_len < 5) {
-        log_error("Archive too small");
-        free(data);
-        fclose(log_fp);
-        fclose(report_fp);
+        fclose(fp);
         return 1;
     }
+    for (const char *p = spec; *p;) {
+        size_t len = strcspn(p, ",");
+        if (!add_pattern(list, p, len)) return 0;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return 1;
+}
+
+// Function to free the patterns of a pattern list
+void free_patterns(PatternList *list) {
+    for (size_t i = 0; i < list->count; i++) mem_free(MEM_PARSE, list->items[i]);
+    mem_free(MEM_PARSE, list->items);
+    list->items = NULL;
+    list->count = 0;
+}
+
+// Function to check whether an entry name matches any pattern ('*' also matches '/')
+int match_patterns(const PatternList *list, const char *name) {
+    char normalized[MAX_PATH];
+    normalize_name(name, normalized);
+    for (size_t i = 0; i < list->count; i++) {
+        if (fnmatch(list->items[i], normalized, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+// Comparison function ordering entry indices by decreasing size, then by archive position
+const Entry *shard_sort_entries = NULL; // Entry table seen by compare_entry_size
+int compare_entry_size(const void *a, const void *b) {
+    size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+    uint64_t sa = shard_sort_entries[ia].orig_size, sb = shard_sort_entries[ib].orig_size;
+    if (sa != sb) return sa > sb ? -1 : 1;
+    return ia < ib ? -1 : (ia > ib);
+}
+
+// Function to list the indices of the entries accepted by keep, largest first
+size_t *entries_by_size(Entry *entries, size_t count, int (*keep)(const Entry *), size_t *n) {
+    size_t *sorted = mem_alloc(MEM_PARSE, (count ? count : 1) * sizeof(size_t));
+    if (!sorted) {
+        log_error("Memory allocation failed");
+        return NULL;
+    }
+    *n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (keep(&entries[i])) sorted[(*n)++] = i;
+    }
+    shard_sort_entries = entries;
+    qsort(sorted, *n, sizeof(size_t), compare_entry_size);
+    return sorted;
+}
+
+// Function to check whether an entry survives duplicate elimination
+int is_latest(const Entry *e) {
+    return e->shadowed_by < 0 || keep_duplicates;
+}
+
+// Function to assign every extracted entry to a shard. Only the archive contents decide the
+// assignment, so every process computes the same partition without coordinating.
+int assign_shards(Entry *entries, size_t count) {
+    char key[MAX_PATH];
+    if (!shard_by_size) {
+        // Hash of the normalized name: stable even if the archive is appended to
+        for (size_t i = 0; i < count; i++) {
+            normalize_name(entries[i].filename, key);
+            entries[i].shard = hash_name(key) % shard_count;
+        }
+        return 1;
+    }
+
+    // Size-balanced: largest entries first, each to the least loaded shard (ties to the lower shard)
+    for (size_t i = 0; i < count; i++) entries[i].shard = -1;
+    size_t n = 0;
+    size_t *sorted = entries_by_size(entries, count, is_latest, &n);
+    uint64_t *load = mem_alloc(MEM_PARSE, shard_count * sizeof(uint64_t));
+    if (!sorted || !load) {
+        if (!load) log_error("Memory allocation failed");
+        mem_free(MEM_PARSE, sorted);
+        mem_free(MEM_PARSE, load);
+        return 0;
+    }
+    memset(load, 0, shard_count * sizeof(uint64_t));
+    for (size_t k = 0; k < n; k++) {
+        int best = 0;
+        for (int sh = 1; sh < shard_count; sh++) {
+            if (load[sh] < load[best]) best = sh;
+        }
+        entries[sorted[k]].shard = best;
+        load[best] += entries[sorted[k]].orig_size + SHARD_ENTRY_COST;
+    }
+    // Copies of a path stay with the last one, so one process writes them in order (--keep-duplicates)
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].shadowed_by >= 0) entries[i].shard = entries[entries[i].shadowed_by].shard;
+    }
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Shard %d/%d assigned %llu bytes", shard_index, shard_count,
+             (unsigned long long)load[shard_index]);
+    log_message(msg);
+    mem_free(MEM_PARSE, sorted);
+    mem_free(MEM_PARSE, load);
+    return 1;
+}
+
+// Function to check whether an entry is extracted by this process
+int is_extracted(const Entry *e) {
+    if (e->shadowed_by >= 0 && !keep_duplicates) return 0; // A later entry writes the same file
+    return e->selected && e->shard == shard_index;
+}
+
+// Function to place every extracted entry on an output root, balancing the bytes per root
+int assign_roots(Entry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) entries[i].root = 0;
+    if (output_root_count == 1) return 1;
+    size_t n = 0;
+    size_t *sorted = entries_by_size(entries, count, is_extracted, &n);
+    if (!sorted) return 0;
+    for (size_t k = 0; k < n; k++) {
+        int best = 0;
+        for (int r = 1; r < output_root_count; r++) {
+            if (output_roots[r].assigned < output_roots[best].assigned) best = r;
+        }
+        entries[sorted[k]].root = best;
+        output_roots[best].assigned += entries[sorted[k]].orig_size + SHARD_ENTRY_COST;
+    }
+    // Copies of a path go to the root of the last one, which is the file they all write
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].shadowed_by >= 0) entries[i].root = entries[entries[i].shadowed_by].root;
+    }
+    mem_free(MEM_PARSE, sorted);
+    return 1;
+}
+
+// Function to write the manifest recording which root each extracted file went to
+int write_manifest(const Entry *entries, size_t count) {
+    char path[MAX_PATH];
+    if (shard_count > 1) snprintf(path, MAX_PATH, "%s/manifest.shard-%d-of-%d.txt", output_roots[0].path, shard_index, shard_count);
+    else snprintf(path, MAX_PATH, "%s/%s", output_roots[0].path, MANIFEST_FILE);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_error("Failed to open manifest file");
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (is_extracted(&entries[i])) fprintf(fp, "%s\t%s\n", entries[i].filename, output_roots[entries[i].root].path);
+    }
+    fclose(fp);
+    return 1;
+}
+
+// Function to wait for a write slot on an output root
+void root_begin_write(OutputRoot *root) {
+    pthread_mutex_lock(&root->lock);
+    while (root_depth > 0 && root->inflight >= root_depth) pthread_cond_wait(&root->slot, &root->lock);
+    root->inflight++;
+    if (root->inflight > root->max_inflight) root->max_inflight = root->inflight;
+    pthread_mutex_unlock(&root->lock);
+}
+
+// Function to release a write slot on an output root
+void root_end_write(OutputRoot *root, int ok, uint64_t bytes) {
+    pthread_mutex_lock(&root->lock);
+    root->inflight--;
+    if (ok) {
+        root->files++;
+        root->bytes += bytes;
+    }
+    pthread_cond_signal(&root->slot);
+    pthread_mutex_unlock(&root->lock);
+}
+
+// Function to log how much each output root received
+void report_roots(void) {
+    if (output_root_count == 1) return;
+    char msg[MAX_PATH + 128];
+    for (int r = 0; r < output_root_count; r++) {
+        OutputRoot *root = &output_roots[r];
+        snprintf(msg, sizeof(msg), "Root %s: %lu files, %llu bytes, max %d writes in flight", root->path, root->files,
+                 (unsigned long long)root->bytes, root->max_inflight);
+        if (stats_enabled) log_message_always(msg);
+        else log_message(msg);
+    }
+}
+
+// Comparison function ordering entry indices by output root, then directory, then file name, so
+// that files of one directory are written together and in the order a directory walk lists them
+const Entry *locality_sort_entries = NULL; // Entry table seen by compare_entry_locality
+int compare_entry_locality(const void *a, const void *b) {
+    size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+    const Entry *ea = &locality_sort_entries[ia], *eb = &locality_sort_entries[ib];
+    if (ea->root != eb->root) return ea->root < eb->root ? -1 : 1;
+    char na[MAX_PATH], nb[MAX_PATH];
+    normalize_name(ea->filename, na);
+    normalize_name(eb->filename, nb);
+    char *sa = strrchr(na, '/'), *sb = strrchr(nb, '/');
+    size_t da = sa ? (size_t)(sa - na) : 0, db = sb ? (size_t)(sb - nb) : 0;
+    int cmp = strncmp(na, nb, da < db ? da : db);
+    if (cmp == 0 && da != db) cmp = da < db ? -1 : 1;
+    if (cmp == 0) cmp = strcmp(sa ? sa + 1 : na, sb ? sb + 1 : nb);
+    if (cmp != 0) return cmp;
+    return ia < ib ? -1 : (ia > ib);
+}
+
+// Function to build the journal path of this shard in the first output root
+void journal_path(char *out, size_t out_len) {
+    if (shard_count > 1) snprintf(out, out_len, "%s/%s.shard-%d-of-%d", output_roots[0].path, JOURNAL_FILE, shard_index, shard_count);
+    else snprintf(out, out_len, "%s/%s", output_roots[0].path, JOURNAL_FILE);
+}
+
+// Function to mark the entries listed in the journal of an interrupted run as already extracted
+// (--resume). Lines are "<data offset>\t<size>\t<name>" after an "archex-journal\t<archive size>\t<identity>"
+// header; a journal written for a different archive is ignored. Returns the number of entries marked.
+size_t load_journal(const char *path, const Archive *ar, Entry *entries, size_t count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0; // Nothing was finished yet
+    char line[MAX_PATH + 64];
+    unsigned long long len = 0, identity = 0, offset, size;
+    size_t resumed = 0;
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "archex-journal\t%llu\t%llx", &len, &identity) != 2 ||
+        len != ar->len || identity != ar->identity) {
+        log_message_always("The journal was written for another archive; extracting everything");
+        fclose(fp);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0;
+        char *name = strchr(line, '\t');
+        name = name ? strchr(name + 1, '\t') : NULL;
+        if (!name || sscanf(line, "%llu\t%llu", &offset, &size) != 2) continue;
+        // Entries are in archive order, so their data offsets are sorted
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].data_offset < offset) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < count && entries[lo].data_offset == offset && entries[lo].orig_size == size &&
+            strcmp(entries[lo].filename, name + 1) == 0 && !entries[lo].resumed) {
+            entries[lo].resumed = 1;
+            resumed++;
+        }
+    }
+    fclose(fp);
+    // Copies before a finished copy of the same path are written in order, so they are done too
+    for (size_t i = count; i-- > 0;) {
+        if (entries[i].resumed && entries[i].prev_copy >= 0) entries[entries[i].prev_copy].resumed = 1;
+    }
+    return resumed;
+}
+
+// Function to start the journal of this run, keeping the lines of the run being resumed (append)
+int open_journal(const char *path, const Archive *ar, int append) {
+    journal_fp = fopen(path, append ? "a" : "w");
+    if (!journal_fp) {
+        log_error("Failed to open journal %s", path);
+        return 0;
+    }
+    setvbuf(journal_fp, NULL, _IOLBF, 0); // Each line reaches the file at once, so a killed run keeps it
+    if (ftell(journal_fp) == 0)
+        fprintf(journal_fp, "archex-journal\t%llu\t%016llx\n", (unsigned long long)ar->len, (unsigned long long)ar->identity);
+    return 1;
+}
+
+// Function to build the extraction order: priority entries first, then the rest, each in archive order
+// (or grouped by directory with --locality).
+// Entries that are not extracted (shadowed duplicates, other shards, not --only) and entries an
+// interrupted run already extracted (--resume) are left out.
+size_t *build_schedule(Entry *entries, size_t count, const PatternList *first, size_t *order_count) {
+    size_t *order = mem_alloc(MEM_PARSE, (count ? count : 1) * sizeof(size_t));
+    if (!order) {
+        log_error("Memory allocation failed");
+        return NULL;
+    }
+    size_t n = 0, matched = 0;
+    for (size_t i = 0; i < count; i++) {
+        entries[i].priority = 0;
+        if (!is_extracted(&entries[i]) || entries[i].resumed) continue;
+        if (first->count > 0 && match_patterns(first, entries[i].filename)) {
+            entries[i].priority = 1;
+            order[n++] = i;
+            matched++;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (is_extracted(&entries[i]) && !entries[i].resumed && !entries[i].priority) order[n++] = i;
+    }
+    if (first->count > 0 && matched == 0) log_message("No entries match --first");
+    if (locality) {
+        // Priority entries stay ahead of the rest; each group is ordered by directory
+        locality_sort_entries = entries;
+        qsort(order, matched, sizeof(size_t), compare_entry_locality);
+        qsort(order + matched, n - matched, sizeof(size_t), compare_entry_locality);
+    }
+    *order_count = n;
+    return order;
+}
+
+// Function to signal that every --first entry has been extracted
+void notify_first_ready(size_t failed) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "first-ready failed=%zu\n", failed);
+    if (notify_touch) {
+        // Write under a temporary name so watchers never see a partial file
+        char tmp_path[MAX_PATH + 8];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", notify_touch);
+        FILE *fp = fopen(tmp_path, "w");
+        if (fp) {
+            fputs(msg, fp);
+            fclose(fp);
+            if (rename(tmp_path, notify_touch) != 0) log_error("Failed to create notify file %s", notify_touch);
+        } else {
+            log_error("Failed to create notify file %s", notify_touch);
+        }
+    }
+    if (notify_fd >= 0 && write(notify_fd, msg, strlen(msg)) < 0)
+        log_error("Failed to write to notify descriptor %d: %s", notify_fd, strerror(errno));
+    log_message("Priority entries extracted");
+}
+
+// Function to read the footer of an indexed archive. The footer carries the ARCH magic,
+// so its byte order is known without reading the start of the archive.
+// Footer: index offset (8), entry count (8), ARCH magic (4), archive version (1), "IDX", "IX2" or "IX3" (3)
+int parse_index_footer(const uint8_t *footer, size_t archive_len, Archive *ar) {
+    if (archive_len < 5 + INDEX_FOOTER_SIZE) return 0;
+    int index_version = 0;
+    if (memcmp(&footer[21], "IDX", 3) == 0) index_version = 1;
+    else if (memcmp(&footer[21], "IX2", 3) == 0) index_version = 2;
+    else if (memcmp(&footer[21], "IX3", 3) == 0) index_version = 3;
+    if (!index_version) return 0;
+    if (read_uint32(&footer[16], ENDIAN_BIG) == MAGIC_NUMBER) ar->endian = ENDIAN_BIG;
+    else if (read_uint32(&footer[16], ENDIAN_LITTLE) == MAGIC_NUMBER) ar->endian = ENDIAN_LITTLE;
+    else return 0;
+    uint64_t index_offset = read_uint64(footer, ar->endian);
+    if (index_offset < 5 || index_offset > archive_len - INDEX_FOOTER_SIZE) return 0;
+    ar->has_index = 1;
+    ar->index_version = index_version;
+    ar->index_offset = index_offset;
+    ar->index_count = read_uint64(&footer[8], ar->endian);
+    ar->version = footer[20];
+    ar->entries_end = index_offset;
+    return 1;
+}
+
+// Function to return an entry's payload, read from its copy in the index if it has one
+const uint8_t *entry_payload(const Archive *ar, const Entry *e) {
+    return &ar->data[e->inline_offset ? e->inline_offset : e->data_offset];
+}
+
+// Function to return the padding between the start of an index and its record table
+size_t index_table_pad(uint64_t index_offset) {
+    return (INDEX_ALIGN - index_offset % INDEX_ALIGN) % INDEX_ALIGN;
+}
+
+// Function to build the entry table from a version 3 index: an aligned array of fixed-width
+// records, then the names. The records are checked in one pass over the table before any
+// name is copied, since finding record k needs no parsing of the records before it.
+// Record: header offset (8), original size (8), processed size (8), modification time (8),
+// hash (8), name offset in the pool (4), name length (4), method (1), flags (1), zero padding (14).
+// With INDEX_INLINE set, a copy of the payload follows the name's terminating NUL in the pool.
+int load_index_table(const Archive *ar, const uint8_t *index, size_t index_len, Entry **entries, size_t *count) {
+    size_t pad = index_table_pad(ar->index_offset);
+    *count = 0;
+    if (index_len < pad || ar->index_count > (index_len - pad) / INDEX_RECORD_V3) {
+        log_error("Corrupt archive index");
+        return 0;
+    }
+    const uint8_t *table = &index[pad];
+    const uint8_t *pool = &table[ar->index_count * INDEX_RECORD_V3];
+    size_t pool_len = index_len - pad - ar->index_count * INDEX_RECORD_V3;
+    int bad = 0;
+    for (uint64_t i = 0; i < ar->index_count; i++) {
+        const uint8_t *rec = &table[i * INDEX_RECORD_V3];
+        uint64_t header_offset = read_uint64(rec, ar->endian);
+        uint64_t proc_size = read_uint64(&rec[16], ar->endian);
+        uint32_t name_offset = read_uint32(&rec[40], ar->endian);
+        uint32_t name_len = read_uint32(&rec[44], ar->endian);
+        uint64_t header_len = 21 + (uint64_t)name_len;
+        uint64_t pooled = name_len + (rec[49] & INDEX_INLINE ? 1 + proc_size : 0);
+        bad |= name_len >= MAX_PATH || name_offset > pool_len || pooled > pool_len - name_offset ||
+               header_offset > ar->entries_end || header_len > ar->entries_end - header_offset ||
+               proc_size > ar->entries_end - header_offset - header_len;
+    }
+    if (bad) {
+        log_error("Corrupt archive index");
+        return 0;
+    }
+    *entries = mem_alloc(MEM_PARSE, (ar->index_count ? ar->index_count : 1) * sizeof(Entry));
+    if (!*entries) {
+        log_error("Memory allocation failed");
+        return 0;
+    }
+    for (uint64_t i = 0; i < ar->index_count; i++) {
+        const uint8_t *rec = &table[i * INDEX_RECORD_V3];
+        Entry *e = &(*entries)[i];
+        memset(e, 0, sizeof(*e));
+        uint32_t name_len = read_uint32(&rec[44], ar->endian);
+        memcpy(e->filename, &pool[read_uint32(&rec[40], ar->endian)], name_len);
+        e->filename[name_len] = '\0';
+        e->header_offset = read_uint64(rec, ar->endian);
+        e->orig_size = read_uint64(&rec[8], ar->endian);
+        e->proc_size = read_uint64(&rec[16], ar->endian);
+        e->mtime = read_uint64(&rec[24], ar->endian);
+        e->hash = read_uint64(&rec[32], ar->endian);
+        e->method = rec[48];
+        e->selected = 1;
+        e->shadowed_by = e->prev_copy = -1;
+        e->data_offset = e->header_offset + 21 + name_len;
+        if (rec[49] & INDEX_INLINE)
+            e->inline_offset = ar->index_offset + (pool - index) + read_uint32(&rec[40], ar->endian) + name_len + 1;
+    }
+    *count = ar->index_count;
+    return 1;
+}
+
+// Function to build the entry table from an index. Each record is the entry's header offset,
+// in version 2 its source file's modification time and data hash, then a copy of its header,
+// so no entry header has to be touched.
+int load_index(const Archive *ar, const uint8_t *index, size_t index_len, Entry **entries, size_t *count) {
+    if (ar->index_version >= 3) return load_index_table(ar, index, index_len, entries, count);
+    size_t prefix = ar->index_version >= 2 ? 8 + INDEX_RECORD_V2 : 8;
+    *count = 0;
+    if (ar->index_count > index_len / (prefix + 21)) { // A record holds at least an empty header
+        log_error("Corrupt archive index");
+        return 0;
+    }
+    *entries = mem_alloc(MEM_PARSE, (ar->index_count ? ar->index_count : 1) * sizeof(Entry));
+    if (!*entries) {
+        log_error("Memory allocation failed");
+        return 0;
+    }
+    size_t pos = 0;
+    for (uint64_t i = 0; i < ar->index_count; i++) {
+        Entry *e = &(*entries)[i];
+        if (index_len - pos < prefix) {
+            log_error("Corrupt archive index");
+            mem_free(MEM_PARSE, *entries);
+            return 0;
+        }
+        size_t header_len = parse_entry_fields(&index[pos + prefix], index_len - pos - prefix, ar->endian, e);
+        e->header_offset = read_uint64(&index[pos], ar->endian);
+        if (prefix > 8) {
+            e->mtime = read_uint64(&index[pos + 8], ar->endian);
+            e->hash = read_uint64(&index[pos + 16], ar->endian);
+        }
+        if (!header_len || e->header_offset > ar->entries_end || header_len > ar->entries_end - e->header_offset ||
+            e->proc_size > ar->entries_end - e->header_offset - header_len) {
+            log_error("Corrupt archive index");
+            mem_free(MEM_PARSE, *entries);
+            return 0;
+        }
+        e->data_offset = e->header_offset + header_len;
+        pos += prefix + header_len;
+    }
+    *count = ar->index_count;
+    return 1;
+}
+
+// Function to write a version 3 index and footer for the entries of an archive.
+// The record table starts on an 8-byte boundary of the archive so a mapping of it is aligned.
+// Entries with a payload in payloads (which may be NULL) get a copy of it in the index.
+int write_index(FILE *fp, const Entry *entries, size_t count, const Archive *ar, uint64_t index_offset,
+                const uint8_t *const *payloads) {
+    uint8_t rec[INDEX_RECORD_V3] = {0};
+    size_t pad = index_table_pad(index_offset);
+    if (fwrite(rec, 1, pad, fp) != pad) return 0;
+    uint64_t name_offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const Entry *e = &entries[i];
+        size_t name_len = strlen(e->filename);
+        int inlined = payloads && payloads[i];
+        if (name_offset + name_len > UINT32_MAX) return 0;
+        write_uint64(rec, e->header_offset, ar->endian);
+        write_uint64(&rec[8], e->orig_size, ar->endian);
+        write_uint64(&rec[16], e->proc_size, ar->endian);
+        write_uint64(&rec[24], e->mtime, ar->endian);
+        write_uint64(&rec[32], e->hash, ar->endian);
+        write_uint32(&rec[40], name_offset, ar->endian);
+        write_uint32(&rec[44], name_len, ar->endian);
+        rec[48] = e->method;
+        rec[49] = inlined ? INDEX_INLINE : 0;
+        if (fwrite(rec, 1, INDEX_RECORD_V3, fp) != INDEX_RECORD_V3) return 0;
+        name_offset += name_len + 1 + (inlined ? e->proc_size : 0); // Names are NUL-terminated in the pool
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(entries[i].filename) + 1;
+        if (fwrite(entries[i].filename, 1, len, fp) != len) return 0;
+        if (payloads && payloads[i] && fwrite(payloads[i], 1, entries[i].proc_size, fp) != entries[i].proc_size) return 0;
+    }
+    uint8_t footer[INDEX_FOOTER_SIZE];
+    write_uint64(footer, index_offset, ar->endian);
+    write_uint64(&footer[8], count, ar->endian);
+    write_uint32(&footer[16], MAGIC_NUMBER, ar->endian);
+    footer[20] = ar->version;
+    memcpy(&footer[21], "IX3", 3);
+    return fwrite(footer, 1, INDEX_FOOTER_SIZE, fp) == INDEX_FOOTER_SIZE;
+}
+
+// Function to quote a string for the shell. Returns 0 if the quoted string does not fit in out.
+int shell_quote(const char *in, char *out, size_t out_len) {
+    size_t n = 0;
+    out[n++] = '\'';
+    for (; *in; in++) {
+        if (n + (*in == '\'' ? 4 : 1) + 2 > out_len) return 0; // Leave room for the closing quote and the NUL
+        if (*in == '\'') {
+            memcpy(&out[n], "'\\''", 4); // Close, escaped quote, reopen
+            n += 4;
+        } else {
+            out[n++] = *in;
+        }
+    }
+    out[n++] = '\'';
+    out[n] = '\0';
+    return 1;
+}
+
+// Function to read the size of a remote archive, checking that the server honours range requests.
+// The ETag and Last-Modified headers are hashed into *validators (0 if the server sends neither).
+int http_archive_size(const char *url, uint64_t *size, uint64_t *validators) {
+    char quoted[MAX_LINE], cmd[MAX_LINE + 64];
+    if (!shell_quote(url, quoted, sizeof(quoted))) {
+        log_error("URL too long: %s", url);
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "curl -sSfL -r 0-0 -D - -o /dev/null %s", quoted);
+    FILE *pipe = popen(cmd, "r");
+    if (!pipe) {
+        log_error("Failed to run curl");
+        return 0;
+    }
+    char line[MAX_LINE];
+    int found = 0;
+    *validators = 0;
+    while (fgets(line, MAX_LINE, pipe)) {
+        unsigned long long total;
+        // Headers of the last response after redirects win
+        if (strncmp(line, "HTTP/", 5) == 0) *validators = 0;
+        if (strncasecmp(line, "Content-Range:", 14) == 0 && sscanf(line + 14, " bytes %*u-%*u/%llu", &total) == 1) {
+            *size = total;
+            found = 1;
+        }
+        if (strncasecmp(line, "ETag:", 5) == 0 || strncasecmp(line, "Last-Modified:", 14) == 0)
+            *validators = (*validators ^ hash_name(line)) * 0x100000001b3ULL;
+    }
+    if (pclose(pipe) != 0) {
+        log_error("Failed to reach %s", url);
+        return 0;
+    }
+    if (!found) log_error("Server does not support range requests for %s", url);
+    return found;
+}
+
+// Function to download a byte range of a remote archive into dst
+int http_get_range(const char *url, uint64_t start, uint64_t len, uint8_t *dst) {
+    char quoted[MAX_LINE], cmd[MAX_LINE + 96];
+    if (!shell_quote(url, quoted, sizeof(quoted))) {
+        log_error("URL too long: %s", url);
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "curl -sSfL --retry 2 -r %llu-%llu %s", (unsigned long long)start,
+             (unsigned long long)(start + len - 1), quoted);
+    FILE *pipe = popen(cmd, "r");
+    if (!pipe) {
+        log_error("Failed to run curl");
+        return 0;
+    }
+    size_t got = 0, n;
+    while (got < len && (n = fread(&dst[got], 1, len - got, pipe)) > 0) got += n;
+    int extra = fgetc(pipe) != EOF; // A server ignoring the range sends the whole archive
+    while (extra && fgetc(pipe) != EOF) {}
+    if (pclose(pipe) != 0 || got != len || extra) {
+        log_error("Failed to fetch bytes %llu-%llu of %s", (unsigned long long)start,
+                  (unsigned long long)(start + len - 1), url);
+        return 0;
+    }
+    return 1;
+}
+
+// Structure holding the state shared by the range download threads
+typedef struct {
+    Archive *ar; // Remote archive the ranges are copied into
+    const FetchRange *ranges; // Ranges to download
+    size_t count; // Number of ranges
+    size_t next; // Next range to claim
+    int failed; // Set if any range failed
+} FetchJob;
+
+// Function run by each range download thread
+void *fetch_worker(void *arg) {
+    FetchJob *job = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) break;
+        const FetchRange *r = &job->ranges[i];
+        if (!http_get_range(job->ar->url, r->start, r->len, &job->ar->data[r->start])) job->failed = 1;
+    }
+    return NULL;
+}
+
+// Function to download ranges of a remote archive with up to fetch_jobs parallel requests
+int fetch_ranges(Archive *ar, const FetchRange *ranges, size_t count) {
+    FetchJob job = {ar, ranges, count, 0, 0};
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    for (; started < fetch_jobs && (size_t)started < count; started++) {
+        if (pthread_create(&threads[started], NULL, fetch_worker, &job) != 0) break;
+    }
+    if (started == 0) fetch_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    return !job.failed;
+}
+
+// Function to comparison-sort ranges by start offset
+int compare_range_start(const void *a, const void *b) {
+    const FetchRange *ra = a, *rb = b;
+    return ra->start < rb->start ? -1 : (ra->start > rb->start);
+}
+
+// Function to download the data of the scheduled entries of a remote archive.
+// Nearby ranges are coalesced into one request and large ones split for parallelism.
+// Payloads copied into the index arrived with it and are not requested again.
+int fetch_scheduled_entries(Archive *ar, const Entry *entries, const size_t *order, size_t order_count) {
+    FetchRange *wanted = mem_alloc(MEM_INGEST, (order_count ? order_count : 1) * sizeof(FetchRange));
+    if (!wanted) {
+        log_error("Memory allocation failed");
+        return 0;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < order_count; i++) {
+        const Entry *e = &entries[order[i]];
+        if (e->proc_size > 0 && !e->inline_offset) wanted[n++] = (FetchRange){e->data_offset, e->proc_size};
+    }
+    qsort(wanted, n, sizeof(FetchRange), compare_range_start);
+
+    // Coalesce ranges separated by less than FETCH_COALESCE_GAP
+    size_t merged = 0;
+    for (size_t i = 0; i < n; i++) {
+        FetchRange *last = merged ? &wanted[merged - 1] : NULL;
+        if (last && wanted[i].start <= last->start + last->len + FETCH_COALESCE_GAP) {
+            uint64_t end = wanted[i].start + wanted[i].len;
+            if (end > last->start + last->len) last->len = end - last->start;
+        } else {
+            wanted[merged++] = wanted[i];
+        }
+    }
+
+    // Split coalesced ranges into pieces of at most FETCH_MAX_RANGE
+    size_t pieces = 0;
+    for (size_t i = 0; i < merged; i++) pieces += (wanted[i].len + FETCH_MAX_RANGE - 1) / FETCH_MAX_RANGE;
+    FetchRange *requests = mem_alloc(MEM_INGEST, (pieces ? pieces : 1) * sizeof(FetchRange));
+    if (!requests) {
+        log_error("Memory allocation failed");
+        mem_free(MEM_INGEST, wanted);
+        return 0;
+    }
+    size_t k = 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < merged; i++) {
+        for (uint64_t off = 0; off < wanted[i].len; off += FETCH_MAX_RANGE) {
+            uint64_t len = wanted[i].len - off < FETCH_MAX_RANGE ? wanted[i].len - off : FETCH_MAX_RANGE;
+            requests[k++] = (FetchRange){wanted[i].start + off, len};
+            total += len;
+        }
+    }
+    int ok = fetch_ranges(ar, requests, k);
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Fetched %llu of %llu archive bytes in %zu range requests",
+             (unsigned long long)total, (unsigned long long)ar->len, k);
+    log_message(msg);
+    mem_free(MEM_INGEST, requests);
+    mem_free(MEM_INGEST, wanted);
+    return ok;
+}
+
+// Function to open a remote binary archive: only its footer and index are downloaded here.
+// The archive is backed by a sparse anonymous mapping so entry offsets stay valid.
+int open_remote_archive(const char *url, Archive *ar, Entry **entries, size_t *count) {
+    memset(ar, 0, sizeof(*ar));
+    ar->url = url;
+    uint64_t size, validators;
+    if (!http_archive_size(url, &size, &validators)) return 0;
+    uint8_t footer[INDEX_FOOTER_SIZE];
+    if (size < 5 + INDEX_FOOTER_SIZE || !http_get_range(url, size - INDEX_FOOTER_SIZE, INDEX_FOOTER_SIZE, footer) ||
+        !parse_index_footer(footer, size, ar)) {
+        log_error("Remote archives need an index (add one with --add-index)");
+        return 0;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        log_error("Failed to reserve %llu bytes for %s", (unsigned long long)size, url);
+        return 0;
+    }
+    ar->data = map;
+    ar->len = size;
+    ar->remote = 1;
+
+    size_t index_len = size - INDEX_FOOTER_SIZE - ar->index_offset;
+    if (index_len > 0 && !http_get_range(url, ar->index_offset, index_len, &ar->data[ar->index_offset])) {
+        unload_archive(ar);
+        return 0;
+    }
+    if (!load_index(ar, &ar->data[ar->index_offset], index_len, entries, count)) {
+        unload_archive(ar);
+        return 0;
+    }
+    // The index covers every entry's size, and its hashes with index version 2 and up
+    ar->identity = validators ^ hash_data(&ar->data[ar->index_offset], size - ar->index_offset);
+    return 1;
+}
+
+// Function to identify the version of a local file by its inode and modification time; rebuilding
+// an archive changes them even when every size and offset stays the same
+uint64_t file_identity(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    uint64_t id[3] = {st.st_dev, st.st_ino, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec};
+    return hash_data((const uint8_t *)id, sizeof(id));
+}
+
+// Function to open a local archive, check its header and build its entry table
+int open_local_archive(const char *path, Archive *ar, Entry **entries, size_t *count) {
+    if (!load_archive(path, ar)) return 0;
+    ar->identity = file_identity(path);
+
+    // Check if the archive is large enough to contain a header
+    if (ar->len < 5) {
+        log_error("Archive too small");
+        unload_archive(ar);
+        return 0;
+    }
 
     // Verify the magic number and determine endianness
-    uint32_t magic = read_uint32(data, ENDIAN_BIG);
-    Endianness endian = ENDIAN_BIG;
-    if (magic != MAGIC_NUMBER) {
-        magic = read_uint32(data, ENDIAN_LITTLE);
-        if (magic != MAGIC_NUMBER) {
+    ar->endian = ENDIAN_BIG;
+    if (read_uint32(ar->data, ENDIAN_BIG) != MAGIC_NUMBER) {
+        if (read_uint32(ar->data, ENDIAN_LITTLE) != MAGIC_NUMBER) {
             log_error("Invalid magic number");
-            free(data);
+            unload_archive(ar);
+            return 0;
+        }
+        ar->endian = ENDIAN_LITTLE;
+    }
+    ar->version = ar->data[4]; // Version number at offset 0x04
+    ar->entries_end = ar->len;
+
+    // An archive with an index is read through it, without walking the entries
+    if (ar->len >= 5 + INDEX_FOOTER_SIZE &&
+        parse_index_footer(&ar->data[ar->len - INDEX_FOOTER_SIZE], ar->len, ar)) {
+        size_t index_len = ar->len - INDEX_FOOTER_SIZE - ar->index_offset;
+        if (!load_index(ar, &ar->data[ar->index_offset], index_len, entries, count)) {
+            unload_archive(ar);
+            return 0;
+        }
+        return 1;
+    }
+
+    // Otherwise scan every entry header (starting after magic number and version)
+    if (!scan_entries(ar, 5, ar->endian, entries, count)) {
+        unload_archive(ar);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to append an index and footer to a local binary archive (--add-index)
+int add_index(const char *path) {
+    Archive ar;
+    Entry *entries = NULL;
+    size_t count = 0;
+    if (!is_binary_file(path) || is_remote_url(path)) {
+        log_error("Only local binary archives (.arch, .bin) can be indexed");
+        return 0;
+    }
+    if (!open_local_archive(path, &ar, &entries, &count)) return 0;
+    int ok = 0;
+    if (ar.has_index) {
+        log_error("Archive already has an index");
+    } else if (count > 0 && entries[count - 1].data_offset + entries[count - 1].proc_size != ar.len) {
+        log_error("Archive has malformed entries; not indexing it");
+    } else {
+        // Payloads up to --inline-max are copied into the index from the mapping
+        const uint8_t **payloads = inline_max ? mem_alloc(MEM_PARSE, (count ? count : 1) * sizeof(*payloads)) : NULL;
+        for (size_t i = 0; payloads && i < count; i++) {
+            const Entry *e = &entries[i];
+            payloads[i] = e->proc_size > 0 && e->proc_size <= inline_max ? &ar.data[e->data_offset] : NULL;
+        }
+        FILE *fp = inline_max && !payloads ? NULL : fopen(path, "ab");
+        if (!fp) {
+            log_error("Failed to open %s for appending", path);
+        } else {
+            ok = write_index(fp, entries, count, &ar, ar.len, payloads);
+            if (fclose(fp) != 0) ok = 0;
+            if (!ok) log_error("Failed to write index to %s", path);
+        }
+        mem_free(MEM_PARSE, payloads);
+    }
+    if (ok) {
+        char msg[MAX_PATH + 64];
+        snprintf(msg, sizeof(msg), "Indexed %zu entries of %s", count, path);
+        log_message(msg);
+    }
+    mem_free(MEM_PARSE, entries);
+    unload_archive(&ar);
+    return ok;
+}
+
+// Function to read a monotonic clock in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to set the rate of a token bucket; it starts full
+void bucket_init(TokenBucket *b, double rate, double min_burst) {
+    b->rate = rate;
+    b->burst = rate * IO_BURST_SECONDS > min_burst ? rate * IO_BURST_SECONDS : min_burst;
+    b->tokens = b->burst;
+    b->last = now_seconds();
+}
+
+// Function to take tokens from a bucket, returning how long the caller has to wait for them.
+// Tokens are taken even if the bucket runs into debt, so concurrent callers queue up fairly.
+double bucket_take(TokenBucket *b, double n, double now) {
+    if (b->rate <= 0) return 0;
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+    b->tokens -= n;
+    return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+// Function to pace one read or write of len bytes against the limits shared by all threads
+void io_throttle(uint64_t len) {
+    if (io_bytes.rate <= 0 && io_ops.rate <= 0) return;
+    pthread_mutex_lock(&io_limit_lock);
+    double now = now_seconds();
+    double wait = bucket_take(&io_bytes, len, now);
+    double wait_ops = bucket_take(&io_ops, 1, now);
+    pthread_mutex_unlock(&io_limit_lock);
+    if (wait_ops > wait) wait = wait_ops;
+    if (wait > 0) {
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+    }
+}
+
+// Function to return the largest I/O to issue at once: IO_CHUNK while a limit is set
+size_t io_chunk(uint64_t len) {
+    if (io_bytes.rate <= 0 && io_ops.rate <= 0) return len;
+    return len < IO_CHUNK ? len : IO_CHUNK;
+}
+
+// Function to pace I/O of len bytes done elsewhere (page faults, process_data.py), one IO_CHUNK at a time
+void io_throttle_span(uint64_t len) {
+    while (len > 0) {
+        size_t n = io_chunk(len);
+        io_throttle(n);
+        len -= n;
+    }
+}
+
+// Function to handle SIGINT and SIGTERM: stop admitting entries (a second signal kills the process)
+void request_stop(int sig) {
+    stop_signal = sig;
+}
+
+// Function to check whether an in-flight decode should give up because a stop was requested more
+// than drain_timeout seconds ago. Decoders call it between blocks.
+int decode_cancelled(void) {
+    if (!stop_signal) return 0;
+    uint64_t now = (uint64_t)(now_seconds() * 1e9), started = 0;
+    if (__atomic_compare_exchange_n(&drain_started_ns, &started, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) started = now;
+    return now - started > (uint64_t)drain_timeout * 1000000000ULL;
+}
+
+// Function to build the temp name an entry is written under before it is renamed onto path.
+// The name carries the entry's header offset, so copies of one path (--keep-duplicates) never share it.
+void build_part_path(char *out, size_t out_len, const char *path, const Entry *e) {
+    snprintf(out, out_len, "%s.part.%zu", path, e->header_offset);
+}
+
+// Function to write a decoded buffer to its output file. The data goes to the entry's part file,
+// which is renamed once complete, so an interrupted run never leaves a truncated file under the real name.
+int write_output(const Entry *e, const char *path, const uint8_t *buf, size_t len) {
+    char part_path[MAX_PATH + 32];
+    build_part_path(part_path, sizeof(part_path), path, e);
+    int fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("Failed to write output file %s: %s", path, strerror(errno));
+        return 0;
+    }
+    // Reserving the whole file up front lets the file system give it one contiguous extent
+    if (locality && len > 0) (void)fallocate(fd, 0, 0, len);
+    while (len > 0) {
+        size_t chunk = io_chunk(len);
+        io_throttle(chunk);
+        ssize_t n = write(fd, buf, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("Failed to write output file %s: %s", path, strerror(errno));
+            close(fd);
+            unlink(part_path);
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    close(fd);
+    if (rename(part_path, path) != 0) {
+        log_error("Failed to write output file %s: %s", path, strerror(errno));
+        unlink(part_path);
+        return 0;
+    }
+    return 1;
+}
+
+#ifdef HAVE_ZLIB
+// Function to add a checkpoint to an entry's list (the window is copied)
+int add_checkpoint(EntryCheckpoints *cp, uint64_t out, uint64_t in, int bits, const uint8_t *window) {
+    if (cp->count == cp->capacity) {
+        size_t capacity = cp->capacity ? cp->capacity * 2 : 16;
+        Checkpoint *grown = mem_realloc(MEM_CHECKPOINT, cp->points, capacity * sizeof(Checkpoint));
+        if (!grown) return 0;
+        cp->points = grown;
+        cp->capacity = capacity;
+    }
+    uint8_t *copy = mem_alloc(MEM_CHECKPOINT, CHECKPOINT_WINDOW);
+    if (!copy) return 0;
+    memcpy(copy, window, CHECKPOINT_WINDOW);
+    cp->points[cp->count++] = (Checkpoint){out, in, (uint8_t)bits, copy};
+    return 1;
+}
+
+// Function to free the checkpoints of an entry
+void free_entry_checkpoints(EntryCheckpoints *cp) {
+    for (size_t i = 0; i < cp->count; i++) mem_free(MEM_CHECKPOINT, cp->points[i].window);
+    mem_free(MEM_CHECKPOINT, cp->points);
+    cp->points = NULL;
+    cp->count = cp->capacity = 0;
+}
+
+// Function to inflate a ZLIB entry into out, reusing the worker's inflate state and window.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+// If record is not NULL, a checkpoint is added to it every checkpoint_span decoded bytes.
+int decode_zlib(Worker *w, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len, EntryCheckpoints *record) {
+    z_stream *zs = &w->zs;
+    if (!w->zs_ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit(zs) != Z_OK) {
+            log_error("Zlib decompression failed: cannot initialize");
+            return 0;
+        }
+        w->zs_ready = 1;
+    } else {
+        inflateReset(zs);
+    }
+
+    // avail_in/avail_out are 32-bit, so large entries are fed in chunks; output goes out in
+    // DECODE_SLICE pieces so a drain can cancel the entry. When recording, Z_BLOCK makes inflate stop at every deflate block boundary.
+    size_t in_pos = 0, out_pos = 0, out_cap = out_len + 1, last_point = 0;
+    int ret;
+    do {
+        uInt in_chunk = in_len - in_pos > UINT_MAX ? UINT_MAX : in_len - in_pos;
+        uInt out_chunk = out_cap - out_pos > DECODE_SLICE ? DECODE_SLICE : out_cap - out_pos;
+        zs->next_in = (Bytef *)&in[in_pos];
+        zs->avail_in = in_chunk;
+        zs->next_out = &out[out_pos];
+        zs->avail_out = out_chunk;
+        ret = inflate(zs, record ? Z_BLOCK : Z_NO_FLUSH);
+        in_pos += in_chunk - zs->avail_in;
+        out_pos += out_chunk - zs->avail_out;
+        // Bit 7 of data_type marks a block boundary, bit 6 the end of the last block
+        if (record && ret == Z_OK && (zs->data_type & 128) && !(zs->data_type & 64) &&
+            out_pos - last_point >= checkpoint_span && out_pos >= CHECKPOINT_WINDOW && out_pos < out_len) {
+            if (!add_checkpoint(record, out_pos, in_pos, zs->data_type & 7, &out[out_pos - CHECKPOINT_WINDOW])) {
+                free_entry_checkpoints(record);
+                record = NULL; // Out of memory: finish the entry without checkpoints
+            }
+            last_point = out_pos;
+        }
+        if (ret == Z_OK && decode_cancelled()) {
+            log_error("Zlib decompression cancelled by a stop signal");
+            return 0;
+        }
+    } while (ret == Z_OK);
+
+    if (ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        log_error("Zlib decompression failed: %s", zs->msg ? zs->msg : "corrupt data");
+        return 0;
+    }
+    if (ret == Z_BUF_ERROR && out_pos <= out_len) {
+        log_error("Zlib decompression failed: truncated data");
+        return 0;
+    }
+    if (out_pos != out_len) {
+        log_error("Zlib decompressed size mismatch");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to compute the CRC-32 identifying an entry's payload in the sidecar
+uint32_t payload_prefix_crc(const uint8_t *payload, uint64_t proc_size) {
+    return crc32(0, payload, proc_size < CHECKPOINT_PREFIX ? proc_size : CHECKPOINT_PREFIX);
+}
+
+// Function to find the checkpoints recorded for an entry (NULL if there are none).
+// The caller holds checkpoints.lock.
+EntryCheckpoints *find_checkpoints(const Entry *e, uint32_t prefix_crc) {
+    for (size_t i = 0; i < checkpoints.count; i++) {
+        EntryCheckpoints *cp = &checkpoints.items[i];
+        if (cp->data_offset == e->data_offset && cp->proc_size == e->proc_size && cp->orig_size == e->orig_size &&
+            cp->prefix_crc == prefix_crc)
+            return cp;
+    }
+    return NULL;
+}
+
+// Function to check whether an entry is large enough to be checkpointed and has no checkpoints yet
+int wants_checkpoints(const Entry *e, const uint8_t *payload) {
+    if (checkpoint_span == 0 || e->method != ZLIB || e->orig_size < 2 * (uint64_t)checkpoint_span) return 0;
+    pthread_mutex_lock(&checkpoints.lock);
+    int wanted = find_checkpoints(e, payload_prefix_crc(payload, e->proc_size)) == NULL;
+    pthread_mutex_unlock(&checkpoints.lock);
+    return wanted;
+}
+
+// Function to move the checkpoints recorded for an entry into the table
+void store_checkpoints(const Entry *e, const uint8_t *payload, EntryCheckpoints *cp) {
+    if (cp->count == 0) return;
+    cp->data_offset = e->data_offset;
+    cp->proc_size = e->proc_size;
+    cp->orig_size = e->orig_size;
+    cp->prefix_crc = payload_prefix_crc(payload, e->proc_size);
+    pthread_mutex_lock(&checkpoints.lock);
+    EntryCheckpoints *grown = NULL;
+    if (!find_checkpoints(e, cp->prefix_crc))
+        grown = mem_realloc(MEM_CHECKPOINT, checkpoints.items, (checkpoints.count + 1) * sizeof(EntryCheckpoints));
+    if (grown) {
+        checkpoints.items = grown;
+        checkpoints.items[checkpoints.count++] = *cp;
+        checkpoints.dirty = 1;
+        cp->points = NULL; // Now owned by the table
+        cp->count = cp->capacity = 0;
+    }
+    pthread_mutex_unlock(&checkpoints.lock);
+    free_entry_checkpoints(cp); // Only if another worker got there first or the table could not grow
+}
+
+// Function to read the checkpoints of an archive from its sidecar file.
+// Sidecar: "ZIDX", archive length (8), then per entry: data offset (8), processed size (8),
+// original size (8), prefix CRC (4), count (4), and per checkpoint: out (8), in (8), bits (1), window.
+// All integers are little-endian. A sidecar written for another archive is ignored.
+int load_checkpoints(const char *path, uint64_t archive_len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 1; // No checkpoints recorded yet
+    uint8_t buf[36];
+    int ok = fread(buf, 1, 12, fp) == 12 && memcmp(buf, "ZIDX", 4) == 0 &&
+             read_uint64(&buf[4], ENDIAN_LITTLE) == archive_len;
+    while (ok && fread(buf, 1, 32, fp) == 32) {
+        EntryCheckpoints cp = {0};
+        cp.data_offset = read_uint64(buf, ENDIAN_LITTLE);
+        cp.proc_size = read_uint64(&buf[8], ENDIAN_LITTLE);
+        cp.orig_size = read_uint64(&buf[16], ENDIAN_LITTLE);
+        cp.prefix_crc = read_uint32(&buf[24], ENDIAN_LITTLE);
+        uint32_t count = read_uint32(&buf[28], ENDIAN_LITTLE);
+        uint8_t *window = mem_alloc(MEM_CHECKPOINT, CHECKPOINT_WINDOW);
+        if (!window) ok = 0;
+        for (uint32_t i = 0; ok && i < count; i++) {
+            ok = fread(buf, 1, 17, fp) == 17 && fread(window, 1, CHECKPOINT_WINDOW, fp) == CHECKPOINT_WINDOW &&
+                 buf[16] < 8 && add_checkpoint(&cp, read_uint64(buf, ENDIAN_LITTLE), read_uint64(&buf[8], ENDIAN_LITTLE),
+                                               buf[16], window);
+        }
+        mem_free(MEM_CHECKPOINT, window);
+        EntryCheckpoints *grown = ok ? mem_realloc(MEM_CHECKPOINT, checkpoints.items,
+                                                   (checkpoints.count + 1) * sizeof(EntryCheckpoints)) : NULL;
+        if (!grown) {
+            free_entry_checkpoints(&cp);
+            ok = 0;
+            break;
+        }
+        checkpoints.items = grown;
+        checkpoints.items[checkpoints.count++] = cp;
+    }
+    fclose(fp);
+    if (!ok) log_message("Ignoring stale or damaged checkpoint file");
+    return 1; // Checkpoints are an optimization; a bad sidecar is rewritten
+}
+
+// Function to write the checkpoint table to the sidecar file if it changed
+int save_checkpoints(const char *path, uint64_t archive_len) {
+    if (!checkpoints.dirty) return 1;
+    char tmp_path[MAX_PATH + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        log_error("Failed to write checkpoint file %s", path);
+        return 0;
+    }
+    uint8_t buf[32];
+    memcpy(buf, "ZIDX", 4);
+    write_uint64(&buf[4], archive_len, ENDIAN_LITTLE);
+    int ok = fwrite(buf, 1, 12, fp) == 12;
+    for (size_t i = 0; ok && i < checkpoints.count; i++) {
+        const EntryCheckpoints *cp = &checkpoints.items[i];
+        write_uint64(buf, cp->data_offset, ENDIAN_LITTLE);
+        write_uint64(&buf[8], cp->proc_size, ENDIAN_LITTLE);
+        write_uint64(&buf[16], cp->orig_size, ENDIAN_LITTLE);
+        write_uint32(&buf[24], cp->prefix_crc, ENDIAN_LITTLE);
+        write_uint32(&buf[28], cp->count, ENDIAN_LITTLE);
+        ok = fwrite(buf, 1, 32, fp) == 32;
+        for (size_t j = 0; ok && j < cp->count; j++) {
+            write_uint64(buf, cp->points[j].out, ENDIAN_LITTLE);
+            write_uint64(&buf[8], cp->points[j].in, ENDIAN_LITTLE);
+            buf[16] = cp->points[j].bits;
+            ok = fwrite(buf, 1, 17, fp) == 17 && fwrite(cp->points[j].window, 1, CHECKPOINT_WINDOW, fp) == CHECKPOINT_WINDOW;
+        }
+    }
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        log_error("Failed to write checkpoint file %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+    checkpoints.dirty = 0;
+    return 1;
+}
+
+// Function to free the checkpoint table
+void free_checkpoints(void) {
+    for (size_t i = 0; i < checkpoints.count; i++) free_entry_checkpoints(&checkpoints.items[i]);
+    mem_free(MEM_CHECKPOINT, checkpoints.items);
+    checkpoints.items = NULL;
+    checkpoints.count = 0;
+}
+
+// Function to write the decoded bytes [offset, offset + len) of a ZLIB entry to fp.
+// Inflating starts at the last checkpoint before offset; without checkpoints it starts at the
+// beginning and records them on the way, so the next read is fast.
+int inflate_range(const Entry *e, const uint8_t *payload, uint64_t offset, uint64_t len, FILE *fp) {
+    uint32_t prefix_crc = payload_prefix_crc(payload, e->proc_size);
+    pthread_mutex_lock(&checkpoints.lock);
+    const EntryCheckpoints *cp = find_checkpoints(e, prefix_crc);
+    const Checkpoint *pt = NULL;
+    for (size_t i = 0; cp && i < cp->count && cp->points[i].out <= offset; i++) pt = &cp->points[i];
+    int record = cp == NULL && checkpoint_span > 0 && e->orig_size >= 2 * (uint64_t)checkpoint_span;
+    pthread_mutex_unlock(&checkpoints.lock); // Points are never removed while the archive is open
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    uint64_t in_pos = 0, out_pos = 0, last_point = 0;
+    int ret = pt ? inflateInit2(&zs, -15) : inflateInit(&zs); // Checkpoints resume inside the raw deflate data
+    if (ret == Z_OK && pt) {
+        if (pt->bits) ret = inflatePrime(&zs, pt->bits, payload[pt->in - 1] >> (8 - pt->bits));
+        if (ret == Z_OK) ret = inflateSetDictionary(&zs, pt->window, CHECKPOINT_WINDOW);
+        in_pos = pt->in;
+        out_pos = last_point = pt->out;
+    }
+    uint8_t *window = mem_alloc(MEM_CHECKPOINT, CHECKPOINT_WINDOW);
+    uint8_t *rotated = record ? mem_alloc(MEM_CHECKPOINT, CHECKPOINT_WINDOW) : NULL;
+    if (ret != Z_OK || !window || (record && !rotated)) {
+        log_error("Zlib decompression failed: cannot initialize");
+        inflateEnd(&zs);
+        mem_free(MEM_CHECKPOINT, window);
+        mem_free(MEM_CHECKPOINT, rotated);
+        return 0;
+    }
+
+    // Inflate into a circular window; its contents are the history a new checkpoint needs
+    EntryCheckpoints recorded = {0};
+    size_t have = 0;
+    uint64_t end = offset + len;
+    int ok = 1;
+    while (out_pos < end) {
+        if (have == CHECKPOINT_WINDOW) have = 0;
+        uInt in_chunk = e->proc_size - in_pos > UINT_MAX ? UINT_MAX : e->proc_size - in_pos;
+        zs.next_in = (Bytef *)&payload[in_pos];
+        zs.avail_in = in_chunk;
+        zs.next_out = &window[have];
+        zs.avail_out = CHECKPOINT_WINDOW - have;
+        ret = inflate(&zs, record ? Z_BLOCK : Z_NO_FLUSH);
+        size_t produced = CHECKPOINT_WINDOW - have - zs.avail_out;
+        in_pos += in_chunk - zs.avail_in;
+
+        // Write the part of the new output that falls inside the range
+        uint64_t from = out_pos > offset ? out_pos : offset;
+        uint64_t to = out_pos + produced < end ? out_pos + produced : end;
+        if (from < to && fwrite(&window[have + (from - out_pos)], 1, to - from, fp) != to - from) {
+            log_error("Failed to write range output");
+            ok = 0;
+            break;
+        }
+        out_pos += produced;
+        have += produced;
+        if (ret == Z_STREAM_END) break;
+        if (ret != Z_OK) {
+            log_error("Zlib decompression failed: %s", zs.msg ? zs.msg : "truncated data");
+            ok = 0;
+            break;
+        }
+        if (record && (zs.data_type & 128) && !(zs.data_type & 64) && out_pos - last_point >= checkpoint_span &&
+            out_pos >= CHECKPOINT_WINDOW) {
+            memcpy(rotated, &window[have], CHECKPOINT_WINDOW - have); // Oldest bytes first
+            memcpy(&rotated[CHECKPOINT_WINDOW - have], window, have);
+            if (!add_checkpoint(&recorded, out_pos, in_pos, zs.data_type & 7, rotated)) record = 0;
+            last_point = out_pos;
+        }
+    }
+    if (ok && out_pos < end) {
+        log_error("Zlib decompressed size mismatch");
+        ok = 0;
+    }
+    inflateEnd(&zs);
+    mem_free(MEM_CHECKPOINT, window);
+    mem_free(MEM_CHECKPOINT, rotated);
+    if (ok) store_checkpoints(e, payload, &recorded);
+    else free_entry_checkpoints(&recorded);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_LZMA
+// Structure describing one block of a multi-block xz payload
+typedef struct {
+    uint64_t in; // Offset of the block header in the payload
+    uint64_t unpadded; // Unpadded size of the block (header, data and check)
+    uint64_t out; // Offset of the block's data in the decoded output
+    uint64_t out_len; // Decoded size of the block
+} XzBlock;
+
+// Structure holding the blocks of an xz payload shared by the block decoding threads
+typedef struct {
+    const uint8_t *in; // The xz payload
+    uint8_t *out; // Output buffer, written at each block's precomputed offset
+    const XzBlock *blocks; // Blocks, in stream order
+    size_t count; // Number of blocks
+    size_t next; // Next block to claim
+    int failed; // Set if any block fails to decode
+} XzJob;
+
+// Function to decode one xz block into its slice of the output
+int decode_xz_block(const uint8_t *in, const XzBlock *b, lzma_check check, uint8_t *out) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    memset(&block, 0, sizeof(block));
+    block.version = 1;
+    block.check = check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(in[b->in]);
+    if (block.header_size > b->unpadded || lzma_block_header_decode(&block, NULL, &in[b->in]) != LZMA_OK)
+        return 0;
+    int ok = lzma_block_compressed_size(&block, b->unpadded) == LZMA_OK;
+    size_t in_pos = b->in + block.header_size, out_pos = b->out;
+    size_t in_end = b->in + ((b->unpadded + 3) & ~(uint64_t)3); // Block padding is part of the block
+    if (ok) ok = lzma_block_buffer_decode(&block, NULL, in, &in_pos, in_end, out, &out_pos, b->out + b->out_len) == LZMA_OK;
+    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) free(filters[i].options);
+    return ok && out_pos == b->out + b->out_len;
+}
+
+// Structure passed to each block decoding thread
+typedef struct {
+    XzJob *job; // Shared block list
+    lzma_check check; // Integrity check type of the stream
+} XzWorker;
+
+// Function run by each block decoding thread: claim blocks until none are left
+void *xz_block_worker(void *arg) {
+    XzWorker *xw = arg;
+    XzJob *job = xw->job;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count || job->failed) break;
+        if (decode_cancelled()) {
+            log_error("LZMA decompression cancelled by a stop signal");
+            job->failed = 1;
+        } else if (!decode_xz_block(job->in, &job->blocks[i], xw->check, job->out)) {
+            job->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+// Function to decode a multi-block .xz payload by decoding its blocks in parallel, each directly
+// into its place in out (the stream index gives every block's offsets).
+// Returns -1 if the payload is not a single multi-block xz stream matching out_len, so that the
+// sequential decoder handles it (and reports any error); otherwise 1 on success and 0 on failure.
+int decode_xz_parallel(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    int threads = xz_threads > 0 ? xz_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+    if (threads < 2 || in_len < 2 * LZMA_STREAM_HEADER_SIZE) return -1;
+
+    // Read the stream header and footer; trailing stream padding or further streams fall back
+    lzma_stream_flags header, footer;
+    if (lzma_stream_header_decode(&header, in) != LZMA_OK ||
+        lzma_stream_footer_decode(&footer, &in[in_len - LZMA_STREAM_HEADER_SIZE]) != LZMA_OK ||
+        lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+        footer.backward_size > in_len - 2 * LZMA_STREAM_HEADER_SIZE)
+        return -1;
+    size_t index_pos = in_len - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+    lzma_index *index = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t pos = index_pos;
+    if (lzma_index_buffer_decode(&index, &memlimit, NULL, in, &pos, in_len - LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+        return -1;
+    lzma_vli block_count = lzma_index_block_count(index);
+    if (block_count < 2 || block_count > MAX_XZ_BLOCKS || lzma_index_stream_size(index) != in_len ||
+        lzma_index_uncompressed_size(index) != out_len) {
+        lzma_index_end(index, NULL);
+        return -1;
+    }
+
+    XzBlock *blocks = mem_alloc(MEM_CODEC_LZMA, block_count * sizeof(XzBlock));
+    if (!blocks) {
+        lzma_index_end(index, NULL);
+        return -1;
+    }
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+    size_t n = 0;
+    while (n < block_count && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        blocks[n++] = (XzBlock){iter.block.compressed_file_offset, iter.block.unpadded_size,
+                                iter.block.uncompressed_file_offset, iter.block.uncompressed_size};
+    }
+    lzma_index_end(index, NULL);
+
+    XzJob job = {in, out, blocks, n, 0, 0};
+    XzWorker xw = {&job, header.check};
+    if ((size_t)threads > n) threads = n;
+    pthread_t tids[MAX_WORKERS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, xz_block_worker, &xw) != 0) break;
+    }
+    xz_block_worker(&xw); // The calling worker decodes blocks too
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    mem_free(MEM_CODEC_LZMA, blocks);
+    if (job.failed) log_error("LZMA decompression failed: corrupt block");
+    return !job.failed;
+}
+
+// Function to decode an LZMA (.xz or .lzma) entry into out, reusing the worker's decoder.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+int decode_lzma(Worker *w, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    // Multi-block .xz streams decode their blocks in parallel
+    int parallel = decode_xz_parallel(in, in_len, out, out_len);
+    if (parallel >= 0) return parallel;
+
+    lzma_stream *xz = &w->xz;
+    // Reinitializing the same stream lets liblzma keep its dictionary allocation
+    if (lzma_auto_decoder(xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        log_error("LZMA decompression failed: cannot initialize");
+        return 0;
+    }
+    xz->next_in = in;
+    xz->avail_in = in_len;
+    xz->next_out = out;
+    uint8_t *out_end = out + out_len + 1;
+    lzma_ret ret;
+    do {
+        // Decode DECODE_SLICE bytes at a time so a drain can cancel the entry
+        size_t left = out_end - xz->next_out;
+        xz->avail_out = left < DECODE_SLICE ? left : DECODE_SLICE;
+        ret = lzma_code(xz, LZMA_FINISH);
+        if (ret == LZMA_OK && decode_cancelled()) {
+            log_error("LZMA decompression cancelled by a stop signal");
+            return 0;
+        }
+    } while (ret == LZMA_OK && xz->next_out < out_end);
+    if (ret != LZMA_STREAM_END) {
+        if (xz->next_out == out_end) log_error("LZMA decompressed size mismatch");
+        else log_error("LZMA decompression failed: error %d", ret);
+        return 0;
+    }
+    if (xz->total_out != out_len) {
+        log_error("LZMA decompressed size mismatch");
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+// Function to decode a BROTLI entry into out.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+int decode_brotli(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    BrotliDecoderState *state = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    if (!state) {
+        log_error("Brotli decompression failed: cannot initialize");
+        return 0;
+    }
+    const uint8_t *next_in = in;
+    size_t avail_in = in_len;
+    uint8_t *next_out = out, *out_end = out + out_len + 1;
+    BrotliDecoderResult ret;
+    do {
+        // Decode DECODE_SLICE bytes at a time so a drain can cancel the entry
+        size_t left = out_end - next_out;
+        size_t avail_out = left < DECODE_SLICE ? left : DECODE_SLICE;
+        ret = BrotliDecoderDecompressStream(state, &avail_in, &next_in, &avail_out, &next_out, NULL);
+        if (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT && decode_cancelled()) {
+            log_error("Brotli decompression cancelled by a stop signal");
+            BrotliDecoderDestroyInstance(state);
+            return 0;
+        }
+    } while (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT && next_out < out_end);
+    int ok = 0;
+    if (ret == BROTLI_DECODER_RESULT_ERROR)
+        log_error("Brotli decompression failed: %s", BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state)));
+    else if (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) log_error("Brotli decompression failed: truncated data");
+    else if (ret != BROTLI_DECODER_RESULT_SUCCESS || (size_t)(next_out - out) != out_len) log_error("Brotli decompressed size mismatch");
+    else if (avail_in != 0) log_error("Brotli decompression failed: data after the end of the stream");
+    else ok = 1;
+    BrotliDecoderDestroyInstance(state);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_BZIP2
+// Structure describing one block of a bzip2 payload
+typedef struct {
+    uint64_t start; // Bit offset of the block's magic in the payload
+    uint64_t end; // Bit offset of the next block's magic or of the stream's end marker
+    uint32_t crc; // CRC of the block's data, stored after its magic
+    uint8_t level; // Block size digit of the stream the block belongs to ('1' to '9')
+    uint8_t *data; // Decoded data, until it is copied into place (NULL once it is)
+    size_t len; // Bytes in data
+    int done; // 1 once the block is decoded (and data holds its output)
+} Bzip2Block;
+
+// Structure holding the blocks of a bzip2 payload shared by the block decoding threads. A block's
+// decoded size is only known once it is decoded, so each block is decoded into its own buffer and
+// copied into out as soon as every block before it is in place.
+typedef struct {
+    const uint8_t *in; // The bzip2 payload
+    size_t in_len; // Size of the payload
+    uint8_t *out; // Output buffer
+    size_t out_len; // Expected decoded size
+    Bzip2Block *blocks; // Blocks, in stream order
+    size_t count; // Number of blocks
+    size_t next; // Next block to claim
+    size_t placed; // Blocks copied into out so far
+    size_t out_pos; // Bytes of out filled by those blocks
+    int failed; // Set if any block fails to decode or the sizes do not add up
+    pthread_mutex_t lock; // Guards the done flags, placed and out_pos
+} Bzip2Job;
+
+// Function to read 64 bits of a payload starting at a byte offset, big-endian, padding past its end with zeros
+uint64_t bzip2_window(const uint8_t *in, size_t len, size_t pos) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8; i++) v = v << 8 | (pos + i < len ? in[pos + i] : 0);
+    return v;
+}
+
+// Function to read n (at most 56) bits of a payload starting at a bit offset
+uint64_t bzip2_bits(const uint8_t *in, size_t len, uint64_t bit, int n) {
+    return bzip2_window(in, len, bit / 8) << (bit % 8) >> (64 - n);
+}
+
+// Function to find the next block magic or end marker at or after a bit offset.
+// Returns its bit offset (end_marker tells which it is), or UINT64_MAX if there is none.
+uint64_t bzip2_next_marker(const uint8_t *in, size_t len, uint64_t from, int *end_marker) {
+    // Whatever a marker's bit offset within its first byte, its bits cover the third byte of the window,
+    // so a table of the shifts each value of that byte allows rules out most positions with one lookup
+    uint8_t shifts[256] = {0};
+    for (int shift = 0; shift < 8; shift++) {
+        shifts[BZIP2_BLOCK_MAGIC >> (24 + shift) & 0xFF] |= 1 << shift;
+        shifts[BZIP2_END_MAGIC >> (24 + shift) & 0xFF] |= 1 << shift;
+    }
+    // The window slides a byte at a time
+    uint64_t w = bzip2_window(in, len, from / 8);
+    for (size_t pos = from / 8; pos + 6 <= len; pos++) {
+        unsigned candidates = shifts[w >> 40 & 0xFF];
+        if (pos == from / 8) candidates &= 0xFF << (from % 8);
+        for (int shift = 0; candidates; shift++, candidates >>= 1) {
+            uint64_t v = w << shift >> 16;
+            if ((candidates & 1) && (v == BZIP2_BLOCK_MAGIC || v == BZIP2_END_MAGIC)) {
+                *end_marker = v == BZIP2_END_MAGIC;
+                return (uint64_t)pos * 8 + shift;
+            }
+        }
+        w = w << 8 | (pos + 8 < len ? in[pos + 8] : 0);
+    }
+    return UINT64_MAX;
+}
+
+// Function to list the blocks of a (possibly multi-stream) bzip2 payload. The markers are found by
+// scanning for their bit patterns, so compressed data that happens to contain one splits a block in
+// two; decoding such a block fails its CRC check and the caller falls back to the sequential decoder.
+// Returns the number of blocks, or 0 if the payload does not parse.
+size_t find_bzip2_blocks(const uint8_t *in, size_t len, Bzip2Block **blocks_out) {
+    Bzip2Block *blocks = NULL;
+    size_t count = 0, capacity = 0, pos = 0;
+    while (pos < len) {
+        if (len - pos < 4 || memcmp(&in[pos], "BZh", 3) != 0 || in[pos + 3] < '1' || in[pos + 3] > '9') break;
+        uint8_t level = in[pos + 3];
+        uint32_t combined = 0;
+        uint64_t bit = (uint64_t)(pos + 4) * 8;
+        int end_marker = 0;
+        uint64_t at = bzip2_next_marker(in, len, bit, &end_marker);
+        if (at != bit) break; // The first block (or the end of an empty stream) follows the header directly
+        while (!end_marker) {
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                Bzip2Block *grown = capacity <= MAX_XZ_BLOCKS ? mem_realloc(MEM_CODEC_BZIP2, blocks, capacity * sizeof(Bzip2Block)) : NULL;
+                if (!grown) {
+                    mem_free(MEM_CODEC_BZIP2, blocks);
+                    return 0;
+                }
+                blocks = grown;
+            }
+            Bzip2Block *b = &blocks[count++];
+            memset(b, 0, sizeof(*b));
+            b->start = at;
+            b->level = level;
+            b->crc = bzip2_bits(in, len, at + 48, 32);
+            combined = (combined << 1 | combined >> 31) ^ b->crc;
+            at = bzip2_next_marker(in, len, at + 80, &end_marker);
+            if (at == UINT64_MAX) {
+                mem_free(MEM_CODEC_BZIP2, blocks);
+                return 0;
+            }
+            b->end = at;
+        }
+        // The end marker carries the CRC combined over the stream's blocks; the stream ends on a byte boundary
+        if (at + 80 > (uint64_t)len * 8 || bzip2_bits(in, len, at + 48, 32) != combined) {
+            mem_free(MEM_CODEC_BZIP2, blocks);
+            return 0;
+        }
+        pos = (at + 80 + 7) / 8;
+    }
+    if (pos != len) count = 0; // Trailing data is left to the sequential decoder to report
+    if (count == 0) mem_free(MEM_CODEC_BZIP2, blocks);
+    else *blocks_out = blocks;
+    return count;
+}
+
+// Function to decode one bzip2 block on its own: its bits are copied, byte-aligned, into a stream of
+// their own between a stream header and an end marker whose combined CRC is the block's CRC
+int decode_bzip2_block(const uint8_t *in, size_t in_len, Bzip2Block *b) {
+    uint64_t bits = b->end - b->start;
+    size_t body = (bits + 7) / 8, stream_len = 4 + (bits + 80 + 7) / 8;
+    uint8_t *stream = mem_alloc(MEM_CODEC_BZIP2, stream_len + 1);
+    if (!stream) return 0;
+    memcpy(stream, "BZh", 3);
+    stream[3] = b->level;
+    size_t from = b->start / 8;
+    int shift = b->start % 8;
+    for (size_t i = 0; i < body; i++) {
+        uint8_t hi = from + i < in_len ? in[from + i] : 0, lo = from + i + 1 < in_len ? in[from + i + 1] : 0;
+        stream[4 + i] = shift ? (uint8_t)(hi << shift | lo >> (8 - shift)) : hi;
+    }
+    if (bits % 8) stream[4 + body - 1] &= 0xFF << (8 - bits % 8); // Bits past the block belong to the next marker
+    memset(&stream[4 + body], 0, stream_len + 1 - 4 - body);
+    // Append the end marker and CRC (80 bits) right after the block's last bit
+    uint64_t trailer[2] = {BZIP2_END_MAGIC, b->crc};
+    int widths[2] = {48, 32};
+    uint64_t bit = 32 + bits;
+    for (int t = 0; t < 2; t++)
+        for (int k = widths[t] - 1; k >= 0; k--, bit++)
+            if (trailer[t] >> k & 1) stream[bit / 8] |= 0x80 >> (bit % 8);
+
+    // A block holds at most level * 100 kB before the initial run-length coding, which can grow it
+    size_t cap = (size_t)(b->level - '0') * 100000 + (1 << 16);
+    b->data = mem_alloc(MEM_CODEC_BZIP2, cap);
+    bz_stream bz;
+    memset(&bz, 0, sizeof(bz));
+    int ok = b->data && BZ2_bzDecompressInit(&bz, 0, 0) == BZ_OK, ret = BZ_OK;
+    if (ok) {
+        bz.next_in = (char *)stream;
+        bz.avail_in = stream_len;
+        while (ok) {
+            bz.next_out = (char *)&b->data[b->len];
+            bz.avail_out = cap - b->len;
+            ret = BZ2_bzDecompress(&bz);
+            b->len = cap - bz.avail_out;
+            if (ret != BZ_OK || b->len < cap) break;
+            uint8_t *grown = mem_realloc(MEM_CODEC_BZIP2, b->data, cap * 2);
+            if (!grown) ok = 0;
+            else b->data = grown, cap *= 2;
+        }
+        BZ2_bzDecompressEnd(&bz);
+    }
+    mem_free(MEM_CODEC_BZIP2, stream);
+    return ok && ret == BZ_STREAM_END;
+}
+
+// Function run by each block decoding thread: claim blocks until none are left, and copy every
+// block whose predecessors are all in place into out
+void *bzip2_block_worker(void *arg) {
+    Bzip2Job *job = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count || job->failed) break;
+        Bzip2Block *b = &job->blocks[i];
+        int ok = !decode_cancelled() && decode_bzip2_block(job->in, job->in_len, b);
+        pthread_mutex_lock(&job->lock);
+        b->done = 1;
+        if (!ok) job->failed = 1;
+        while (!job->failed && job->placed < job->count && job->blocks[job->placed].done) {
+            Bzip2Block *p = &job->blocks[job->placed++];
+            if (p->len > job->out_len - job->out_pos) job->failed = 1;
+            else memcpy(&job->out[job->out_pos], p->data, p->len);
+            job->out_pos += p->len;
+            mem_free(MEM_CODEC_BZIP2, p->data);
+            p->data = NULL;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// Function to decode a bzip2 payload of several blocks by decoding its blocks in parallel.
+// Returns -1 if the payload has a single block or does not split cleanly into blocks that decode
+// to out_len bytes, so that the sequential decoder handles it (and reports any error); otherwise 1.
+int decode_bzip2_parallel(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    if (xz_threads == 1) return -1;
+    Bzip2Block *blocks = NULL;
+    size_t count = find_bzip2_blocks(in, in_len, &blocks);
+    int threads = count < 2 ? 0 : xz_threads > 0 ? xz_threads : (int)sysconf(_SC_NPROCESSORS_ONLN); // Only asked when needed
+    if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+    if (threads < 2) {
+        mem_free(MEM_CODEC_BZIP2, blocks);
+        return -1;
+    }
+    Bzip2Job job = {in, in_len, out, out_len, blocks, count, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    if ((size_t)threads > count) threads = count;
+    pthread_t tids[MAX_WORKERS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, bzip2_block_worker, &job) != 0) break;
+    }
+    bzip2_block_worker(&job); // The calling worker decodes blocks too
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    for (size_t i = 0; i < count; i++) mem_free(MEM_CODEC_BZIP2, blocks[i].data); // Left over after a failure
+    mem_free(MEM_CODEC_BZIP2, blocks);
+    pthread_mutex_destroy(&job.lock);
+    if (decode_cancelled()) {
+        log_error("Bzip2 decompression cancelled by a stop signal");
+        return 0;
+    }
+    return job.failed || job.out_pos != out_len ? -1 : 1;
+}
+
+// Function to decode a BZIP2 entry (one or more concatenated streams) into out.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+int decode_bzip2(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    // Payloads of several blocks decode their blocks in parallel
+    int parallel = decode_bzip2_parallel(in, in_len, out, out_len);
+    if (parallel >= 0) return parallel;
+
+    // avail_in/avail_out are 32-bit, so large entries are fed in chunks; output goes out in
+    // DECODE_SLICE pieces so a drain can cancel the entry
+    size_t in_pos = 0, out_pos = 0, out_cap = out_len + 1;
+    int ret = BZ_OK;
+    do {
+        bz_stream bz;
+        memset(&bz, 0, sizeof(bz));
+        if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+            log_error("Bzip2 decompression failed: cannot initialize");
+            return 0;
+        }
+        do {
+            unsigned int in_chunk = in_len - in_pos > UINT_MAX ? UINT_MAX : in_len - in_pos;
+            unsigned int out_chunk = out_cap - out_pos > DECODE_SLICE ? DECODE_SLICE : out_cap - out_pos;
+            bz.next_in = (char *)&in[in_pos];
+            bz.avail_in = in_chunk;
+            bz.next_out = (char *)&out[out_pos];
+            bz.avail_out = out_chunk;
+            ret = BZ2_bzDecompress(&bz);
+            in_pos += in_chunk - bz.avail_in;
+            out_pos += out_chunk - bz.avail_out;
+            if (ret == BZ_OK && in_chunk == bz.avail_in && out_chunk == bz.avail_out) ret = BZ_UNEXPECTED_EOF; // No progress
+            if (ret == BZ_OK && decode_cancelled()) {
+                log_error("Bzip2 decompression cancelled by a stop signal");
+                BZ2_bzDecompressEnd(&bz);
+                return 0;
+            }
+        } while (ret == BZ_OK);
+        BZ2_bzDecompressEnd(&bz);
+    } while (ret == BZ_STREAM_END && in_pos < in_len); // Concatenated streams, as parallel bzip2 tools write
+
+    if (ret != BZ_STREAM_END) {
+        if (out_pos == out_cap) log_error("Bzip2 decompressed size mismatch");
+        else if (ret == BZ_UNEXPECTED_EOF) log_error("Bzip2 decompression failed: truncated data");
+        else if (ret == BZ_DATA_ERROR || ret == BZ_DATA_ERROR_MAGIC) log_error("Bzip2 decompression failed: corrupt data");
+        else log_error("Bzip2 decompression failed: error %d", ret);
+        return 0;
+    }
+    if (out_pos != out_len) {
+        log_error("Bzip2 decompressed size mismatch");
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+// Function to parse the filter chain at the start of a FILTERED payload.
+// Returns the length of the descriptor, or 0 if it is malformed.
+size_t parse_filter_chain(const uint8_t *payload, size_t len, FilterChain *chain) {
+    if (len < 2 || payload[0] > LZMA || payload[1] == 0 || payload[1] > FILTER_MAX || len < 2 + 2 * (size_t)payload[1])
+        return 0;
+    chain->inner = payload[0];
+    chain->count = payload[1];
+    for (int i = 0; i < chain->count; i++) {
+        chain->ids[i] = payload[2 + 2 * i];
+        chain->params[i] = payload[3 + 2 * i];
+        int ok = chain->ids[i] == FILTER_DELTA ? chain->params[i] >= 1
+               : chain->ids[i] == FILTER_SHUFFLE || chain->ids[i] == FILTER_BITSHUFFLE ? chain->params[i] >= 2
+               : chain->ids[i] == FILTER_BCJ_X86;
+        if (!ok) return 0;
+    }
+    return 2 + 2 * chain->count;
+}
+
+// Function to parse a --filter list such as "delta:4,shuffle:8" or "bcj" into a chain.
+// Delta takes a distance (default 1), shuffle and bitshuffle an element size (default 4).
+int parse_filter_spec(const char *spec, FilterChain *chain) {
+    char buf[MAX_LINE];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    chain->count = 0;
+    for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (chain->count == FILTER_MAX) return 0;
+        char *colon = strchr(tok, ':');
+        int param = colon ? atoi(colon + 1) : -1;
+        if (colon) *colon = '\0';
+        int i = chain->count++;
+        if (strcmp(tok, "delta") == 0) chain->ids[i] = FILTER_DELTA, param = param < 0 ? 1 : param;
+        else if (strcmp(tok, "shuffle") == 0) chain->ids[i] = FILTER_SHUFFLE, param = param < 0 ? 4 : param;
+        else if (strcmp(tok, "bitshuffle") == 0) chain->ids[i] = FILTER_BITSHUFFLE, param = param < 0 ? 4 : param;
+        else if (strcmp(tok, "bcj") == 0 && !colon) chain->ids[i] = FILTER_BCJ_X86, param = 0;
+        else return 0;
+        if (param > 255 || (chain->ids[i] == FILTER_DELTA && param < 1) ||
+            (chain->ids[i] != FILTER_DELTA && chain->ids[i] != FILTER_BCJ_X86 && param < 2))
+            return 0;
+        chain->params[i] = param;
+    }
+    return chain->count > 0;
+}
+
+// Function to write the descriptor of a filter chain, returning its length
+size_t write_filter_chain(const FilterChain *chain, uint8_t *out) {
+    out[0] = chain->inner;
+    out[1] = chain->count;
+    for (int i = 0; i < chain->count; i++) {
+        out[2 + 2 * i] = chain->ids[i];
+        out[3 + 2 * i] = chain->params[i];
+    }
+    return 2 + 2 * chain->count;
+}
+
+#ifdef HAVE_AVX2_KERNELS
+// Function to shift a vector left by s bytes (1, 2, 4, 8 or 16) across its two lanes
+__attribute__((target("avx2"))) static inline __m256i shift_bytes_avx2(__m256i v, size_t s) {
+    __m256i low = _mm256_permute2x128_si256(v, v, 0x08); // Zero, then the low lane
+    switch (s) {
+        case 1: return _mm256_alignr_epi8(v, low, 15);
+        case 2: return _mm256_alignr_epi8(v, low, 14);
+        case 4: return _mm256_alignr_epi8(v, low, 12);
+        case 8: return _mm256_alignr_epi8(v, low, 8);
+        default: return low;
+    }
+}
+
+// Function to undo a delta filter 32 bytes at a time, from offset dist. Distances of 32 or more
+// add whole vectors; 1, 2, 4, 8 and 16 take a prefix sum in the register plus the carried bytes.
+// Returns the offset reached; the caller finishes the rest.
+__attribute__((target("avx2"))) size_t undelta_avx2(uint8_t *buf, size_t len, size_t dist) {
+    size_t i = dist;
+    if (dist >= 32) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&buf[i]);
+            __m256i prev = _mm256_loadu_si256((const __m256i *)&buf[i - dist]);
+            _mm256_storeu_si256((__m256i *)&buf[i], _mm256_add_epi8(v, prev));
+        }
+    } else if ((dist & (dist - 1)) == 0) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&buf[i]);
+            for (size_t s = dist; s < 32; s *= 2) v = _mm256_add_epi8(v, shift_bytes_avx2(v, s));
+            // The last dist bytes decoded so far, repeated across the vector
+            __m256i carry;
+            uint16_t c16;
+            uint32_t c32;
+            uint64_t c64;
+            switch (dist) {
+                case 1: carry = _mm256_set1_epi8(buf[i - 1]); break;
+                case 2: memcpy(&c16, &buf[i - 2], 2); carry = _mm256_set1_epi16(c16); break;
+                case 4: memcpy(&c32, &buf[i - 4], 4); carry = _mm256_set1_epi32(c32); break;
+                case 8: memcpy(&c64, &buf[i - 8], 8); carry = _mm256_set1_epi64x(c64); break;
+                default: carry = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&buf[i - 16])); break;
+            }
+            _mm256_storeu_si256((__m256i *)&buf[i], _mm256_add_epi8(v, carry));
+        }
+    }
+    return i;
+}
+
+// Function to undo a byte shuffle of 2-, 4- or 8-byte elements, 32 elements at a time.
+// Returns the number of elements done; the caller finishes the rest.
+__attribute__((target("avx2"))) size_t unshuffle_avx2(const uint8_t *src, uint8_t *dst, size_t n, size_t size) {
+    size_t i = 0;
+    if (size == 2) {
+        for (; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&src[i]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&src[n + i]);
+            __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+            _mm256_storeu_si256((__m256i *)&dst[2 * i], _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *)&dst[2 * i + 32], _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    } else if (size == 4) {
+        for (; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&src[i]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&src[n + i]);
+            __m256i c = _mm256_loadu_si256((const __m256i *)&src[2 * n + i]);
+            __m256i d = _mm256_loadu_si256((const __m256i *)&src[3 * n + i]);
+            __m256i ab_lo = _mm256_unpacklo_epi8(a, b), ab_hi = _mm256_unpackhi_epi8(a, b);
+            __m256i cd_lo = _mm256_unpacklo_epi8(c, d), cd_hi = _mm256_unpackhi_epi8(c, d);
+            // Elements 0-3 and 16-19, 4-7 and 20-23, 8-11 and 24-27, 12-15 and 28-31
+            __m256i x0 = _mm256_unpacklo_epi16(ab_lo, cd_lo), x1 = _mm256_unpackhi_epi16(ab_lo, cd_lo);
+            __m256i x2 = _mm256_unpacklo_epi16(ab_hi, cd_hi), x3 = _mm256_unpackhi_epi16(ab_hi, cd_hi);
+            _mm256_storeu_si256((__m256i *)&dst[4 * i], _mm256_permute2x128_si256(x0, x1, 0x20));
+            _mm256_storeu_si256((__m256i *)&dst[4 * i + 32], _mm256_permute2x128_si256(x2, x3, 0x20));
+            _mm256_storeu_si256((__m256i *)&dst[4 * i + 64], _mm256_permute2x128_si256(x0, x1, 0x31));
+            _mm256_storeu_si256((__m256i *)&dst[4 * i + 96], _mm256_permute2x128_si256(x2, x3, 0x31));
+        }
+    } else if (size == 8) {
+        // Each plane holds byte j of the 32 elements as 8 dwords of 4 elements; transposing the
+        // 8x8 dwords gathers the 8 bytes of 4 elements in one vector
+        const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                                0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        const __m256i halves = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for (; i + 32 <= n; i += 32) {
+            __m256i r[8], t[8], u[8];
+            for (int j = 0; j < 8; j++) r[j] = _mm256_loadu_si256((const __m256i *)&src[j * n + i]);
+            for (int j = 0; j < 8; j += 2) {
+                t[j] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+                t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+            }
+            for (int j = 0; j < 8; j += 4) {
+                u[j] = _mm256_unpacklo_epi64(t[j], t[j + 2]);
+                u[j + 1] = _mm256_unpackhi_epi64(t[j], t[j + 2]);
+                u[j + 2] = _mm256_unpacklo_epi64(t[j + 1], t[j + 3]);
+                u[j + 3] = _mm256_unpackhi_epi64(t[j + 1], t[j + 3]);
+            }
+            for (int k = 0; k < 4; k++) {
+                __m256i lo = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20); // Elements 4k to 4k+3
+                __m256i hi = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31); // Elements 4k+16 to 4k+19
+                lo = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(lo, gather), halves);
+                hi = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(hi, gather), halves);
+                _mm256_storeu_si256((__m256i *)&dst[8 * (i + 4 * k)], lo);
+                _mm256_storeu_si256((__m256i *)&dst[8 * (i + 4 * k + 16)], hi);
+            }
+        }
+    }
+    return i;
+}
+
+// Function to turn the 8 bit rows of a byte plane back into its bytes, 32 bytes at a time.
+// Returns the number of bytes done; the caller finishes the rest.
+__attribute__((target("avx2"))) size_t unbitrows_avx2(const uint8_t *rows, size_t row_len, uint8_t *plane, size_t n) {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bit = _mm256_set1_epi64x(0x8040201008040201ULL);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int k = 0; k < 8; k++) {
+            uint32_t word;
+            memcpy(&word, &rows[k * row_len + i / 8], 4);
+            // Byte b of the vector becomes all ones if bit b of the word is set
+            __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+            v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit);
+            acc = _mm256_or_si256(acc, _mm256_and_si256(v, _mm256_set1_epi8(1 << k)));
+        }
+        _mm256_storeu_si256((__m256i *)&plane[i], acc);
+    }
+    return i;
+}
+
+// Function to find the next E8 or E9 byte from i, 32 bytes at a time (len if there is none)
+__attribute__((target("avx2"))) size_t bcj_scan_avx2(const uint8_t *buf, size_t i, size_t len) {
+    const __m256i mask = _mm256_set1_epi8((char)0xfe), call = _mm256_set1_epi8((char)0xe8);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&buf[i]), mask);
+        uint32_t hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, call));
+        if (hits) return i + __builtin_ctz(hits);
+    }
+    while (i < len && (buf[i] & 0xfe) != 0xe8) i++;
+    return i;
+}
+#endif
+
+// Function to check whether the AVX2 kernels may run
+static inline int use_avx2(void) {
+#ifdef HAVE_AVX2_KERNELS
+    return simd_kernels && __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+// Function to apply a delta filter in place: each byte becomes its difference from the byte dist before
+void delta_encode(uint8_t *buf, size_t len, size_t dist) {
+    for (size_t i = len; i-- > dist;) buf[i] -= buf[i - dist];
+}
+
+// Function to undo a delta filter in place
+void delta_decode(uint8_t *buf, size_t len, size_t dist) {
+    size_t i = dist;
+#ifdef HAVE_AVX2_KERNELS
+    if (use_avx2()) i = undelta_avx2(buf, len, dist);
+#endif
+    for (; i < len; i++) buf[i] += buf[i - dist];
+}
+
+// Function to byte-shuffle n elements of size bytes: byte j of every element goes to plane j
+void shuffle_encode(const uint8_t *src, uint8_t *dst, size_t n, size_t size) {
+    for (size_t j = 0; j < size; j++)
+        for (size_t i = 0; i < n; i++) dst[j * n + i] = src[i * size + j];
+}
+
+// Function to undo a byte shuffle of n elements of size bytes
+void shuffle_decode(const uint8_t *src, uint8_t *dst, size_t n, size_t size) {
+    size_t done = 0;
+#ifdef HAVE_AVX2_KERNELS
+    if ((size == 2 || size == 4 || size == 8) && use_avx2()) done = unshuffle_avx2(src, dst, n, size);
+#endif
+    for (size_t j = 0; j < size; j++)
+        for (size_t i = done; i < n; i++) dst[i * size + j] = src[j * n + i];
+}
+
+// Function to bit-shuffle a buffer of size-byte elements in place, using tmp: the elements are
+// byte-shuffled, then each byte plane is split into 8 rows holding one bit of every element.
+// Only a multiple of 8 elements is shuffled; the bytes after them are left as they are.
+void bitshuffle_encode(uint8_t *buf, uint8_t *tmp, size_t len, size_t size) {
+    size_t n = len / size & ~(size_t)7, row_len = n / 8;
+    shuffle_encode(buf, tmp, n, size);
+    for (size_t j = 0; j < size; j++) {
+        const uint8_t *plane = &tmp[j * n];
+        for (int k = 0; k < 8; k++) {
+            uint8_t *row = &buf[(j * 8 + k) * row_len];
+            for (size_t g = 0; g < row_len; g++) {
+                uint8_t bits = 0;
+                for (int m = 0; m < 8; m++) bits |= ((plane[g * 8 + m] >> k) & 1) << m;
+                row[g] = bits;
+            }
+        }
+    }
+}
+
+// Function to undo a bit shuffle in place, using tmp
+void bitshuffle_decode(uint8_t *buf, uint8_t *tmp, size_t len, size_t size) {
+    size_t n = len / size & ~(size_t)7, row_len = n / 8;
+    for (size_t j = 0; j < size; j++) {
+        const uint8_t *rows = &buf[j * 8 * row_len];
+        uint8_t *plane = &tmp[j * n];
+        size_t i = 0;
+#ifdef HAVE_AVX2_KERNELS
+        if (use_avx2()) i = unbitrows_avx2(rows, row_len, plane, n);
+#endif
+        for (; i < n; i++) {
+            uint8_t b = 0;
+            for (int k = 0; k < 8; k++) b |= ((rows[k * row_len + i / 8] >> (i % 8)) & 1) << k;
+            plane[i] = b;
+        }
+    }
+    shuffle_decode(tmp, buf, n, size);
+}
+
+// Function to convert the operands of x86 CALL and JMP rel32 instructions (E8 and E9) between
+// relative and absolute form. Only operands within +-16 MB are converted, and a converted operand
+// stays in that range. An E8 or E9 left alone blocks conversions that would change its operand,
+// so decoding sees the same bytes, and finds the same instructions, as encoding did.
+void bcj_x86(uint8_t *buf, size_t len, int encode) {
+    size_t blocked = 0; // Candidates before this offset overlap the operand of one left alone
+    for (size_t i = 0; i + 5 <= len;) {
+#ifdef HAVE_AVX2_KERNELS
+        if (use_avx2()) {
+            i = bcj_scan_avx2(buf, i, len - 4);
+            if (i + 5 > len) break;
+        }
+#endif
+        if ((buf[i] & 0xfe) != 0xe8) {
+            i++;
+            continue;
+        }
+        uint32_t v = read_uint32(&buf[i + 1], ENDIAN_LITTLE);
+        if (i < blocked || (((v >> 24) + 1) & 0xfe)) { // The top byte must be 0x00 or 0xff
+            blocked = i + 4;
+            i++;
+            continue;
+        }
+        uint32_t pos = (uint32_t)(i + 5);
+        v = encode ? v + pos : v - pos;
+        v = (uint32_t)((int32_t)(v << 7) >> 7); // Sign-extend bit 24 back over the top byte
+        write_uint32(&buf[i + 1], v, ENDIAN_LITTLE);
+        i += 5;
+    }
+}
+
+// Function to count the shuffles of a filter chain, each of which moves the data to the other
+// buffer, and to tell whether undoing the chain needs a scratch buffer at all
+int filter_moves(const FilterChain *chain, int *scratch) {
+    int moves = 0;
+    *scratch = 0;
+    for (int i = 0; i < chain->count; i++) {
+        moves += chain->ids[i] == FILTER_SHUFFLE;
+        *scratch |= chain->ids[i] == FILTER_SHUFFLE || chain->ids[i] == FILTER_BITSHUFFLE;
+    }
+    return moves;
+}
+
+// Function to undo a filter chain on the len decoded bytes at cur, in reverse order.
+// Shuffles move the data between cur and other; returns the buffer holding the result.
+uint8_t *undo_filters(const FilterChain *chain, uint8_t *cur, uint8_t *other, size_t len) {
+    for (int i = chain->count - 1; i >= 0; i--) {
+        size_t param = chain->params[i];
+        switch (chain->ids[i]) {
+            case FILTER_DELTA: delta_decode(cur, len, param); break;
+            case FILTER_BCJ_X86: bcj_x86(cur, len, 0); break;
+            case FILTER_BITSHUFFLE: bitshuffle_decode(cur, other, len, param); break;
+            case FILTER_SHUFFLE: {
+                size_t n = len / param;
+                shuffle_decode(cur, other, n, param);
+                memcpy(&other[n * param], &cur[n * param], len - n * param); // Bytes after the last element
+                uint8_t *swap = cur;
+                cur = other;
+                other = swap;
+                break;
+            }
+        }
+    }
+    return cur;
+}
+
+// Function to decode a FILTERED entry into out: the inner codec first, then the filters in reverse.
+// Shuffles move the data between out and a scratch buffer, so the inner codec decodes into
+// whichever buffer makes the last of them end in out. out must hold orig_size + 1 bytes.
+int decode_filtered(Worker *w, const Entry *e, const uint8_t *payload, uint8_t *out) {
+    FilterChain chain;
+    size_t desc = parse_filter_chain(payload, e->proc_size, &chain);
+    if (!desc) {
+        log_error("Corrupt filter chain");
+        return 0;
+    }
+    int scratch;
+    int moves = filter_moves(&chain, &scratch);
+    size_t len = e->orig_size;
+    uint8_t *tmp = scratch ? pool_get(&w->pool, len + 1, MEM_CODEC_FILTERED) : NULL;
+    if (scratch && !tmp) return 0;
+    uint8_t *cur = moves % 2 ? tmp : out, *other = moves % 2 ? out : tmp;
+
+    const uint8_t *in = payload + desc;
+    size_t in_len = e->proc_size - desc;
+    int ok = 0;
+    if (chain.inner == NO_PROCESSING) {
+        ok = in_len == len;
+        if (ok) memcpy(cur, in, len);
+        else log_error("Data size mismatch for no processing");
+    }
+#ifdef HAVE_ZLIB
+    if (chain.inner == ZLIB) ok = decode_zlib(w, in, in_len, cur, len, NULL);
+#endif
+#ifdef HAVE_LZMA
+    if (chain.inner == LZMA) ok = decode_lzma(w, in, in_len, cur, len);
+#endif
+    if (ok) undo_filters(&chain, cur, other, len);
+    if (tmp) pool_put(&w->pool, tmp, len + 1, MEM_CODEC_FILTERED);
+    return ok;
+}
+
+// Function to parse the stage list at the start of a CHAIN payload.
+// Returns the length of the descriptor, or 0 if it is malformed.
+size_t parse_method_chain(const uint8_t *payload, size_t len, MethodChain *chain) {
+    if (len < 1 || payload[0] < 2 || payload[0] > CHAIN_MAX || len < 1 + (size_t)payload[0]) return 0;
+    chain->count = payload[0];
+    for (int i = 0; i < chain->count; i++) {
+        chain->stages[i] = payload[1 + i];
+        int last = i == chain->count - 1;
+        if (chain->stages[i] != ZLIB && chain->stages[i] != LZMA && chain->stages[i] != FERNET &&
+            !(last && chain->stages[i] == FILTERED))
+            return 0;
+    }
+    return 1 + chain->count;
+}
+
+// Function to write the descriptor of a method chain; returns its length
+size_t write_method_chain(const MethodChain *chain, uint8_t *out) {
+    out[0] = chain->count;
+    for (int i = 0; i < chain->count; i++) out[1 + i] = chain->stages[i];
+    return 1 + chain->count;
+}
+
+// Function to parse a --method list such as "lzma" or "zlib,fernet", in the order the methods are
+// applied when encoding. A list of several methods fills chain, innermost stage last; brotli and
+// bzip2 are accepted on their own only, since chain stages are decoded by streaming steps.
+int parse_method_spec(const char *spec, Method *method, MethodChain *chain) {
+    char buf[MAX_LINE];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    Method listed[CHAIN_MAX];
+    int count = 0;
+    for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (count == CHAIN_MAX) return 0;
+        if (strcmp(tok, "none") == 0) listed[count++] = NO_PROCESSING;
+        else if (strcmp(tok, "zlib") == 0) listed[count++] = ZLIB;
+        else if (strcmp(tok, "lzma") == 0) listed[count++] = LZMA;
+        else if (strcmp(tok, "fernet") == 0) listed[count++] = FERNET;
+        else if (strcmp(tok, "brotli") == 0) listed[count++] = BROTLI;
+        else if (strcmp(tok, "bzip2") == 0) listed[count++] = BZIP2;
+        else return 0;
+    }
+    if (count == 0) return 0;
+    chain->count = 0;
+    if (count == 1) {
+        *method = listed[0];
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (listed[i] == NO_PROCESSING) return 0; // A stored stage would only copy the data
+        if (listed[i] == BROTLI || listed[i] == BZIP2) return 0;
+        chain->stages[count - 1 - i] = listed[i];
+    }
+    chain->count = count;
+    *method = CHAIN;
+    return 1;
+}
+
+#ifdef HAVE_OPENSSL
+// Table mapping each byte to its value as a base64url character (-1 if it is not one)
+const int8_t base64url_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// Function to decode base64url characters, carrying an incomplete group over to the next call.
+// Returns the number of bytes written to out (3 per 4 characters), or -1 on an invalid character.
+ssize_t fernet_unbase64(FernetStream *f, const uint8_t *in, size_t len, uint8_t *out) {
+    size_t n = 0, i = 0;
+    while (i < len) {
+        if (f->group_len == 0 && !f->padded && i + 4 <= len) {
+            // Whole groups at once; a character with the sign bit set in the OR is '=' or invalid
+            int a = base64url_values[in[i]], b = base64url_values[in[i + 1]];
+            int c = base64url_values[in[i + 2]], d = base64url_values[in[i + 3]];
+            if ((a | b | c | d) >= 0) {
+                out[n++] = a << 2 | b >> 4;
+                out[n++] = b << 4 | c >> 2;
+                out[n++] = c << 6 | d;
+                i += 4;
+                continue;
+            }
+        }
+        if (in[i] == '=') {
+            f->padded = 1;
+            i++;
+            continue;
+        }
+        int v = base64url_values[in[i++]];
+        if (v < 0 || f->padded) return -1; // Nothing but padding may follow padding
+        f->group[f->group_len++] = v;
+        if (f->group_len == 4) {
+            out[n++] = f->group[0] << 2 | f->group[1] >> 4;
+            out[n++] = f->group[1] << 4 | f->group[2] >> 2;
+            out[n++] = f->group[2] << 6 | f->group[3];
+            f->group_len = 0;
+        }
+    }
+    return n;
+}
+
+// Function to decode the incomplete group left at the end of base64url characters.
+// Returns the number of bytes written to out (at most 2), or -1 if a lone character is left.
+int fernet_unbase64_end(FernetStream *f, uint8_t *out) {
+    if (f->group_len == 1) return -1;
+    if (f->group_len == 0) return 0;
+    out[0] = f->group[0] << 2 | f->group[1] >> 4;
+    out[1] = f->group[1] << 4 | (f->group_len == 3 ? f->group[2] >> 2 : 0);
+    return f->group_len - 1;
+}
+
+// Function to start an HMAC-SHA256 keyed with the 16-byte signing half of a Fernet key. It is built
+// from plain digests: setting up an EVP_PKEY HMAC costs more than decrypting a small entry.
+int fernet_mac_init(EVP_MD_CTX *mac, const uint8_t *key) {
+    uint8_t pad[64];
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < 16; i++) pad[i] ^= key[i];
+    return EVP_DigestInit_ex(mac, EVP_sha256(), NULL) == 1 && EVP_DigestUpdate(mac, pad, sizeof(pad)) == 1;
+}
+
+// Function to finish an HMAC-SHA256 started by fernet_mac_init, writing FERNET_MAC bytes to digest
+int fernet_mac_final(EVP_MD_CTX *mac, const uint8_t *key, uint8_t *digest) {
+    uint8_t pad[64], inner[EVP_MAX_MD_SIZE];
+    unsigned int inner_len = 0, len = 0;
+    memset(pad, 0x5c, sizeof(pad));
+    for (int i = 0; i < 16; i++) pad[i] ^= key[i];
+    return EVP_DigestFinal_ex(mac, inner, &inner_len) == 1 && EVP_DigestInit_ex(mac, EVP_sha256(), NULL) == 1 &&
+           EVP_DigestUpdate(mac, pad, sizeof(pad)) == 1 && EVP_DigestUpdate(mac, inner, inner_len) == 1 &&
+           EVP_DigestFinal_ex(mac, digest, &len) == 1 && len == FERNET_MAC;
+}
+
+// Function to set up the HMAC and cipher of a Fernet stage once its 44-character key is read
+int fernet_start(FernetStream *f) {
+    FernetStream key_reader = {0};
+    uint8_t key[33];
+    ssize_t n = fernet_unbase64(&key_reader, (const uint8_t *)f->key_text, FERNET_KEY_LEN, key);
+    if (n != 30 || fernet_unbase64_end(&key_reader, &key[30]) != 2 || !key_reader.padded) { // 43 characters and one '='
+        log_error("Invalid Fernet key");
+        return 0;
+    }
+    memcpy(f->key, key, 32);
+    f->mac = EVP_MD_CTX_new();
+    f->cipher = EVP_CIPHER_CTX_new();
+    if (!f->mac || !f->cipher || !fernet_mac_init(f->mac, f->key)) {
+        log_error("Fernet decryption failed: cannot initialize");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to authenticate and decrypt ciphertext bytes of a Fernet token into the stage's plain buffer
+int fernet_decrypt(ChainStage *st, const uint8_t *data, size_t len) {
+    FernetStream *f = &st->fernet;
+    int n = 0;
+    if (len == 0) return 1;
+    if (EVP_DigestUpdate(f->mac, data, len) != 1 ||
+        EVP_DecryptUpdate(f->cipher, &st->plain[f->plain_len], &n, data, (int)len) != 1) {
+        log_error("Fernet decryption failed: cipher error");
+        return 0;
+    }
+    f->plain_len += n;
+    return 1;
+}
+
+// Function to pass decoded token bytes through a Fernet stage: the header first, then the
+// ciphertext, holding back the last FERNET_MAC bytes seen since they may be the HMAC
+int fernet_feed(ChainStage *st, const uint8_t *raw, size_t len) {
+    FernetStream *f = &st->fernet;
+    if (f->head_len < FERNET_HEAD) {
+        size_t take = len < FERNET_HEAD - f->head_len ? len : FERNET_HEAD - f->head_len;
+        memcpy(&f->head[f->head_len], raw, take);
+        f->head_len += take;
+        raw += take;
+        len -= take;
+        if (f->head_len < FERNET_HEAD) return 1;
+        if (f->head[0] != 0x80) {
+            log_error("Fernet decryption failed: unknown token version");
+            return 0;
+        }
+        // The IV follows the version byte and the 8-byte timestamp
+        if (EVP_DigestUpdate(f->mac, f->head, FERNET_HEAD) != 1 ||
+            EVP_DecryptInit_ex(f->cipher, EVP_aes_128_cbc(), NULL, &f->key[16], &f->head[9]) != 1) {
+            log_error("Fernet decryption failed: cannot initialize");
+            return 0;
+        }
+    }
+    if (f->tail_len + len <= FERNET_MAC) {
+        memcpy(&f->tail[f->tail_len], raw, len);
+        f->tail_len += len;
+        return 1;
+    }
+    // Everything before the last FERNET_MAC bytes is ciphertext: the held-back bytes, then raw
+    size_t emit = f->tail_len + len - FERNET_MAC;
+    size_t from_tail = emit < f->tail_len ? emit : f->tail_len;
+    if (!fernet_decrypt(st, f->tail, from_tail) || !fernet_decrypt(st, raw, emit - from_tail)) return 0;
+    memmove(f->tail, &f->tail[from_tail], f->tail_len - from_tail);
+    f->tail_len -= from_tail;
+    memcpy(&f->tail[f->tail_len], &raw[emit - from_tail], len - (emit - from_tail));
+    f->tail_len = FERNET_MAC;
+    return 1;
+}
+
+// Function to finish a Fernet stage at the end of its input: decode the last base64 group,
+// check the HMAC over the whole token and remove the padding of the last block
+int fernet_finish(ChainStage *st) {
+    FernetStream *f = &st->fernet;
+    uint8_t last[2];
+    int n = fernet_unbase64_end(f, last);
+    if (n < 0) {
+        log_error("Fernet decryption failed: invalid base64");
+        return 0;
+    }
+    if (n > 0 && !fernet_feed(st, last, n)) return 0;
+    if (f->head_len < FERNET_HEAD || f->tail_len < FERNET_MAC) {
+        log_error("Fernet decryption failed: token too short");
+        return 0;
+    }
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    if (!fernet_mac_final(f->mac, f->key, digest) || CRYPTO_memcmp(digest, f->tail, FERNET_MAC) != 0) {
+        log_error("Fernet decryption failed: invalid token");
+        return 0;
+    }
+    int out = 0;
+    if (EVP_DecryptFinal_ex(f->cipher, &st->plain[f->plain_len], &out) != 1) {
+        log_error("Fernet decryption failed: invalid padding");
+        return 0;
+    }
+    f->plain_len += out;
+    f->finished = 1;
+    return 1;
+}
+
+// Function to decrypt the input of a FERNET stage into out: the 44-character key, then the base64
+// token. The ciphertext is authenticated and decrypted as it arrives; the HMAC ending the token is
+// checked when the input ends, so a forged token fails the entry before the stage reports its end.
+ssize_t chain_fernet(ChainStage *st, uint8_t *out, size_t cap) {
+    FernetStream *f = &st->fernet;
+    if (f->plain_pos == f->plain_len) {
+        f->plain_pos = f->plain_len = 0;
+        if (f->finished) {
+            st->done = 1;
+            return 0;
+        }
+        if (f->key_len < FERNET_KEY_LEN) {
+            size_t take = st->in_len < FERNET_KEY_LEN - f->key_len ? st->in_len : FERNET_KEY_LEN - f->key_len;
+            memcpy(&f->key_text[f->key_len], st->in, take);
+            f->key_len += take;
+            st->in += take;
+            st->in_len -= take;
+            if (f->key_len == FERNET_KEY_LEN) return fernet_start(f) ? 0 : -1;
+            if (st->in_end) {
+                log_error("Fernet data too short for key");
+                return -1;
+            }
+            return 0;
+        }
+        if (st->in_len > 0) {
+            // Decoding at most this many characters keeps the bytes within raw, even with a carried group
+            size_t chars = st->in_len < CHAIN_BUFFER / 3 * 4 ? st->in_len : CHAIN_BUFFER / 3 * 4;
+            ssize_t n = fernet_unbase64(f, st->in, chars, st->raw);
+            if (n < 0) {
+                log_error("Fernet decryption failed: invalid base64");
+                return -1;
+            }
+            st->in += chars;
+            st->in_len -= chars;
+            if (!fernet_feed(st, st->raw, n)) return -1;
+        } else if (!fernet_finish(st)) {
+            return -1;
+        }
+    }
+    size_t n = f->plain_len - f->plain_pos < cap ? f->plain_len - f->plain_pos : cap;
+    memcpy(out, &st->plain[f->plain_pos], n);
+    f->plain_pos += n;
+    return n;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+// Function to inflate the input of a ZLIB stage into out
+ssize_t chain_inflate(ChainStage *st, uint8_t *out, size_t cap) {
+    z_stream *zs = &st->zs;
+    uInt in_chunk = st->in_len > UINT_MAX ? UINT_MAX : st->in_len;
+    uInt out_chunk = cap > UINT_MAX ? UINT_MAX : cap;
+    zs->next_in = (Bytef *)st->in;
+    zs->avail_in = in_chunk;
+    zs->next_out = out;
+    zs->avail_out = out_chunk;
+    int ret = inflate(zs, Z_NO_FLUSH);
+    st->in += in_chunk - zs->avail_in;
+    st->in_len -= in_chunk - zs->avail_in;
+    if (ret == Z_STREAM_END) {
+        st->done = 1;
+    } else if (ret == Z_BUF_ERROR && st->in_end) {
+        log_error("Zlib decompression failed: truncated data");
+        return -1;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        log_error("Zlib decompression failed: %s", zs->msg ? zs->msg : "corrupt data");
+        return -1;
+    }
+    return out_chunk - zs->avail_out;
+}
+#endif
+
+#ifdef HAVE_LZMA
+// Function to decode the input of an LZMA stage into out
+ssize_t chain_unxz(ChainStage *st, uint8_t *out, size_t cap) {
+    lzma_stream *xz = &st->xz;
+    xz->next_in = st->in;
+    xz->avail_in = st->in_len;
+    xz->next_out = out;
+    xz->avail_out = cap;
+    lzma_ret ret = lzma_code(xz, st->in_end ? LZMA_FINISH : LZMA_RUN);
+    st->in += st->in_len - xz->avail_in;
+    st->in_len = xz->avail_in;
+    if (ret == LZMA_STREAM_END) {
+        st->done = 1;
+    } else if (ret == LZMA_BUF_ERROR && st->in_end) {
+        log_error("LZMA decompression failed: truncated data");
+        return -1;
+    } else if (ret != LZMA_OK && ret != LZMA_BUF_ERROR) {
+        log_error("LZMA decompression failed: error %d", ret);
+        return -1;
+    }
+    return cap - xz->avail_out;
+}
+#endif
+
+ssize_t chain_read(ChainStage *st, uint8_t *out, size_t cap);
+
+// Function to refill the input of a chain stage from the stage before it once it is used up.
+// Returns 0 if the stage before it failed.
+int chain_input(ChainStage *st) {
+    if (st->in_len > 0 || st->in_end) return 1;
+    if (!st->up) {
+        st->in_end = 1; // The payload is used up
+        return 1;
+    }
+    ssize_t n = chain_read(st->up, st->buf, CHAIN_BUFFER);
+    if (n < 0) return 0;
+    st->in = st->buf;
+    st->in_len = n;
+    st->in_end = n == 0;
+    return 1;
+}
+
+// Function to initialize the codec state of a chain stage before its first input
+int chain_start(ChainStage *st) {
+    st->started = 1;
+    switch (st->method) {
+        case NO_PROCESSING: return 1;
+#ifdef HAVE_ZLIB
+        case ZLIB:
+            if (inflateInit(&st->zs) == Z_OK) return 1;
+            st->started = 0;
+            log_error("Zlib decompression failed: cannot initialize");
+            return 0;
+#endif
+#ifdef HAVE_LZMA
+        case LZMA:
+            if (lzma_auto_decoder(&st->xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK) return 1;
+            log_error("LZMA decompression failed: cannot initialize");
+            return 0;
+#endif
+#ifdef HAVE_OPENSSL
+        case FERNET: return 1; // Set up once the key is read
+#endif
+        default:
+            st->started = 0;
+            log_error("Method %s needs a build with its native codec", method_name(st->method) ? method_name(st->method) : "?");
+            return 0;
+    }
+}
+
+// Function to release the codec state of a chain stage
+void chain_end(ChainStage *st) {
+    if (!st->started) return;
+#ifdef HAVE_ZLIB
+    if (st->method == ZLIB) inflateEnd(&st->zs);
+#endif
+#ifdef HAVE_LZMA
+    if (st->method == LZMA) lzma_end(&st->xz);
+#endif
+#ifdef HAVE_OPENSSL
+    if (st->method == FERNET) {
+        EVP_CIPHER_CTX_free(st->fernet.cipher);
+        EVP_MD_CTX_free(st->fernet.mac);
+    }
+#endif
+}
+
+// Function to pull up to cap decoded bytes from a chain stage.
+// Returns the number of bytes, 0 once the stage has no more output, or -1 on error.
+ssize_t chain_read(ChainStage *st, uint8_t *out, size_t cap) {
+    ssize_t n = 0;
+    while (n == 0 && !st->done) {
+        if (!chain_input(st) || (!st->started && !chain_start(st))) return -1;
+        switch (st->method) {
+            case NO_PROCESSING:
+                n = st->in_len < cap ? st->in_len : cap;
+                memcpy(out, st->in, n);
+                st->in += n;
+                st->in_len -= n;
+                st->done = st->in_end && st->in_len == 0;
+                break;
+#ifdef HAVE_ZLIB
+            case ZLIB: n = chain_inflate(st, out, cap); break;
+#endif
+#ifdef HAVE_LZMA
+            case LZMA: n = chain_unxz(st, out, cap); break;
+#endif
+#ifdef HAVE_OPENSSL
+            case FERNET: n = chain_fernet(st, out, cap); break;
+#endif
+            default: return -1;
+        }
+        if (n < 0) return -1;
+    }
+    return n;
+}
+
+// Function to read the filter descriptor starting the stream of a FILTERED stage, which then
+// decodes the rest of its stream with the inner method
+int chain_read_filters(ChainStage *st) {
+    size_t need = 2;
+    while (st->desc_len < need) {
+        if (!chain_input(st)) return 0;
+        if (st->in_len == 0) break;
+        st->desc[st->desc_len++] = *st->in++;
+        st->in_len--;
+        if (st->desc_len == 2 && st->desc[1] <= FILTER_MAX) need = 2 + 2 * st->desc[1];
+    }
+    if (!parse_filter_chain(st->desc, st->desc_len, &st->filters)) {
+        log_error("Corrupt filter chain");
+        return 0;
+    }
+    st->method = st->filters.inner;
+    return 1;
+}
+
+// Function to decode the stream of a method chain into out. The stages run side by side, each
+// pulling CHAIN_BUFFER bytes at a time from the one before it, so the payload is read once and only
+// the last stage writes a whole buffer; a final FILTERED stage undoes its filters on that buffer.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+int decode_chain(Worker *w, const MethodChain *chain, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    size_t size = chain->count * sizeof(ChainStage);
+    ChainStage *stages = pool_get(&w->pool, size, MEM_CODEC_CHAIN);
+    if (!stages) return 0;
+    for (int i = 0; i < chain->count; i++) {
+        memset(&stages[i], 0, offsetof(ChainStage, buf)); // The buffers need no clearing
+        stages[i].method = chain->stages[i];
+        stages[i].up = i > 0 ? &stages[i - 1] : NULL;
+    }
+    stages[0].in = in;
+    stages[0].in_len = in_len;
+    ChainStage *last = &stages[chain->count - 1];
+
+    // As in decode_filtered, the stages decode into whichever buffer makes the last shuffle end in out
+    int filtered = last->method == FILTERED, ok = !filtered || chain_read_filters(last), scratch = 0, moves = 0;
+    if (ok && filtered) moves = filter_moves(&last->filters, &scratch);
+    uint8_t *tmp = scratch ? pool_get(&w->pool, out_len + 1, MEM_CODEC_FILTERED) : NULL;
+    if (scratch && !tmp) ok = 0;
+    uint8_t *cur = moves % 2 ? tmp : out, *other = moves % 2 ? out : tmp;
+
+    size_t pos = 0;
+    while (ok) {
+        ssize_t n = chain_read(last, &cur[pos], out_len + 1 - pos);
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        pos += n;
+        if (pos > out_len) {
+            log_error("Chain decoded size mismatch");
+            ok = 0;
+        } else if (decode_cancelled()) {
+            log_error("Chain decoding cancelled by a stop signal");
+            ok = 0;
+        }
+    }
+    if (ok && pos != out_len) {
+        log_error("Chain decoded size mismatch");
+        ok = 0;
+    }
+    if (ok && filtered) undo_filters(&last->filters, cur, other, out_len);
+    for (int i = 0; i < chain->count; i++) chain_end(&stages[i]);
+    if (tmp) pool_put(&w->pool, tmp, out_len + 1, MEM_CODEC_FILTERED);
+    pool_put(&w->pool, stages, size, MEM_CODEC_CHAIN);
+    return ok;
+}
+
+// Function to decode a CHAIN entry into out; a FERNET entry is decoded as a chain of one stage
+int decode_chained(Worker *w, const Entry *e, const uint8_t *payload, uint8_t *out) {
+    MethodChain chain = {1, {FERNET}};
+    size_t desc = 0;
+    if (e->method == CHAIN && !(desc = parse_method_chain(payload, e->proc_size, &chain))) {
+        log_error("Corrupt method chain");
+        return 0;
+    }
+    return decode_chain(w, &chain, payload + desc, e->proc_size - desc, out, e->orig_size);
+}
+
+// Function to write an entry's decoded data at its place in the --pack file
+int write_packfile(const Entry *e, const uint8_t *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        size_t chunk = io_chunk(len - done);
+        io_throttle(chunk);
+        ssize_t n = pwrite(packfile_fd, buf + done, chunk, e->pack_offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("Failed to write %s to the pack file: %s", e->filename, strerror(errno));
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Function to copy a decoded temp file to an entry's place in the --pack file
+int copy_to_packfile(const Entry *e, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Failed to open %s", path);
+        return 0;
+    }
+    loff_t out = e->pack_offset;
+    uint64_t left = e->orig_size;
+    while (left > 0) {
+        size_t chunk = io_chunk(left);
+        io_throttle(chunk);
+        ssize_t n = copy_file_range(fd, NULL, packfile_fd, &out, chunk, 0);
+        if (n <= 0) break;
+        left -= n;
+    }
+    close(fd);
+    if (left > 0) log_error("Failed to write %s to the pack file", e->filename);
+    return left == 0;
+}
+
+// Function to write an entry's decoded data while holding a write slot on its root
+int write_entry_output(const Entry *e, const char *path, const uint8_t *buf, size_t len) {
+    OutputRoot *root = &output_roots[e->root];
+    root_begin_write(root);
+    int ok = packfile_fd >= 0 ? write_packfile(e, buf, len) : write_output(e, path, buf, len);
+    root_end_write(root, ok, len);
+    return ok;
+}
+
+// Function to check whether a method is decoded in-process
+int has_native_codec(Method method) {
+    switch (method) {
+        case NO_PROCESSING: return 1;
+#ifdef HAVE_ZLIB
+        case ZLIB: return 1;
+#endif
+#ifdef HAVE_LZMA
+        case LZMA: return 1;
+#endif
+#ifdef HAVE_OPENSSL
+        case FERNET: return 1;
+#endif
+#ifdef HAVE_BROTLI
+        case BROTLI: return 1;
+#endif
+#ifdef HAVE_BZIP2
+        case BZIP2: return 1;
+#endif
+#if defined(HAVE_ZLIB) && defined(HAVE_LZMA)
+        case FILTERED: return 1; // The filters are native; the inner codec may be any of the above
+#endif
+#if defined(HAVE_ZLIB) && defined(HAVE_LZMA) && defined(HAVE_OPENSSL)
+        case CHAIN: return 1; // Every stage a chain may hold
+#endif
+        default: return 0;
+    }
+}
+
+// Function to decode an entry in-process into a pooled buffer and write it out
+int decode_native(Worker *w, const Entry *e, const uint8_t *payload, const char *output_path) {
+    if (e->method == NO_PROCESSING) {
+        if (e->proc_size != e->orig_size) {
+            log_error("Data size mismatch for no processing");
+            return 0;
+        }
+        return write_entry_output(e, output_path, payload, e->proc_size); // Stored data needs no buffer
+    }
+
+    MemTag tag = mem_codec_tag(e->method);
+    uint8_t *out = pool_get(&w->pool, e->orig_size + 1, tag);
+    if (!out) return 0;
+    int ok = 0;
+#ifdef HAVE_ZLIB
+    if (e->method == ZLIB) {
+        // Large entries record checkpoints the first time they are decoded
+        EntryCheckpoints recorded = {0};
+        int record = wants_checkpoints(e, payload);
+        ok = decode_zlib(w, payload, e->proc_size, out, e->orig_size, record ? &recorded : NULL);
+        if (ok) store_checkpoints(e, payload, &recorded);
+        else free_entry_checkpoints(&recorded);
+    }
+#endif
+#ifdef HAVE_LZMA
+    if (e->method == LZMA) ok = decode_lzma(w, payload, e->proc_size, out, e->orig_size);
+#endif
+#ifdef HAVE_BROTLI
+    if (e->method == BROTLI) ok = decode_brotli(payload, e->proc_size, out, e->orig_size);
+#endif
+#ifdef HAVE_BZIP2
+    if (e->method == BZIP2) ok = decode_bzip2(payload, e->proc_size, out, e->orig_size);
+#endif
+    if (e->method == FILTERED) ok = decode_filtered(w, e, payload, out);
+    if (e->method == FERNET || e->method == CHAIN) ok = decode_chained(w, e, payload, out);
+    if (ok) ok = write_entry_output(e, output_path, out, e->orig_size);
+    pool_put(&w->pool, out, e->orig_size + 1, tag);
+    return ok;
+}
+
+// Function to decode an entry by running process_data.py on a temporary copy of its data
+int decode_python(Worker *w, const Entry *e, const uint8_t *payload, const char *output_path) {
+    io_throttle_span(e->proc_size + e->orig_size); // The temp file and the script's output
+    // Write file data to a temporary file for processing
+    FILE *temp_fp = fopen(w->temp_path, "wb");
+    if (!temp_fp) {
+        log_error("Failed to create temp file");
+        return 0;
+    }
+    if (e->method == FERNET) {
+        // For FERNET, write the key and data separately
+        fwrite(payload, 1, 44, temp_fp);
+        fwrite(payload + 44, 1, e->proc_size - 44, temp_fp);
+    } else {
+        // For other methods, write the data as-is
+        fwrite(payload, 1, e->proc_size, temp_fp);
+    }
+    fclose(temp_fp);
+
+    // Run the Python script to process the temporary file; it writes the output itself
+    OutputRoot *root = &output_roots[e->root];
+    root_begin_write(root);
+    char cmd[512];
+    snprintf(cmd, 512, "python3 process_data.py %d %s %s %llu 2>&1", e->method, w->temp_path, output_path,
+             (unsigned long long)e->orig_size);
+    FILE *pipe = popen(cmd, "r"); // Use popen to capture script output
+    if (!pipe) {
+        log_error("Failed to execute Python script");
+        root_end_write(root, 0, 0);
+        unlink(w->temp_path);
+        return 0;
+    }
+
+    // Read and log the Python script’s output
+    char line[MAX_LINE];
+    while (fgets(line, MAX_LINE, pipe)) {
+        line[strcspn(line, "\n")] = 0; // Remove newline
+        log_message(line); // Log each line of output
+    }
+
+    // Check the Python script’s exit status
+    int ret = pclose(pipe);
+    root_end_write(root, ret == 0, e->orig_size);
+    sample_child_rss(e->method); // Attribute the codec process's memory to its method
+    unlink(w->temp_path); // Remove temporary file
+    if (ret != 0) {
+        log_error("Python processing failed with exit code %d", ret);
+        return 0;
+    }
+    return 1; // Success
+}
+
+// Function to check that an entry can be decoded, logging its details
+int check_entry(const Entry *e) {
+    const char *method_str = method_name(e->method);
+    if (!method_str) {
+        log_error("Unknown processing method");
+        return 0;
+    }
+    if (verbose >= 1) {
+        char msg[512];
+        snprintf(msg, 512, "Processing %s: method=%s, orig_size=%llu, proc_size=%llu", e->filename, method_str,
+                 (unsigned long long)e->orig_size, (unsigned long long)e->proc_size);
+        log_message(msg); // Log processing details
+    }
+    if (e->method == FERNET && e->proc_size < 44) {
+        log_error("Fernet data too short for key");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to extract a single file entry of the archive
+int extract_entry(Worker *w, const Entry *e) {
+    if (!check_entry(e)) return 0;
+    const uint8_t *payload = entry_payload(w->ex->ar, e);
+    if (w->ex->ar->mapped) io_throttle_span(e->proc_size); // The payload is faulted in from the archive
+
+    // In a pack file, process_data.py output goes through a temp file
+    if (packfile_fd >= 0) {
+        if (has_native_codec(e->method)) return decode_native(w, e, payload, NULL);
+        char temp_out[80];
+        snprintf(temp_out, sizeof(temp_out), "./%s.out", w->temp_path);
+        int ok = decode_python(w, e, payload, temp_out) && copy_to_packfile(e, temp_out);
+        unlink(temp_out);
+        return ok;
+    }
+
+    // Create the full output path and ensure directories exist
+    char output_path[MAX_PATH];
+    if (!build_output_path(output_path, MAX_PATH, output_roots[e->root].path, e->filename)) {
+        log_error("Output path too long for %s", e->filename);
+        return 0;
+    }
+    create_directories(output_path);
+    if (has_native_codec(e->method)) return decode_native(w, e, payload, output_path);
+
+    // process_data.py writes the part file that is renamed once the script succeeds
+    char part_path[MAX_PATH + 32];
+    build_part_path(part_path, sizeof(part_path), output_path, e);
+    if (!decode_python(w, e, payload, part_path) || rename(part_path, output_path) != 0) {
+        unlink(part_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to mark an entry finished and release the archive pages no pending entry needs
+void finish_entry(Extraction *ex, size_t idx, int ok) {
+    pthread_mutex_lock(&ex->lock);
+    ex->done[idx] = 1;
+    if (keep_duplicates) pthread_cond_broadcast(&ex->finished);
+    if (ok && journal_fp) {
+        const Entry *e = &ex->entries[idx];
+        fprintf(journal_fp, "%llu\t%llu\t%s\n", (unsigned long long)e->data_offset, (unsigned long long)e->orig_size,
+                e->filename);
+    }
+    if (ex->entries[idx].priority) {
+        if (!ok) ex->priority_failed++;
+        if (--ex->priority_left == 0) notify_first_ready(ex->priority_failed);
+    }
+    while (ex->first_pending < ex->count && ex->done[ex->first_pending]) ex->first_pending++;
+    size_t low_water = ex->first_pending < ex->count ? ex->entries[ex->first_pending].header_offset : ex->ar->len;
+    release_consumed(ex->ar, low_water);
+    pthread_mutex_unlock(&ex->lock);
+    sample_rss(STAGE_EXTRACT);
+}
+
+// Function to wait until the previous copy of an entry's path is finished (--keep-duplicates), so the
+// copies are written in archive order and the last one wins. Copies are claimed in archive order, so
+// the previous one is already in progress. Returns 0 if a stop signal came first.
+int wait_for_previous_copy(Extraction *ex, size_t idx) {
+    long prev = ex->entries[idx].prev_copy;
+    if (prev < 0) return 1;
+    pthread_mutex_lock(&ex->lock);
+    while (!ex->done[prev] && !stop_signal) {
+        // Wake up now and then to notice a stop signal
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ex->finished, &ex->lock, &until);
+    }
+    int ready = ex->done[prev];
+    pthread_mutex_unlock(&ex->lock);
+    return ready;
+}
+
+// Function run by each extraction worker: claim entries until none are left
+void *worker_main(void *arg) {
+    Worker *w = arg;
+    Extraction *ex = w->ex;
+    while (!stop_signal) { // After a stop signal no new entry is started
+        size_t pos = __atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED);
+        if (pos >= ex->order_count) break;
+        size_t idx = ex->order[pos];
+        if (!wait_for_previous_copy(ex, idx)) break; // Left unfinished for --resume
+        int ok = extract_entry(w, &ex->entries[idx]);
+        if (!ok) {
+            ex->entries[idx].failed = 1;
+            log_message("Continuing after error in file entry");
+        }
+        finish_entry(ex, idx, ok);
+    }
+    return NULL;
+}
+
+// Function to count a file written outside write_entry_output on its output root
+void root_add_written(OutputRoot *root, uint64_t bytes) {
+    pthread_mutex_lock(&root->lock);
+    root->files++;
+    root->bytes += bytes;
+    pthread_mutex_unlock(&root->lock);
+}
+
+// Function to check whether an entry can go to process_data.py in a batch: a valid method without
+// a native codec, a name that fits on a manifest line, not one whose --first readiness is awaited,
+// and not a copy of a path written several times (the workers write those in order)
+int wants_python_batch(const Entry *e) {
+    return !has_native_codec(e->method) && method_name(e->method) && !e->priority &&
+           !(e->method == FERNET && e->proc_size < 44) && !strpbrk(e->filename, "\t\n") &&
+           (!keep_duplicates || (e->shadowed_by < 0 && e->prev_copy < 0));
+}
+
+// Function to build the file process_data.py writes a batched entry to (0 if the path is too long)
+int batch_output_path(const Entry *e, size_t k, char *out, size_t out_len) {
+    if (packfile_fd >= 0) {
+        snprintf(out, out_len, "./temp.%d.batch.%zu.out", (int)getpid(), k);
+        return 1;
+    }
+    char path[MAX_PATH];
+    if (!build_output_path(path, MAX_PATH, output_roots[e->root].path, e->filename)) return 0;
+    create_directories(path);
+    build_part_path(out, out_len, path, e);
+    return 1;
+}
+
+// Function to finish batched entry k once process_data.py reported it: move its output into place
+// (or into the pack file) and release it, so the low-water mark advances while the run goes on
+void finish_batch_entry(Extraction *ex, size_t k, int entry_ok) {
+    size_t idx = ex->batch[k];
+    const Entry *e = &ex->entries[idx];
+    char output_path[MAX_PATH + 32], final_path[MAX_PATH];
+    if (packfile_fd >= 0) {
+        batch_output_path(e, k, output_path, sizeof(output_path));
+        if (entry_ok) entry_ok = copy_to_packfile(e, output_path);
+        unlink(output_path);
+    } else if (build_output_path(final_path, MAX_PATH, output_roots[e->root].path, e->filename)) {
+        build_part_path(output_path, sizeof(output_path), final_path, e);
+        if (entry_ok) entry_ok = rename(output_path, final_path) == 0;
+        if (!entry_ok) unlink(output_path);
+    }
+    if (entry_ok) {
+        root_add_written(&output_roots[e->root], e->orig_size);
+    } else {
+        ex->entries[idx].failed = 1;
+        log_error("Python processing failed for %s", e->filename);
+        log_message("Continuing after error in file entry");
+    }
+    finish_entry(ex, idx, entry_ok);
+}
+
+// Function to handle a line printed by the process_data.py batch run: "OK <n>" or "FAILED <n>"
+// finishes the entry of manifest line n, anything else is the script's own output.
+// Returns 1 if the line finished an entry.
+int batch_result_line(Extraction *ex, const char *line, unsigned char *status, const size_t *line_entry, size_t lines) {
+    size_t n;
+    int entry_ok = sscanf(line, "OK %zu", &n) == 1;
+    if (!entry_ok && sscanf(line, "FAILED %zu", &n) != 1) {
+        log_message(line); // Log the script's own output
+    } else if (n < lines && !status[line_entry[n]]) {
+        status[line_entry[n]] = 1;
+        finish_batch_entry(ex, line_entry[n], entry_ok);
+        return 1;
+    }
+    return 0;
+}
+
+// Function to start process_data.py with its arguments, its stdin on *to_child and its stdout and
+// stderr on *from_child. Unlike popen, the pid is known, so a drain can terminate the run.
+pid_t spawn_python(char *const argv[], int *to_child, int *from_child) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0) return -1;
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN); // Ctrl-C reaches the whole process group; the drain decides when the script stops
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+    *to_child = in[1];
+    *from_child = out[0];
+    return pid;
+}
+
+// Function to decode the batched entries with one process_data.py run, so the interpreter starts
+// once and decodes them on num_workers threads. The manifest is fed to the script's stdin an entry
+// at a time, keeping two per thread outstanding; after a stop signal no more entries are fed, and
+// once the drain times out the script is terminated. Mapped archives are read by the script in
+// place; other archives first write the batched payloads to a temp file.
+int decode_python_batch(Extraction *ex) {
+    Archive *ar = ex->ar;
+    char blob_path[64], input[MAX_PATH], threads[16];
+    snprintf(blob_path, sizeof(blob_path), "temp.%d.batch.bin", (int)getpid());
+    int use_blob = !(ar->mapped && ar->path);
+    snprintf(input, sizeof(input), "%s", use_blob ? blob_path : ar->path);
+    snprintf(threads, sizeof(threads), "%d", num_workers);
+    unsigned char *status = mem_alloc(MEM_PARSE, ex->batch_count); // 1 once an entry is finished
+    size_t *line_entry = mem_alloc(MEM_PARSE, ex->batch_count * sizeof(size_t)); // Batch position per manifest line
+    FILE *blob = use_blob ? fopen(blob_path, "wb") : NULL;
+    int ok = status && line_entry && (!use_blob || blob);
+    if (!ok) log_error("Failed to prepare the process_data.py batch");
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Decoding %zu entries with one process_data.py run", ex->batch_count);
+    log_message(msg);
+    if (status) memset(status, 0, ex->batch_count);
+    for (size_t k = 0; use_blob && ok && k < ex->batch_count; k++) {
+        const Entry *e = &ex->entries[ex->batch[k]];
+        ok = fwrite(entry_payload(ar, e), 1, e->proc_size, blob) == e->proc_size;
+    }
+    if (blob && fclose(blob) != 0) ok = 0;
+
+    // Run the script; it prints one OK or FAILED line per manifest line, in manifest order, and
+    // each entry is finished as its line arrives
+    size_t fed = 0, lines = 0; // Batch entries handed to the script, and manifest lines written
+    if (ok) {
+        signal(SIGPIPE, SIG_IGN); // A script that exits early fails the feeding write instead of killing the run
+        char *argv[] = {"python3", "process_data.py", "--manifest", "-", input, threads, NULL};
+        int to_child = -1, from_child = -1;
+        pid_t pid = spawn_python(argv, &to_child, &from_child);
+        if (pid < 0) {
+            log_error("Failed to execute Python script");
+            ok = 0;
+        } else {
+            char line[MAX_LINE], output_path[MAX_PATH + 32];
+            size_t line_len = 0, reported = 0; // Manifest lines the script has answered
+            uint64_t blob_offset = 0;
+            int terminated = 0;
+            for (;;) {
+                if (to_child >= 0 && (fed == ex->batch_count || stop_signal)) {
+                    close(to_child); // The script finishes the entries it has, then exits
+                    to_child = -1;
+                }
+                if (!terminated && decode_cancelled()) {
+                    log_error("Python processing cancelled by a stop signal");
+                    kill(pid, SIGTERM);
+                    terminated = 1;
+                }
+                int feed = to_child >= 0 && lines - reported < 2 * (size_t)num_workers;
+                struct pollfd fds[2] = {{from_child, POLLIN, 0}, {feed ? to_child : -1, POLLOUT, 0}};
+                if (poll(fds, 2, 100) < 0) { // Wakes up to check for a stop
+                    if (errno == EINTR) continue;
+                    break;
+                }
+
+                // Feed the next entry; outputs go to part files renamed on success, or to temp files
+                // copied into a pack file
+                if (feed && fds[1].revents) {
+                    // The script reads the payload and writes the output; the entry is charged as it is
+                    // handed over, so the script is paced like the workers (a stop cuts the wait short)
+                    const Entry *e = &ex->entries[ex->batch[fed]];
+                    for (uint64_t left = e->proc_size + e->orig_size; left > 0 && !stop_signal;) {
+                        size_t chunk = io_chunk(left);
+                        io_throttle(chunk);
+                        left -= chunk;
+                    }
+                    if (stop_signal) continue;
+                    size_t k = fed++;
+                    check_entry(e); // Logs the entry; it was checked when it was batched
+                    uint64_t offset = use_blob ? blob_offset : e->data_offset;
+                    blob_offset += e->proc_size;
+                    if (!batch_output_path(e, k, output_path, sizeof(output_path))) {
+                        status[k] = 1;
+                        finish_batch_entry(ex, k, 0);
+                        continue;
+                    }
+                    char entry[MAX_PATH + 96];
+                    int len = snprintf(entry, sizeof(entry), "%llu\t%llu\t%d\t%llu\t%s\n", (unsigned long long)offset,
+                                       (unsigned long long)e->proc_size, e->method, (unsigned long long)e->orig_size,
+                                       output_path);
+                    line_entry[lines++] = k;
+                    if (write(to_child, entry, len) != len) { // The script is gone
+                        close(to_child);
+                        to_child = -1;
+                    }
+                }
+
+                // Collect the script's output a line at a time
+                if (fds[0].revents) {
+                    ssize_t got = read(from_child, &line[line_len], sizeof(line) - 1 - line_len);
+                    if (got < 0 && errno == EINTR) continue;
+                    if (got <= 0) break; // The script exited
+                    line_len += got;
+                    char *start = line, *end;
+                    while ((end = memchr(start, '\n', &line[line_len] - start))) {
+                        *end = 0;
+                        reported += batch_result_line(ex, start, status, line_entry, lines);
+                        start = end + 1;
+                    }
+                    line_len -= start - line;
+                    memmove(line, start, line_len);
+                    if (line_len == sizeof(line) - 1) { // A line too long for the buffer is logged in pieces
+                        line[line_len] = 0;
+                        reported += batch_result_line(ex, line, status, line_entry, lines);
+                        line_len = 0;
+                    }
+                }
+            }
+            if (line_len) { // Output not ended by a newline
+                line[line_len] = 0;
+                reported += batch_result_line(ex, line, status, line_entry, lines);
+            }
+            if (to_child >= 0) close(to_child);
+            close(from_child);
+            int ret = 0;
+            while (waitpid(pid, &ret, 0) < 0 && errno == EINTR) {}
+            sample_child_rss(ex->entries[ex->batch[0]].method);
+            if (ret != 0 && !terminated) {
+                log_error("Python processing failed with exit code %d", ret);
+                ok = 0;
+            }
+        }
+    }
+    if (use_blob) unlink(blob_path);
+
+    // Entries the script never reported (paths too long, or a failed run) are failed. Entries not
+    // fed after a stop signal are left unfinished, like those no worker started.
+    for (size_t k = 0; k < ex->batch_count; k++) {
+        if ((!status || !status[k]) && (k < fed || !stop_signal)) finish_batch_entry(ex, k, 0);
+    }
+    mem_free(MEM_PARSE, status);
+    mem_free(MEM_PARSE, line_entry);
+    return ok;
+}
+
+// Function run by the thread that decodes the process_data.py batch
+void *python_batch_main(void *arg) {
+    decode_python_batch(arg);
+    return NULL;
+}
+
+// Function to set up a worker's pool, codec state and temp file name
+void worker_init(Worker *w, int id, Extraction *ex) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->ex = ex;
+    pthread_mutex_init(&w->pool.lock, NULL);
+    pool_registry[pool_registry_count++] = &w->pool;
+    snprintf(w->temp_path, sizeof(w->temp_path), "temp.%d.%d.bin", (int)getpid(), id);
+#ifdef HAVE_LZMA
+    lzma_stream xz_init = LZMA_STREAM_INIT;
+    w->xz = xz_init;
+#endif
+}
+
+// Function to free a worker's pool and codec state
+void worker_destroy(Worker *w) {
+    pool_destroy(&w->pool);
+#ifdef HAVE_ZLIB
+    if (w->zs_ready) inflateEnd(&w->zs);
+#endif
+#ifdef HAVE_LZMA
+    lzma_end(&w->xz);
+#endif
+}
+
+// Function to extract the scheduled entries with num_workers workers
+int extract_entries(Archive *ar, Entry *entries, size_t count, const size_t *order, size_t order_count) {
+    Extraction ex = {0};
+    ex.ar = ar;
+    ex.entries = entries;
+    ex.count = count;
+    ex.order = order;
+    ex.order_count = order_count;
+    ex.done = mem_alloc(MEM_PARSE, count ? count : 1);
+    Worker *workers = mem_alloc(MEM_PARSE, num_workers * sizeof(Worker));
+    size_t *split = mem_alloc(MEM_PARSE, (order_count ? order_count : 1) * 2 * sizeof(size_t));
+    if (!ex.done || !workers || !split) {
+        log_error("Memory allocation failed");
+        mem_free(MEM_PARSE, ex.done);
+        mem_free(MEM_PARSE, workers);
+        mem_free(MEM_PARSE, split);
+        return 0;
+    }
+
+    // Entries that need process_data.py go to one batch run instead of a run each
+    size_t worker_count = 0;
+    ex.batch = split + order_count;
+    for (size_t i = 0; i < order_count; i++) {
+        if (wants_python_batch(&entries[order[i]])) ex.batch[ex.batch_count++] = order[i];
+        else split[worker_count++] = order[i];
+    }
+    if (ex.batch_count >= PYTHON_BATCH_MIN) {
+        ex.order = split;
+        ex.order_count = worker_count;
+    } else {
+        ex.batch_count = 0;
+    }
+    // Entries that are not scheduled count as done for the low-water mark
+    memset(ex.done, 1, count ? count : 1);
+    for (size_t i = 0; i < order_count; i++) {
+        ex.done[order[i]] = 0;
+        if (entries[order[i]].priority) ex.priority_left++;
+    }
+    while (ex.first_pending < count && ex.done[ex.first_pending]) ex.first_pending++;
+    pthread_mutex_init(&ex.lock, NULL);
+    pthread_cond_init(&ex.finished, NULL);
+    for (int i = 0; i < num_workers; i++) worker_init(&workers[i], i, &ex);
+    pthread_t batch_thread;
+    int batch_started = ex.batch_count > 0 && pthread_create(&batch_thread, NULL, python_batch_main, &ex) == 0;
+    if (ex.batch_count > 0 && !batch_started) decode_python_batch(&ex);
+
+    // A single worker runs on the main thread
+    if (num_workers == 1) {
+        worker_main(&workers[0]);
+    } else {
+        int started = 0;
+        for (; started < num_workers; started++) {
+            if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+                log_error("Failed to start worker thread");
+                break;
+            }
+        }
+        if (started == 0) worker_main(&workers[0]); // Fall back to extracting on the main thread
+        for (int i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+    }
+    if (batch_started) pthread_join(batch_thread, NULL);
+    for (size_t i = 0; i < order_count; i++) {
+        if (!ex.done[order[i]]) entries[order[i]].failed = 1; // Never started after a stop signal
+    }
+
+    for (int i = 0; i < num_workers; i++) worker_destroy(&workers[i]);
+    pool_registry_count = 0;
+    pthread_mutex_destroy(&ex.lock);
+    pthread_cond_destroy(&ex.finished);
+    mem_free(MEM_PARSE, workers);
+    mem_free(MEM_PARSE, split);
+    mem_free(MEM_PARSE, ex.done);
+    return 1;
+}
+
+// Function to open an archive given as a local path or a URL
+int open_archive(const char *input, Archive *ar, Entry **entries, size_t *count) {
+    if (is_remote_url(input)) return open_remote_archive(input, ar, entries, count);
+    return open_local_archive(input, ar, entries, count);
+}
+
+// Function to build the name of a sidecar file of a local archive (empty for remote ones)
+void sidecar_path(const char *input, const char *suffix, char *out, size_t out_len) {
+    out[0] = '\0';
+    if (!is_remote_url(input) && strlen(input) + strlen(suffix) < out_len) snprintf(out, out_len, "%s%s", input, suffix);
+}
+
+// Function to add the counts of an access stats sidecar ("<count>\t<name>" lines) to the entries.
+// Names no longer in the archive are dropped; a name counts for the entry extraction leaves on disk.
+int load_access_counts(const char *path, Entry *entries, size_t count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 1; // Nothing recorded yet
+    size_t buckets = 0;
+    long *table = build_name_table(entries, count, &buckets);
+    if (!table) {
+        fclose(fp);
+        return 0;
+    }
+    char line[MAX_PATH + 32];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0;
+        char *name = strchr(line, '\t');
+        if (!name) continue;
+        long idx = find_entry(table, buckets, entries, name + 1);
+        if (idx >= 0) entries[idx].accesses += strtoull(line, NULL, 10);
+    }
+    mem_free(MEM_PARSE, table);
+    fclose(fp);
+    return 1;
+}
+
+// Function to write the access counts of the entries to a sidecar, replacing it
+int save_access_counts(const char *path, const Entry *entries, size_t count) {
+    char tmp_path[MAX_PATH + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    int ok = fp != NULL;
+    for (size_t i = 0; ok && i < count; i++) {
+        if (entries[i].accesses) ok = fprintf(fp, "%llu\t%s\n", (unsigned long long)entries[i].accesses, entries[i].filename) > 0;
+    }
+    if (fp && fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        log_error("Failed to write access stats %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to add the reads counted in the entries' accesses to the access stats sidecar of an
+// archive, then clear the counts
+void flush_accesses(const char *input, Entry *entries, size_t count) {
+    char path[MAX_PATH];
+    sidecar_path(input, ACCESS_SUFFIX, path, sizeof(path));
+    if (record_access && path[0] && load_access_counts(path, entries, count)) save_access_counts(path, entries, count);
+    for (size_t i = 0; i < count; i++) entries[i].accesses = 0;
+}
+
+// Function to copy the bytes [offset, offset + len) of a file to fp
+int copy_file_range_to(const char *path, uint64_t offset, uint64_t len, FILE *fp) {
+    FILE *in = fopen(path, "rb");
+    if (!in || fseeko(in, offset, SEEK_SET) != 0) {
+        log_error("Failed to read decoded data from %s", path);
+        if (in) fclose(in);
+        return 0;
+    }
+    char buf[65536];
+    while (len > 0) {
+        size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), in);
+        if (n == 0 || fwrite(buf, 1, n, fp) != n) break;
+        len -= n;
+    }
+    fclose(in);
+    if (len > 0) log_error("Failed to copy range output");
+    return len == 0;
+}
+
+// Function to point the first output root at the working directory, for decodes outside an extraction
+void init_scratch_root(void) {
+    output_roots[0].path = ".";
+    pthread_mutex_init(&output_roots[0].lock, NULL);
+    pthread_cond_init(&output_roots[0].slot, NULL);
+}
+
+// Function to write part of one entry's decoded data to stdout (--read, --range).
+// ZLIB entries inflate from the nearest checkpoint; other methods decode the whole entry.
+int read_entry(const char *input, const char *name, uint64_t offset, uint64_t len) {
+    Archive ar;
+    Entry *entries = NULL;
+    size_t count = 0;
+    if (!open_archive(input, &ar, &entries, &count)) return 0;
+
+    // The last entry with the name is the one extraction would leave on disk
+    size_t buckets = 0;
+    long *table = build_name_table(entries, count, &buckets);
+    long found = table ? find_entry(table, buckets, entries, name) : -1;
+    Entry *e = found >= 0 ? &entries[found] : NULL;
+    if (table) mem_free(MEM_PARSE, table);
+    int ok = 0;
+    if (!e) {
+        log_error("No entry named %s", name);
+    } else if (check_entry(e)) {
+        ok = 1;
+        if (offset > e->orig_size) offset = e->orig_size;
+        if (len > e->orig_size - offset) len = e->orig_size - offset;
+        size_t idx = e - entries;
+        if (ar.remote) ok = fetch_scheduled_entries(&ar, entries, &idx, 1);
+    }
+    const uint8_t *payload = ok ? entry_payload(&ar, e) : NULL;
+
+    if (ok && e->method == NO_PROCESSING) {
+        if (e->proc_size != e->orig_size) {
+            log_error("Data size mismatch for no processing");
+            ok = 0;
+        } else {
+            ok = fwrite(payload + offset, 1, len, stdout) == len;
+        }
+#ifdef HAVE_ZLIB
+    } else if (ok && e->method == ZLIB) {
+        char sidecar[MAX_PATH];
+        sidecar_path(input, CHECKPOINT_SUFFIX, sidecar, sizeof(sidecar));
+        if (sidecar[0]) load_checkpoints(sidecar, ar.len);
+        ok = inflate_range(e, payload, offset, len, stdout);
+        if (sidecar[0]) save_checkpoints(sidecar, ar.len);
+        free_checkpoints();
+#endif
+    } else if (ok) {
+        // Decode the whole entry to a temp file next to the worker's, then copy the range
+        Worker w;
+        worker_init(&w, 0, NULL);
+        char temp_out[80];
+        snprintf(temp_out, sizeof(temp_out), "./%s.out", w.temp_path); // process_data.py needs a directory
+        e->root = 0;
+        init_scratch_root();
+        ok = has_native_codec(e->method) ? decode_native(&w, e, payload, temp_out) : decode_python(&w, e, payload, temp_out);
+        if (ok) ok = copy_file_range_to(temp_out, offset, len, stdout);
+        unlink(temp_out);
+        worker_destroy(&w);
+        pool_registry_count = 0;
+    }
+    fflush(stdout);
+    if (ok) {
+        e->accesses = 1;
+        flush_accesses(input, entries, count);
+    }
+    mem_free(MEM_PARSE, entries);
+    unload_archive(&ar);
+    return ok;
+}
+
+// Structure holding the state shared by the --serve threads
+typedef struct {
+    int listen_fd; // Listening Unix socket
+    const char *input; // Path of the archive
+    Archive *ar; // Archive entries are decoded from
+    Entry *entries; // Entries of the archive
+    size_t count; // Number of entries
+    long *table; // Latest entry per name
+    size_t buckets; // Buckets in table
+    int accessed; // 1 if entries were served since the access stats were last written
+    pthread_mutex_t stats_lock; // Guards the access counts of the entries
+} Server;
+
+// Structure holding the per-thread state of a --serve thread
+typedef struct {
+    Worker w; // Decoder state and scratch buffers
+    Server *srv; // Shared server state
+} ServeThread;
+
+// Function to decode an entry into a sealed memfd, so a consumer can map it without a copy on disk
+int decode_to_memfd(Worker *w, const Entry *e, const uint8_t *payload, int fd) {
+    int ok = 0;
+    if (e->method == NO_PROCESSING) {
+        if (e->proc_size != e->orig_size) {
+            log_error("Data size mismatch for no processing");
+            return 0;
+        }
+        ok = 1;
+        for (size_t done = 0; ok && done < e->orig_size;) {
+            ssize_t n = write(fd, payload + done, e->orig_size - done);
+            if (n <= 0) ok = 0;
+            else done += n;
+        }
+    } else if (has_native_codec(e->method)) {
+        // Decode straight into the memfd's pages; the spare byte lets the decoders detect overlong data
+        if (ftruncate(fd, e->orig_size + 1) != 0) {
+            log_error("Failed to size memfd for %s", e->filename);
+            return 0;
+        }
+        uint8_t *out = mmap(NULL, e->orig_size + 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (out == MAP_FAILED) {
+            log_error("Failed to map memfd for %s", e->filename);
+            return 0;
+        }
+#ifdef HAVE_ZLIB
+        if (e->method == ZLIB) ok = decode_zlib(w, payload, e->proc_size, out, e->orig_size, NULL);
+#endif
+#ifdef HAVE_LZMA
+        if (e->method == LZMA) ok = decode_lzma(w, payload, e->proc_size, out, e->orig_size);
+#endif
+#ifdef HAVE_BROTLI
+        if (e->method == BROTLI) ok = decode_brotli(payload, e->proc_size, out, e->orig_size);
+#endif
+#ifdef HAVE_BZIP2
+        if (e->method == BZIP2) ok = decode_bzip2(payload, e->proc_size, out, e->orig_size);
+#endif
+        if (e->method == FILTERED) ok = decode_filtered(w, e, payload, out);
+        if (e->method == FERNET || e->method == CHAIN) ok = decode_chained(w, e, payload, out);
+        munmap(out, e->orig_size + 1);
+        if (ok && ftruncate(fd, e->orig_size) != 0) ok = 0;
+    } else {
+        // process_data.py reopens the memfd through /proc
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), fd);
+        ok = decode_python(w, e, payload, path);
+    }
+    if (ok && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        log_error("Failed to seal memfd for %s", e->filename);
+        ok = 0;
+    }
+    return ok;
+}
+
+// Function to send a reply line, with a descriptor attached unless fd is -1
+int send_reply(int conn, const char *line, int fd) {
+    struct iovec iov = {(void *)line, strlen(line)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+}
+
+// Function to answer the requests of one client: each "GET <name>" line gets "OK <size>" with a
+// sealed memfd holding the decoded entry, or "ERR <message>"
+void serve_client(ServeThread *t, int conn) {
+    Server *srv = t->srv;
+    FILE *in = fdopen(conn, "r");
+    if (!in) {
+        close(conn);
+        return;
+    }
+    char line[MAX_PATH + 16], reply[MAX_PATH + 64];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, "GET ", 4) != 0) {
+            if (!send_reply(conn, "ERR expected GET <name>\n", -1)) break;
+            continue;
+        }
+        const char *name = line + 4;
+        long idx = find_entry(srv->table, srv->buckets, srv->entries, name);
+        if (idx < 0) {
+            snprintf(reply, sizeof(reply), "ERR no entry named %s\n", name);
+            if (!send_reply(conn, reply, -1)) break;
+            continue;
+        }
+        const Entry *e = &srv->entries[idx];
+        int fd = memfd_create(e->filename, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        int ok = fd >= 0 && check_entry(e) && decode_to_memfd(&t->w, e, entry_payload(srv->ar, e), fd);
+        if (ok) snprintf(reply, sizeof(reply), "OK %llu\n", (unsigned long long)e->orig_size);
+        else snprintf(reply, sizeof(reply), "ERR failed to decode %s\n", name);
+        int sent = send_reply(conn, reply, ok ? fd : -1);
+        if (fd >= 0) close(fd); // The client holds its own reference
+        if (ok && sent) {
+            pthread_mutex_lock(&srv->stats_lock);
+            srv->entries[idx].accesses++;
+            srv->accessed = 1;
+            pthread_mutex_unlock(&srv->stats_lock);
+        }
+        if (!sent) break;
+    }
+    fclose(in);
+
+    // The access stats are updated once per client rather than per request
+    pthread_mutex_lock(&srv->stats_lock);
+    if (srv->accessed) flush_accesses(srv->input, srv->entries, srv->count);
+    srv->accessed = 0;
+    pthread_mutex_unlock(&srv->stats_lock);
+}
+
+// Function run by each --serve thread: accept clients one at a time until the process ends
+void *serve_worker(void *arg) {
+    ServeThread *t = arg;
+    for (;;) {
+        int conn = accept(t->srv->listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            log_error("Failed to accept a connection");
+            return NULL;
+        }
+        serve_client(t, conn);
+    }
+}
+
+// Function to serve decoded entries over a Unix socket with num_workers threads (--serve).
+// Descriptors are passed with SCM_RIGHTS, so consumers map the data without it touching disk.
+int serve_archive(const char *input, const char *socket_path) {
+    Archive ar;
+    Entry *entries = NULL;
+    size_t count = 0;
+    if (is_remote_url(input)) {
+        log_error("--serve needs a local archive");
+        return 0;
+    }
+    if (!open_archive(input, &ar, &entries, &count)) return 0;
+    for (size_t i = 0; i < count; i++) entries[i].root = 0; // Python decodes write under the scratch root
+    Server srv = {-1, input, &ar, entries, count, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    srv.table = build_name_table(entries, count, &srv.buckets);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    int ok = srv.table != NULL;
+    if (ok && strlen(socket_path) >= sizeof(addr.sun_path)) {
+        log_error("Socket path too long: %s", socket_path);
+        ok = 0;
+    }
+    if (ok) {
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path); // Replace the socket of a previous server
+        srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (srv.listen_fd < 0 || bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(srv.listen_fd, 64) != 0) {
+            log_error("Failed to listen on %s", socket_path);
+            ok = 0;
+        }
+    }
+    if (ok) {
+        signal(SIGPIPE, SIG_IGN); // A client leaving mid-reply only ends its connection
+        init_scratch_root();
+        ServeThread threads[MAX_WORKERS];
+        int started = 1; // The calling thread serves too
+        worker_init(&threads[0].w, 0, NULL);
+        threads[0].srv = &srv;
+        for (; started < num_workers; started++) {
+            worker_init(&threads[started].w, started, NULL);
+            threads[started].srv = &srv;
+            if (pthread_create(&threads[started].w.thread, NULL, serve_worker, &threads[started]) != 0) {
+                log_error("Failed to start server thread");
+                worker_destroy(&threads[started].w);
+                break;
+            }
+        }
+        char msg[MAX_PATH + 64];
+        snprintf(msg, sizeof(msg), "Serving %zu entries on %s with %d threads", count, socket_path, started);
+        log_message_always(msg);
+        serve_worker(&threads[0]); // Returns only if accept fails
+        ok = 0;
+    }
+    if (srv.listen_fd >= 0) close(srv.listen_fd);
+    if (srv.table) mem_free(MEM_PARSE, srv.table);
+    mem_free(MEM_PARSE, entries);
+    unload_archive(&ar);
+    return ok;
+}
+
+// Function to lay out the scheduled entries in the --pack file, each at a page-aligned offset in
+// schedule order, and size the file. Workers then write their entries in place, in any order.
+int open_packfile(const char *path, Entry *entries, const size_t *order, size_t order_count) {
+    uint64_t end = 0;
+    for (size_t i = 0; i < order_count; i++) {
+        Entry *e = &entries[order[i]];
+        e->pack_offset = end;
+        end = (end + e->orig_size + PACKFILE_ALIGN - 1) & ~(uint64_t)(PACKFILE_ALIGN - 1);
+    }
+    packfile_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (packfile_fd < 0 || ftruncate(packfile_fd, end) != 0) {
+        log_error("Failed to create pack file %s: %s", path, strerror(errno));
+        if (packfile_fd >= 0) close(packfile_fd);
+        packfile_fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+// Function to write the hash index of a --pack file: a header ("PIDX", version, bucket count, entry count,
+// pack size), open-addressing buckets of (name hash, offset, length, name offset, name length) and the
+// normalized names, all little-endian, so readers map the file and look a name up with no parsing
+int write_packfile_index(const char *path, const Entry *entries, const size_t *order, size_t order_count) {
+    size_t count = 0, names_len = 0;
+    char name[MAX_PATH];
+    for (size_t i = 0; i < order_count; i++) {
+        if (entries[order[i]].failed) continue;
+        normalize_name(entries[order[i]].filename, name);
+        if (!name[0]) continue; // An empty length marks a free bucket
+        names_len += strlen(name);
+        count++;
+    }
+    uint64_t buckets = 16;
+    while (buckets < count * 2) buckets *= 2;
+    size_t size = PACKFILE_HEADER + buckets * PACKFILE_RECORD + names_len;
+    uint8_t *buf = mem_alloc(MEM_WRITER, size);
+    if (!buf) {
+        log_error("Memory allocation failed");
+        return 0;
+    }
+    memset(buf, 0, PACKFILE_HEADER + buckets * PACKFILE_RECORD);
+    memcpy(buf, "PIDX", 4);
+    write_uint32(&buf[4], 1, ENDIAN_LITTLE);
+    write_uint64(&buf[8], buckets, ENDIAN_LITTLE);
+    write_uint64(&buf[16], count, ENDIAN_LITTLE);
+    struct stat st;
+    write_uint64(&buf[24], fstat(packfile_fd, &st) == 0 ? (uint64_t)st.st_size : 0, ENDIAN_LITTLE);
+
+    // Later entries with the same name come later in the schedule and replace earlier ones
+    size_t names_at = 0;
+    uint8_t *names = buf + PACKFILE_HEADER + buckets * PACKFILE_RECORD;
+    for (size_t i = 0; i < order_count; i++) {
+        const Entry *e = &entries[order[i]];
+        if (e->failed) continue;
+        normalize_name(e->filename, name);
+        size_t len = strlen(name);
+        if (len == 0) continue;
+        uint64_t h = hash_name(name);
+        uint8_t *rec;
+        for (uint64_t b = h & (buckets - 1);; b = (b + 1) & (buckets - 1)) {
+            rec = buf + PACKFILE_HEADER + b * PACKFILE_RECORD;
+            uint32_t other_len = read_uint32(&rec[28], ENDIAN_LITTLE);
+            if (other_len == 0) break;
+            if (read_uint64(rec, ENDIAN_LITTLE) == h && other_len == len &&
+                memcmp(names + read_uint32(&rec[24], ENDIAN_LITTLE), name, len) == 0) break;
+        }
+        memcpy(names + names_at, name, len);
+        write_uint64(rec, h, ENDIAN_LITTLE);
+        write_uint64(&rec[8], e->pack_offset, ENDIAN_LITTLE);
+        write_uint64(&rec[16], e->orig_size, ENDIAN_LITTLE);
+        write_uint32(&rec[24], names_at, ENDIAN_LITTLE);
+        write_uint32(&rec[28], len, ENDIAN_LITTLE);
+        names_at += len;
+    }
+
+    char index_path[MAX_PATH + 16], tmp_path[MAX_PATH + 32];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, PACKFILE_INDEX_SUFFIX);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    int ok = fp && fwrite(buf, 1, PACKFILE_HEADER + buckets * PACKFILE_RECORD + names_at, fp) ==
+                       PACKFILE_HEADER + buckets * PACKFILE_RECORD + names_at;
+    if (fp && fclose(fp) != 0) ok = 0;
+    mem_free(MEM_WRITER, buf);
+    if (!ok || rename(tmp_path, index_path) != 0) {
+        log_error("Failed to write pack index %s", index_path);
+        unlink(tmp_path);
+        return 0;
+    }
+    char msg[MAX_PATH + 64];
+    snprintf(msg, sizeof(msg), "Packed %zu entries into %s", count, path);
+    log_message(msg);
+    return 1;
+}
+
+// Function to write one entry of a --pack file to stdout, found through the mapped index (--pack-get)
+int packfile_get(const char *path, const char *name) {
+    char index_path[MAX_PATH + 16];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, PACKFILE_INDEX_SUFFIX);
+    int fd = open(index_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < PACKFILE_HEADER) {
+        log_error("Failed to open pack index %s", index_path);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    uint8_t *idx = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (idx == MAP_FAILED) {
+        log_error("Failed to map pack index %s", index_path);
+        return 0;
+    }
+    uint64_t buckets = read_uint64(&idx[8], ENDIAN_LITTLE);
+    if (memcmp(idx, "PIDX", 4) != 0 || read_uint32(&idx[4], ENDIAN_LITTLE) != 1 || buckets == 0 ||
+        (buckets & (buckets - 1)) || buckets > ((uint64_t)st.st_size - PACKFILE_HEADER) / PACKFILE_RECORD) {
+        log_error("Invalid pack index %s", index_path);
+        munmap(idx, st.st_size);
+        return 0;
+    }
+    const uint8_t *names = idx + PACKFILE_HEADER + buckets * PACKFILE_RECORD;
+    size_t names_len = st.st_size - PACKFILE_HEADER - buckets * PACKFILE_RECORD;
+
+    char key[MAX_PATH] = "";
+    if (strlen(name) < MAX_PATH) normalize_name(name, key);
+    size_t len = strlen(key);
+    uint64_t h = hash_name(key);
+    const uint8_t *found = NULL;
+    for (uint64_t b = h & (buckets - 1), probes = 0; probes < buckets; b = (b + 1) & (buckets - 1), probes++) {
+        const uint8_t *rec = idx + PACKFILE_HEADER + b * PACKFILE_RECORD;
+        uint32_t rec_len = read_uint32(&rec[28], ENDIAN_LITTLE);
+        uint32_t rec_name = read_uint32(&rec[24], ENDIAN_LITTLE);
+        if (rec_len == 0 || len == 0) break;
+        if (read_uint64(rec, ENDIAN_LITTLE) == h && rec_len == len && rec_name <= names_len - len &&
+            memcmp(names + rec_name, key, len) == 0) {
+            found = rec;
+            break;
+        }
+    }
+    int ok = 0;
+    if (!found) log_error("No entry named %s", name);
+    else ok = copy_file_range_to(path, read_uint64(&found[8], ENDIAN_LITTLE), read_uint64(&found[16], ENDIAN_LITTLE), stdout);
+    fflush(stdout);
+    munmap(idx, st.st_size);
+    return ok;
+}
+
+// Structure holding one file waiting to be encoded and written in create mode
+typedef struct {
+    char name[MAX_PATH]; // Entry name
+    const uint8_t *data; // Input data: a file mapping, a buffer read from a tar stream or a zip member
+    size_t len; // Input bytes
+    size_t orig_size; // Decoded size of the entry
+    int owned; // 1 if data was allocated with mem_alloc, 2 if it is a file mapping, 0 if borrowed
+    int raw_deflate; // 1 if data is a raw deflate stream (a zip member) decoding to orig_size bytes
+    uint32_t crc; // CRC-32 of the decoded data (zip members)
+    uint64_t mtime; // Modification time of the source in ns (0 if unknown)
+    uint64_t hash; // Hash of the decoded data (valid if hashed)
+    int hashed; // 1 once hash is computed
+    const Entry *reuse; // Entry of the base archive whose payload is copied instead of encoding
+    uint8_t *payload; // Encoded data (may be data itself for stored entries)
+    size_t payload_len; // Encoded bytes
+    int ok; // 1 once encoded
+} PackItem;
+
+// Structure holding the state of an archive being created (-c, --from-tar, --from-zip)
+typedef struct {
+    FILE *fp; // Archive being written (under a temporary name)
+    char path[MAX_PATH]; // Final name of the archive
+    char tmp_path[MAX_PATH + 16]; // Name written to until the archive is complete
+    Archive ar; // Byte order and version of the archive
+    Method method; // Method applied to every file
+    int text_format; // 0: binary, 1: raw hex lines, 2: xxd lines
+    uint8_t line[HEX_LINE_BYTES]; // Bytes of the text line being filled
+    size_t line_len; // Bytes in line
+    uint64_t line_offset; // Archive offset of the first byte of line
+    Entry *entries; // Entries written so far, for the index
+    uint8_t **inline_payloads; // Copies of the payloads of entries that get one in the index (--inline-max)
+    size_t count; // Number of entries written
+    size_t capacity; // Allocated entries
+    uint64_t offset; // Bytes written so far
+    PackItem *batch; // Files waiting to be encoded, in archive order
+    size_t batch_count; // Number of files in batch
+    size_t batch_bytes; // Input bytes held by batch
+    size_t batch_next; // Next file of the batch to claim for encoding
+    Archive base; // Previous archive whose payloads are reused (--base)
+    Entry *base_entries; // Entries of the base archive
+    size_t base_count; // Number of base entries
+    long *base_table; // Latest base entry per name, open addressing (NULL without --base)
+    size_t base_buckets; // Buckets in base_table
+    int base_fd; // Base archive file, for copy_file_range
+    unsigned long reused; // Files whose payload was copied from the base
+    uint64_t reused_bytes; // Payload bytes copied from the base
+} ArchiveWriter;
+
+#ifdef HAVE_ZLIB
+// Function to compress a file's data as a ZLIB stream
+int encode_zlib(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    uLongf bound = compressBound(len);
+    *out = mem_alloc(MEM_CODEC_ZLIB, bound ? bound : 1);
+    if (!*out) return 0;
+    if (compress2(*out, &bound, data ? data : (const uint8_t *)"", len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        mem_free(MEM_CODEC_ZLIB, *out);
+        return 0;
+    }
+    *out_len = bound;
+    return 1;
+}
+#endif
+
+#ifdef HAVE_LZMA
+// Function to compress a file's data as .xz split into xz_block_size blocks, which the
+// multi-threaded encoder compresses in parallel and extraction decodes in parallel
+int encode_xz(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = xz_threads > 0 ? (uint32_t)xz_threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    mt.block_size = xz_block_size;
+    mt.preset = LZMA_PRESET_DEFAULT;
+    mt.check = LZMA_CHECK_CRC64;
+    size_t bound = lzma_stream_buffer_bound(len);
+    lzma_stream xz = LZMA_STREAM_INIT;
+    *out = mem_alloc(MEM_CODEC_LZMA, bound);
+    if (!*out) return 0;
+    if (lzma_stream_encoder_mt(&xz, &mt) != LZMA_OK) {
+        mem_free(MEM_CODEC_LZMA, *out);
+        return 0;
+    }
+    xz.next_in = data;
+    xz.avail_in = len;
+    xz.next_out = *out;
+    xz.avail_out = bound;
+    lzma_ret ret;
+    do {
+        ret = lzma_code(&xz, LZMA_FINISH);
+    } while (ret == LZMA_OK);
+    *out_len = xz.total_out;
+    lzma_end(&xz);
+    if (ret != LZMA_STREAM_END) {
+        mem_free(MEM_CODEC_LZMA, *out);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+// Function to compress a file's data as a BROTLI stream
+int encode_brotli(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    if (bound == 0) return 0; // Too large for a single call
+    *out = mem_alloc(MEM_CODEC_BROTLI, bound);
+    if (!*out) return 0;
+    *out_len = bound;
+    if (!BrotliEncoderCompress(BROTLI_CREATE_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, len,
+                               data ? data : (const uint8_t *)"", out_len, *out)) {
+        mem_free(MEM_CODEC_BROTLI, *out);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+#ifdef HAVE_BZIP2
+// Function to compress a file's data as a BZIP2 stream of 900 kB blocks, which extraction decodes in parallel
+int encode_bzip2(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    size_t bound = len + len / 100 + 600; // The worst case bzip2 documents
+    bz_stream bz;
+    memset(&bz, 0, sizeof(bz));
+    *out = mem_alloc(MEM_CODEC_BZIP2, bound);
+    if (!*out) return 0;
+    if (BZ2_bzCompressInit(&bz, 9, 0, 0) != BZ_OK) {
+        mem_free(MEM_CODEC_BZIP2, *out);
+        return 0;
+    }
+    // avail_in/avail_out are 32-bit, so large files are fed in chunks
+    size_t in_pos = 0, out_pos = 0;
+    int ret;
+    do {
+        unsigned int in_chunk = len - in_pos > UINT_MAX ? UINT_MAX : len - in_pos;
+        unsigned int out_chunk = bound - out_pos > UINT_MAX ? UINT_MAX : bound - out_pos;
+        bz.next_in = (char *)(data ? &data[in_pos] : data);
+        bz.avail_in = in_chunk;
+        bz.next_out = (char *)&(*out)[out_pos];
+        bz.avail_out = out_chunk;
+        ret = BZ2_bzCompress(&bz, in_pos + in_chunk == len ? BZ_FINISH : BZ_RUN);
+        in_pos += in_chunk - bz.avail_in;
+        out_pos += out_chunk - bz.avail_out;
+    } while (ret == BZ_RUN_OK || ret == BZ_FINISH_OK);
+    BZ2_bzCompressEnd(&bz);
+    if (ret != BZ_STREAM_END) {
+        mem_free(MEM_CODEC_BZIP2, *out);
+        return 0;
+    }
+    *out_len = out_pos;
+    return 1;
+}
+#endif
+
+#ifdef HAVE_OPENSSL
+// Function to write bytes as padded base64url; returns the number of characters
+size_t base64url_encode(const uint8_t *in, size_t len, uint8_t *out) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) | (i + 2 < len ? in[i + 2] : 0);
+        out[n++] = digits[v >> 18];
+        out[n++] = digits[v >> 12 & 63];
+        out[n++] = i + 1 < len ? digits[v >> 6 & 63] : '=';
+        out[n++] = i + 2 < len ? digits[v & 63] : '=';
+    }
+    return n;
+}
+
+// Function to encrypt a file's data as a FERNET payload: a fresh key in base64 (44 characters),
+// then a Fernet token (version, timestamp, IV, AES-128-CBC ciphertext and HMAC-SHA256) in base64
+int encode_fernet(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    uint8_t key[32];
+    size_t token_len = FERNET_HEAD + (len / 16 + 1) * 16 + FERNET_MAC; // PKCS7 always adds 1 to 16 bytes
+    uint8_t *token = mem_alloc(MEM_CODEC_FERNET, token_len);
+    *out = mem_alloc(MEM_CODEC_FERNET, FERNET_KEY_LEN + (token_len + 2) / 3 * 4);
+    EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+    EVP_MD_CTX *mac = EVP_MD_CTX_new();
+    int ok = token && *out && cipher && mac && RAND_bytes(key, sizeof(key)) == 1 && RAND_bytes(&token[9], 16) == 1;
+    size_t pos = FERNET_HEAD;
+    if (ok) {
+        token[0] = 0x80;
+        write_uint64(&token[1], (uint64_t)time(NULL), ENDIAN_BIG);
+        ok = EVP_EncryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, &key[16], &token[9]) == 1;
+        // EVP lengths are ints, so large files are encrypted in pieces
+        for (size_t done = 0; ok && done < len;) {
+            int chunk = len - done > (1 << 30) ? 1 << 30 : (int)(len - done), n = 0;
+            ok = EVP_EncryptUpdate(cipher, &token[pos], &n, &data[done], chunk) == 1;
+            done += chunk;
+            pos += n;
+        }
+        int n = 0;
+        ok = ok && EVP_EncryptFinal_ex(cipher, &token[pos], &n) == 1;
+        pos += n;
+    }
+    ok = ok && pos + FERNET_MAC == token_len && fernet_mac_init(mac, key) && EVP_DigestUpdate(mac, token, pos) == 1 &&
+         fernet_mac_final(mac, key, &token[pos]);
+    if (ok) {
+        base64url_encode(key, sizeof(key), *out);
+        *out_len = FERNET_KEY_LEN + base64url_encode(token, token_len, *out + FERNET_KEY_LEN);
+    } else {
+        log_error("Fernet encryption failed");
+        mem_free(MEM_CODEC_FERNET, *out);
+    }
+    EVP_MD_CTX_free(mac);
+    EVP_CIPHER_CTX_free(cipher);
+    mem_free(MEM_CODEC_FERNET, token);
+    return ok;
+}
+#endif
+
+int encode_filtered(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len);
+int encode_chain(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len);
+
+// Function to encode a file's data with the archive's method. Stored data is not copied.
+int encode_payload(Method method, const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    switch (method) {
+        case FILTERED: return encode_filtered(data, len, out, out_len);
+        case CHAIN: return encode_chain(data, len, out, out_len);
+        case NO_PROCESSING:
+            *out = (uint8_t *)data;
+            *out_len = len;
+            return 1;
+#ifdef HAVE_ZLIB
+        case ZLIB: return encode_zlib(data, len, out, out_len);
+#endif
+#ifdef HAVE_LZMA
+        case LZMA: return encode_xz(data, len, out, out_len);
+#endif
+#ifdef HAVE_OPENSSL
+        case FERNET: return encode_fernet(data, len, out, out_len);
+#endif
+#ifdef HAVE_BROTLI
+        case BROTLI: return encode_brotli(data, len, out, out_len);
+#endif
+#ifdef HAVE_BZIP2
+        case BZIP2: return encode_bzip2(data, len, out, out_len);
+#endif
+        default: return 0;
+    }
+}
+
+// Function to check whether create mode can encode a method in-process, naming the missing codec if not
+int can_encode(Method method) {
+    switch (method) {
+        case FILTERED: return can_encode(filter_chain.inner); // The filters are always native
+        case CHAIN:
+            for (int i = 0; i < method_chain.count; i++)
+                if (!can_encode(method_chain.stages[i])) return 0;
+            return 1;
+        case NO_PROCESSING: return 1;
+#ifdef HAVE_ZLIB
+        case ZLIB: return 1;
+#endif
+#ifdef HAVE_LZMA
+        case LZMA: return 1;
+#endif
+#ifdef HAVE_OPENSSL
+        case FERNET: return 1;
+#endif
+#ifdef HAVE_BROTLI
+        case BROTLI: return 1;
+#endif
+#ifdef HAVE_BZIP2
+        case BZIP2: return 1;
+#endif
+        default:
+            log_error("Method %s needs a build with its native codec", method_name(method) ? method_name(method) : "?");
+            return 0;
+    }
+}
+
+// Function to encode a file's data as a CHAIN payload: the stages of the --method list are applied
+// innermost first, each to the output of the one before, and the result follows the chain's descriptor
+int encode_chain(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    const MethodChain *chain = &method_chain;
+    uint8_t *cur = (uint8_t *)data;
+    size_t cur_len = len;
+    for (int i = chain->count - 1; i >= 0; i--) {
+        uint8_t *next = NULL;
+        size_t next_len = 0;
+        int ok = encode_payload(chain->stages[i], cur, cur_len, &next, &next_len);
+        if (cur != data) mem_free(mem_codec_tag(chain->stages[i + 1]), cur);
+        if (!ok) return 0;
+        cur = next;
+        cur_len = next_len;
+    }
+    uint8_t desc[1 + CHAIN_MAX];
+    size_t desc_len = write_method_chain(chain, desc);
+    *out = mem_alloc(MEM_CODEC_CHAIN, desc_len + cur_len);
+    if (*out) {
+        memcpy(*out, desc, desc_len);
+        memcpy(*out + desc_len, cur, cur_len);
+        *out_len = desc_len + cur_len;
+    }
+    mem_free(mem_codec_tag(chain->stages[0]), cur);
+    return *out != NULL;
+}
+
+// Function to encode a file's data as a FILTERED payload: the --filter chain is applied to a copy
+// of the data, which is then encoded with the chain's inner method behind the chain's descriptor
+int encode_filtered(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len) {
+    const FilterChain *chain = &filter_chain;
+    int scratch = 0;
+    for (int i = 0; i < chain->count; i++)
+        scratch |= chain->ids[i] == FILTER_SHUFFLE || chain->ids[i] == FILTER_BITSHUFFLE;
+    uint8_t *buf = mem_alloc(MEM_CODEC_FILTERED, len ? len : 1);
+    uint8_t *tmp = scratch ? mem_alloc(MEM_CODEC_FILTERED, len ? len : 1) : NULL;
+    if (!buf || (scratch && !tmp)) {
+        mem_free(MEM_CODEC_FILTERED, buf);
+        mem_free(MEM_CODEC_FILTERED, tmp);
+        return 0;
+    }
+    if (len) memcpy(buf, data, len);
+    for (int i = 0; i < chain->count; i++) {
+        size_t param = chain->params[i];
+        switch (chain->ids[i]) {
+            case FILTER_DELTA: delta_encode(buf, len, param); break;
+            case FILTER_BCJ_X86: bcj_x86(buf, len, 1); break;
+            case FILTER_BITSHUFFLE: bitshuffle_encode(buf, tmp, len, param); break;
+            case FILTER_SHUFFLE: {
+                size_t n = len / param;
+                shuffle_encode(buf, tmp, n, param);
+                memcpy(&tmp[n * param], &buf[n * param], len - n * param); // Bytes after the last element
+                uint8_t *swap = buf;
+                buf = tmp;
+                tmp = swap;
+                break;
+            }
+        }
+    }
+    mem_free(MEM_CODEC_FILTERED, tmp);
+
+    uint8_t *inner = NULL;
+    size_t inner_len = 0;
+    int ok = encode_payload(chain->inner, buf, len, &inner, &inner_len);
+    if (ok) {
+        uint8_t desc[2 + 2 * FILTER_MAX];
+        size_t desc_len = write_filter_chain(chain, desc);
+        *out = mem_alloc(MEM_CODEC_FILTERED, desc_len + inner_len);
+        ok = *out != NULL;
+        if (ok) {
+            memcpy(*out, desc, desc_len);
+            memcpy(*out + desc_len, inner, inner_len);
+            *out_len = desc_len + inner_len;
+        }
+        if (inner != buf) mem_free(mem_codec_tag(chain->inner), inner);
+    }
+    mem_free(MEM_CODEC_FILTERED, buf);
+    return ok;
+}
+
+#ifdef HAVE_ZLIB
+// Function to inflate a raw deflate stream that must decode to exactly out_len bytes.
+// out must hold out_len + 1 bytes so that oversized data is detected.
+int inflate_raw(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) return 0;
+    size_t in_pos = 0, out_pos = 0, out_cap = out_len + 1;
+    int ret;
+    do {
+        uInt in_chunk = in_len - in_pos > UINT_MAX ? UINT_MAX : in_len - in_pos;
+        uInt out_chunk = out_cap - out_pos > UINT_MAX ? UINT_MAX : out_cap - out_pos;
+        zs.next_in = (Bytef *)&in[in_pos];
+        zs.avail_in = in_chunk;
+        zs.next_out = &out[out_pos];
+        zs.avail_out = out_chunk;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        in_pos += in_chunk - zs.avail_in;
+        out_pos += out_chunk - zs.avail_out;
+    } while (ret == Z_OK);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END && out_pos == out_len;
+}
+#endif
+
+// Function to encode one queued file. A zip member's deflate data is inflated once to check it;
+// for ZLIB output it is then wrapped in a zlib header and Adler-32 trailer instead of recompressed.
+int pack_item_encode(PackItem *it, Method method) {
+    if (it->reuse) return 1; // Copied from the base archive as it is
+    if (!it->raw_deflate) {
+        if (!it->hashed) it->hash = hash_data(it->data, it->len);
+        it->hashed = 1;
+        return encode_payload(method, it->data, it->len, &it->payload, &it->payload_len);
+    }
+#ifdef HAVE_ZLIB
+    MemTag tag = mem_codec_tag(method);
+    uint8_t *plain = mem_alloc(tag, it->orig_size + 1);
+    if (!plain) return 0;
+    if (!inflate_raw(it->data, it->len, plain, it->orig_size) || crc32(0, plain, it->orig_size) != it->crc) {
+        log_error("Corrupt zip member %s", it->name);
+        mem_free(tag, plain);
+        return 0;
+    }
+    it->hash = hash_data(plain, it->orig_size);
+    it->hashed = 1;
+    int ok = 1;
+    if (method == ZLIB) {
+        it->payload = mem_alloc(tag, it->len + 6);
+        ok = it->payload != NULL;
+        if (ok) {
+            it->payload[0] = 0x78; // Deflate with a 32 KB window
+            it->payload[1] = 0x9c; // Default level; makes the header a multiple of 31
+            memcpy(&it->payload[2], it->data, it->len);
+            write_uint32(&it->payload[2 + it->len], adler32(adler32(0, NULL, 0), plain, it->orig_size), ENDIAN_BIG);
+            it->payload_len = it->len + 6;
+        }
+    } else {
+        ok = encode_payload(method, plain, it->orig_size, &it->payload, &it->payload_len);
+    }
+    if (it->payload != plain) mem_free(tag, plain);
+    return ok;
+#else
+    log_error("Zip member %s is deflated; converting it needs the native ZLIB build", it->name);
+    return 0;
+#endif
+}
+
+// Function to write the pending text line of a hex or xxd archive
+int writer_flush_line(ArchiveWriter *aw) {
+    if (aw->line_len == 0) return 1;
+    char text[HEX_LINE_BYTES * 4 + 32];
+    int pos = 0;
+    if (aw->text_format == 2) {
+        // xxd layout: offset, 2-byte groups, then the printable characters
+        pos += sprintf(&text[pos], "%08llx: ", (unsigned long long)aw->line_offset);
+        for (size_t i = 0; i < HEX_LINE_BYTES; i++) {
+            if (i < aw->line_len) pos += sprintf(&text[pos], "%02x", aw->line[i]);
+            else pos += sprintf(&text[pos], "  ");
+            if (i % 2 == 1) text[pos++] = ' ';
+        }
+        text[pos++] = ' ';
+        for (size_t i = 0; i < aw->line_len; i++) text[pos++] = isprint(aw->line[i]) ? aw->line[i] : '.';
+    } else {
+        for (size_t i = 0; i < aw->line_len; i++) pos += sprintf(&text[pos], "%02x", aw->line[i]);
+    }
+    text[pos++] = '\n';
+    aw->line_offset += aw->line_len;
+    aw->line_len = 0;
+    return fwrite(text, 1, pos, aw->fp) == (size_t)pos;
+}
+
+// Function to write archive bytes, as binary or as hex / xxd text
+int writer_write(ArchiveWriter *aw, const uint8_t *buf, size_t len) {
+    if (aw->text_format == 0) return fwrite(buf, 1, len, aw->fp) == len;
+    while (len > 0) {
+        size_t n = HEX_LINE_BYTES - aw->line_len < len ? HEX_LINE_BYTES - aw->line_len : len;
+        memcpy(&aw->line[aw->line_len], buf, n);
+        aw->line_len += n;
+        buf += n;
+        len -= n;
+        if (aw->line_len == HEX_LINE_BYTES && !writer_flush_line(aw)) return 0;
+    }
+    return 1;
+}
+
+// Function to copy an entry's payload from the base archive to the archive being written.
+// Binary archives use copy_file_range, so the data need not pass through user space.
+int writer_copy_base(ArchiveWriter *aw, const Entry *src) {
+    aw->reused++;
+    aw->reused_bytes += src->proc_size;
+    if (aw->text_format == 0 && aw->base.mapped && aw->base_fd >= 0 && fflush(aw->fp) == 0) {
+        loff_t in_off = src->data_offset;
+        uint64_t left = src->proc_size;
+        while (left > 0) {
+            ssize_t n = copy_file_range(aw->base_fd, &in_off, fileno(aw->fp), NULL, left, 0);
+            if (n <= 0) break; // Not supported here (e.g. across file systems): copy the rest below
+            left -= n;
+        }
+        if (fseeko(aw->fp, 0, SEEK_END) != 0) return 0; // Resynchronize the stream with the descriptor
+        return left == 0 || writer_write(aw, &aw->base.data[src->data_offset + src->proc_size - left], left);
+    }
+    return writer_write(aw, &aw->base.data[src->data_offset], src->proc_size);
+}
+
+// Function to check whether a file is unchanged since the base archive: same name, method,
+// size and modification time, and the same data hash. The payload of a match is reused.
+void writer_match_base(ArchiveWriter *aw, PackItem *it) {
+    long idx = find_entry(aw->base_table, aw->base_buckets, aw->base_entries, it->name);
+    const Entry *e = idx >= 0 ? &aw->base_entries[idx] : NULL;
+    if (!e || e->method != aw->method || e->orig_size != it->orig_size || e->mtime != it->mtime || it->mtime == 0) return;
+    if (e->method == FILTERED || e->method == CHAIN) {
+        // The base payload must have been filtered the same way, or encoded by the same stages
+        uint8_t desc[2 + 2 * FILTER_MAX + 1 + CHAIN_MAX];
+        size_t desc_len = e->method == FILTERED ? write_filter_chain(&filter_chain, desc) : write_method_chain(&method_chain, desc);
+        if (e->proc_size < desc_len || memcmp(entry_payload(&aw->base, e), desc, desc_len) != 0) return;
+    }
+    it->hash = hash_data(it->data, it->len);
+    it->hashed = 1;
+    if (it->hash != e->hash) return;
+    it->reuse = e;
+    // The input is no longer needed
+    if (it->owned == 1) mem_free(MEM_INGEST, (void *)it->data);
+    else if (it->owned == 2 && it->len > 0) munmap((void *)it->data, it->len);
+    it->data = NULL;
+    it->len = 0;
+    it->owned = 0;
+}
+
+// Function to open the archive whose unchanged payloads are reused (--base). Only archives with
+// a version 2 index record modification times and hashes; others are read but match nothing.
+int writer_set_base(ArchiveWriter *aw, const char *path) {
+    if (!open_local_archive(path, &aw->base, &aw->base_entries, &aw->base_count)) return 0;
+    aw->base_fd = open(path, O_RDONLY);
+    if (aw->base.index_version < 2) {
+        char msg[MAX_PATH + 64];
+        snprintf(msg, sizeof(msg), "Base archive %s has no file hashes; nothing will be reused", path);
+        log_message_always(msg);
+    }
+    aw->base_table = build_name_table(aw->base_entries, aw->base_count, &aw->base_buckets);
+    return aw->base_table != NULL;
+}
+
+// Function to free the input and payload of a queued file
+void pack_item_free(PackItem *it, Method method) {
+    if (it->payload && it->payload != it->data) mem_free(mem_codec_tag(method), it->payload);
+    if (it->owned == 1) mem_free(MEM_INGEST, (void *)it->data);
+    else if (it->owned == 2 && it->len > 0) munmap((void *)it->data, it->len);
+}
+
+// Function run by each encoding thread: claim files of the batch until none are left
+void *pack_worker(void *arg) {
+    ArchiveWriter *aw = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&aw->batch_next, 1, __ATOMIC_RELAXED);
+        if (i >= aw->batch_count) break;
+        aw->batch[i].ok = pack_item_encode(&aw->batch[i], aw->method);
+        if (!aw->batch[i].ok && !aw->batch[i].raw_deflate) log_error("Failed to encode %s", aw->batch[i].name);
+    }
+    return NULL;
+}
+
+// Function to encode the queued files on num_workers threads, then write them in order
+int writer_flush_batch(ArchiveWriter *aw) {
+    if (aw->batch_count == 0) return 1;
+    aw->batch_next = 0;
+    int threads = num_workers < (int)aw->batch_count ? num_workers : (int)aw->batch_count;
+    pthread_t tids[MAX_WORKERS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, pack_worker, aw) != 0) break;
+    }
+    pack_worker(aw); // The calling thread encodes too
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    int ok = 1;
+    for (size_t i = 0; i < aw->batch_count; i++) {
+        PackItem *it = &aw->batch[i];
+        if (ok && !it->ok) ok = 0;
+        if (ok && aw->count == aw->capacity) {
+            size_t capacity = aw->capacity ? aw->capacity * 2 : 64;
+            Entry *grown = mem_realloc(MEM_PARSE, aw->entries, capacity * sizeof(Entry));
+            if (grown) aw->entries = grown;
+            uint8_t **copies = grown && inline_max ?
+                mem_realloc(MEM_WRITER, aw->inline_payloads, capacity * sizeof(*copies)) : NULL;
+            if (copies) aw->inline_payloads = copies;
+            if (!grown || (inline_max && !copies)) {
+                log_error("Memory reallocation failed");
+                ok = 0;
+            } else {
+                aw->capacity = capacity;
+            }
+        }
+        if (ok) {
+            // Write the entry header and payload
+            size_t name_len = strlen(it->name);
+            Entry *e = &aw->entries[aw->count];
+            memset(e, 0, sizeof(*e));
+            memcpy(e->filename, it->name, name_len + 1);
+            e->orig_size = it->orig_size;
+            e->proc_size = it->payload_len;
+            e->method = it->reuse ? it->reuse->method : aw->method;
+            e->header_offset = aw->offset;
+            e->data_offset = aw->offset + 21 + name_len;
+            e->mtime = it->mtime;
+            e->hash = it->hash;
+            if (it->reuse) it->payload_len = e->proc_size = it->reuse->proc_size;
+            uint8_t header[4 + MAX_PATH + 17];
+            write_uint32(header, name_len, aw->ar.endian);
+            memcpy(&header[4], it->name, name_len);
+            write_uint64(&header[4 + name_len], e->orig_size, aw->ar.endian);
+            write_uint64(&header[12 + name_len], e->proc_size, aw->ar.endian);
+            header[20 + name_len] = e->method;
+            ok = writer_write(aw, header, 21 + name_len) &&
+                 (it->reuse ? writer_copy_base(aw, it->reuse) : writer_write(aw, it->payload, it->payload_len));
+            if (!ok) log_error("Failed to write archive entry %s", it->name);
+            if (ok && inline_max) {
+                // Keep a copy of a small payload for the index
+                uint8_t *copy = NULL;
+                if (e->proc_size > 0 && e->proc_size <= inline_max) {
+                    copy = mem_alloc(MEM_WRITER, e->proc_size);
+                    if (copy) {
+                        memcpy(copy, it->reuse ? entry_payload(&aw->base, it->reuse) : it->payload, e->proc_size);
+                    } else {
+                        log_error("Memory allocation failed");
+                        ok = 0;
+                    }
+                }
+                aw->inline_payloads[aw->count] = copy;
+            }
+        }
+        if (ok) {
+            aw->offset = aw->entries[aw->count].data_offset + it->payload_len;
+            aw->count++;
+            if (verbose >= 1) {
+                char msg[MAX_PATH + 96];
+                snprintf(msg, sizeof(msg), "Added %s: orig_size=%zu, proc_size=%zu", it->name, it->orig_size,
+                         it->payload_len);
+                log_message(msg);
+            }
+        }
+        pack_item_free(it, aw->method);
+    }
+    aw->batch_count = 0;
+    aw->batch_bytes = 0;
+    return ok;
+}
+
+// Function to queue a file for encoding; the batch is encoded once it is full.
+// On failure the file's input is freed.
+int writer_queue(ArchiveWriter *aw, PackItem *it) {
+    if (aw->base_table && !it->raw_deflate) writer_match_base(aw, it);
+    aw->batch[aw->batch_count++] = *it;
+    aw->batch_bytes += it->len;
+    if (aw->batch_count == PACK_BATCH_ITEMS || aw->batch_bytes >= PACK_BATCH_BYTES) return writer_flush_batch(aw);
+    return 1;
+}
+
+// Function to turn a path into an entry name: relative, without "./" and repeated or trailing "/"
+int archive_name(const char *path, char *name) {
+    while (*path == '/') path++;
+    if (strlen(path) >= MAX_PATH) {
+        log_error("Name too long for archive: %s", path);
+        return 0;
+    }
+    normalize_name(path, name);
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/') name[--len] = '\0';
+    if (strcmp(name, ".") == 0) name[0] = '\0';
+    return 1;
+}
+
+// Function to start writing an archive: binary, or hex / xxd text if the name ends in .hex / .txt
+int writer_open(ArchiveWriter *aw, const char *path, Method method) {
+    memset(aw, 0, sizeof(*aw));
+    if (!can_encode(method)) return 0;
+    aw->base_fd = -1;
+    aw->ar.endian = ENDIAN_BIG;
+    aw->ar.version = 0x01;
+    aw->method = method;
+    aw->text_format = is_hex_file(path) ? 1 : is_xxd_file(path) ? 2 : 0;
+    snprintf(aw->path, sizeof(aw->path), "%s", path);
+    snprintf(aw->tmp_path, sizeof(aw->tmp_path), "%s.tmp", path);
+    aw->batch = mem_alloc(MEM_PARSE, PACK_BATCH_ITEMS * sizeof(PackItem));
+    aw->fp = aw->batch ? fopen(aw->tmp_path, "wb") : NULL;
+    if (!aw->fp) {
+        log_error("Failed to create %s", path);
+        mem_free(MEM_PARSE, aw->batch);
+        return 0;
+    }
+    uint8_t header[5];
+    write_uint32(header, MAGIC_NUMBER, aw->ar.endian);
+    header[4] = aw->ar.version;
+    aw->offset = 5;
+    return writer_write(aw, header, 5);
+}
+
+// Function to finish an archive: write the pending files and the index, then move it into place.
+// If ok is 0 the partial archive is removed.
+int writer_close(ArchiveWriter *aw, int ok) {
+    if (ok) ok = writer_flush_batch(aw);
+    for (size_t i = 0; i < aw->batch_count; i++) pack_item_free(&aw->batch[i], aw->method); // Left by a failure
+    if (ok) {
+        // The index goes through writer_write so that text archives carry it too
+        char *index = NULL;
+        size_t index_len = 0;
+        FILE *mem = open_memstream(&index, &index_len);
+        ok = mem && write_index(mem, aw->entries, aw->count, &aw->ar, aw->offset, (const uint8_t *const *)aw->inline_payloads);
+        if (mem && fclose(mem) != 0) ok = 0;
+        if (ok) ok = writer_write(aw, (uint8_t *)index, index_len) && writer_flush_line(aw);
+        free(index);
+    }
+    if (fclose(aw->fp) != 0) ok = 0;
+    if (ok && rename(aw->tmp_path, aw->path) != 0) {
+        log_error("Failed to create %s: %s", aw->path, strerror(errno));
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(aw->tmp_path);
+    } else {
+        char msg[MAX_PATH + 64];
+        snprintf(msg, sizeof(msg), "Created %s with %zu entries", aw->path, aw->count);
+        log_message(msg);
+        if (aw->base_table) {
+            snprintf(msg, sizeof(msg), "Reused %lu payloads (%llu bytes) from the base archive", aw->reused,
+                     (unsigned long long)aw->reused_bytes);
+            log_message(msg);
+        }
+    }
+    mem_free(MEM_PARSE, aw->entries);
+    if (aw->inline_payloads) {
+        for (size_t i = 0; i < aw->count; i++) mem_free(MEM_WRITER, aw->inline_payloads[i]);
+        mem_free(MEM_WRITER, aw->inline_payloads);
+    }
+    mem_free(MEM_PARSE, aw->batch);
+    if (aw->base_table) mem_free(MEM_PARSE, aw->base_table);
+    if (aw->base_entries) {
+        mem_free(MEM_PARSE, aw->base_entries);
+        unload_archive(&aw->base);
+    }
+    if (aw->base_fd >= 0) close(aw->base_fd);
+    return ok;
+}
+
+// Function to queue one file of the file system for an archive being created
+int writer_add_file(ArchiveWriter *aw, const char *path, const char *name, size_t len, uint64_t mtime) {
+    if (name[0] == '\0' || strlen(name) >= MAX_PATH) {
+        log_error("Name too long for archive: %s", name);
+        return 0;
+    }
+    PackItem it;
+    memset(&it, 0, sizeof(it));
+    snprintf(it.name, sizeof(it.name), "%s", name);
+    it.len = it.orig_size = len;
+    it.mtime = mtime;
+    it.owned = 2;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return 0;
+    }
+    if (len > 0) {
+        void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            log_error("Failed to map %s: %s", path, strerror(errno));
+            close(fd);
+            return 0;
+        }
+        madvise(data, len, MADV_SEQUENTIAL);
+        it.data = data;
+    }
+    close(fd);
+    return writer_queue(aw, &it);
+}
+
+// Function to append a file, or every file under a directory (in name order), to an archive
+int writer_add_path(ArchiveWriter *aw, const char *path, const char *name) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        log_error("Failed to read %s: %s", path, strerror(errno));
+        return 0;
+    }
+    if (S_ISREG(st.st_mode)) return writer_add_file(aw, path, name, st.st_size, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+    if (!S_ISDIR(st.st_mode)) {
+        char msg[MAX_PATH + 32];
+        snprintf(msg, sizeof(msg), "Skipping %s: not a regular file", path);
+        log_message(msg);
+        return 1;
+    }
+    struct dirent **list;
+    int n = scandir(path, &list, NULL, alphasort);
+    if (n < 0) {
+        log_error("Failed to list %s: %s", path, strerror(errno));
+        return 0;
+    }
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        const char *child = list[i]->d_name;
+        if (ok && strcmp(child, ".") != 0 && strcmp(child, "..") != 0) {
+            char child_path[PATH_MAX], child_name[MAX_PATH];
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, child);
+            if (snprintf(child_name, sizeof(child_name), "%s%s%s", name, name[0] ? "/" : "", child) >= MAX_PATH) {
+                log_error("Name too long for archive: %s", child_path);
+                ok = 0;
+            } else {
+                ok = writer_add_path(aw, child_path, child_name);
+            }
+        }
+        free(list[i]);
+    }
+    free(list);
+    return ok;
+}
+
+// Function to create an archive (with an index) from files and directories (-c)
+int create_archive(const char *path, char **inputs, int input_count, Method method, const char *base) {
+    ArchiveWriter aw;
+    if (!writer_open(&aw, path, method)) return 0;
+    int ok = !base || writer_set_base(&aw, base);
+    for (int i = 0; ok && i < input_count; i++) {
+        char name[MAX_PATH];
+        ok = archive_name(inputs[i], name) && writer_add_path(&aw, inputs[i], name);
+    }
+    return writer_close(&aw, ok);
+}
+
+// Function to parse a numeric tar header field (octal, or base-256 for large values)
+uint64_t tar_number(const uint8_t *field, size_t len) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) value = (value << 8) | field[i];
+        return value;
+    }
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + (field[i] - '0');
+        else if (field[i] != ' ') break;
+    }
+    return value;
+}
+
+// Function to skip bytes of a stream that cannot seek
+int skip_stream(FILE *fp, uint64_t len) {
+    uint8_t buf[65536];
+    while (len > 0) {
+        size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), fp);
+        if (n == 0) return 0;
+        len -= n;
+    }
+    return 1;
+}
+
+// Function to convert a tar stream ("-" for stdin) into an archive (--from-tar).
+// Regular files are read in turn and queued, so the tar is read once from start to end.
+int import_tar(ArchiveWriter *aw, const char *src) {
+    FILE *fp = strcmp(src, "-") == 0 ? stdin : fopen(src, "rb");
+    if (!fp) {
+        log_error("Failed to open %s", src);
+        return 0;
+    }
+    uint8_t hdr[512];
+    char long_name[MAX_PATH] = ""; // Name from a GNU long name or pax header, for the next member
+    int ok = 1, zero_blocks = 0, long_name_bad = 0;
+    while (ok && fread(hdr, 1, 512, fp) == 512) {
+        // Two zero blocks end the archive
+        size_t nonzero = 0;
+        while (nonzero < 512 && hdr[nonzero] == 0) nonzero++;
+        if (nonzero == 512) {
+            if (++zero_blocks == 2) break;
+            continue;
+        }
+        zero_blocks = 0;
+
+        // The checksum covers the header with its own field read as spaces
+        uint64_t sum = 8 * ' ';
+        for (int i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? 0 : hdr[i];
+        if (sum != tar_number(&hdr[148], 8)) {
+            log_error("Corrupt tar header in %s", src);
+            ok = 0;
+            break;
+        }
+        uint64_t size = tar_number(&hdr[124], 12);
+        uint64_t padding = (512 - size % 512) % 512;
+        char type = hdr[156];
+
+        if (type == 'L' || type == 'x') {
+            // GNU long name or pax extended header: applies to the next member
+            uint8_t *meta = size < (1 << 20) ? mem_alloc(MEM_PARSE, size + 1) : NULL;
+            if (!meta || fread(meta, 1, size, fp) != size || !skip_stream(fp, padding)) {
+                log_error("Corrupt tar header in %s", src);
+                mem_free(MEM_PARSE, meta);
+                ok = 0;
+                break;
+            }
+            meta[size] = '\0';
+            const char *value = NULL;
+            size_t value_len = 0;
+            if (type == 'L') {
+                value = (const char *)meta;
+                value_len = strlen(value);
+            } else {
+                // Records are "<length> <key>=<value>\n"
+                for (size_t pos = 0; pos < size;) {
+                    unsigned long rec_len = strtoul((const char *)&meta[pos], NULL, 10);
+                    const char *key = memchr(&meta[pos], ' ', size - pos);
+                    if (rec_len == 0 || pos + rec_len > size || !key) break;
+                    if (strncmp(key + 1, "path=", 5) == 0) {
+                        value = key + 6;
+                        value_len = (const char *)&meta[pos + rec_len - 1] - value; // Drop the newline
+                    }
+                    pos += rec_len;
+                }
+            }
+            if (value) {
+                long_name_bad = value_len >= MAX_PATH;
+                if (!long_name_bad) {
+                    memcpy(long_name, value, value_len);
+                    long_name[value_len] = '\0';
+                }
+            }
+            mem_free(MEM_PARSE, meta);
+            continue;
+        }
+
+        // ustar names are prefix + "/" + name; neither field needs a terminator
+        char full[MAX_PATH + 160], name[MAX_PATH];
+        int name_len = strnlen((const char *)hdr, 100);
+        int prefix_len = memcmp(&hdr[257], "ustar", 5) == 0 ? (int)strnlen((const char *)&hdr[345], 155) : 0;
+        if (long_name[0]) snprintf(full, sizeof(full), "%s", long_name);
+        else if (prefix_len) snprintf(full, sizeof(full), "%.*s/%.*s", prefix_len, &hdr[345], name_len, hdr);
+        else snprintf(full, sizeof(full), "%.*s", name_len, hdr);
+        long_name[0] = '\0';
+
+        if (type == '0' || type == '\0' || type == '7') {
+            if (long_name_bad || !archive_name(full, name) || name[0] == '\0') {
+                log_error("Name too long for archive: %s", full);
+                ok = 0;
+                break;
+            }
+            PackItem it;
+            memset(&it, 0, sizeof(it));
+            snprintf(it.name, sizeof(it.name), "%s", name);
+            it.len = it.orig_size = size;
+            it.mtime = tar_number(&hdr[136], 12) * 1000000000ULL;
+            it.owned = 1;
+            uint8_t *data = mem_alloc(MEM_INGEST, size ? size : 1);
+            if (!data || fread(data, 1, size, fp) != size || !skip_stream(fp, padding)) {
+                log_error(data ? "Truncated tar member %s" : "Memory allocation failed for %s", full);
+                mem_free(MEM_INGEST, data);
+                ok = 0;
+                break;
+            }
+            it.data = data;
+            ok = writer_queue(aw, &it);
+        } else {
+            // Directories are implied by the file names; links and devices are not archived
+            if (type != '5' && type != 'g') {
+                char msg[MAX_PATH + 200];
+                snprintf(msg, sizeof(msg), "Skipping %s: not a regular file", full);
+                log_message(msg);
+            }
+            if (!skip_stream(fp, size + padding)) {
+                log_error("Truncated tar member %s", full);
+                ok = 0;
+            }
+        }
+        long_name_bad = 0;
+    }
+    if (ok && ferror(fp)) {
+        log_error("Failed to read %s", src);
+        ok = 0;
+    }
+    if (fp != stdin) fclose(fp);
+    return ok;
+}
+
+// Function to find a zip64 extended information field (zip sizes and offsets that do not fit 32 bits)
+const uint8_t *zip64_extra(const uint8_t *extra, size_t len) {
+    for (size_t pos = 0; pos + 4 <= len;) {
+        uint16_t id = extra[pos] | (extra[pos + 1] << 8);
+        uint16_t size = extra[pos + 2] | (extra[pos + 3] << 8);
+        if (pos + 4 + size > len) break;
+        if (id == 0x0001) return &extra[pos + 4];
+        pos += 4 + size;
+    }
+    return NULL;
+}
+
+// Function to convert a zip file into an archive (--from-zip). Members are found through the
+// central directory; deflated members are passed through as ZLIB when that is the output method.
+int import_zip(ArchiveWriter *aw, const char *src) {
+    Archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!load_binary_archive(src, &zip)) return 0;
+    const uint8_t *d = zip.data;
+    size_t len = zip.len;
+
+    // Find the end of central directory record (it may be followed by a comment)
+    size_t eocd = len;
+    for (size_t pos = len >= 22 ? len - 22 : 0; len >= 22; pos--) {
+        if (read_uint32(&d[pos], ENDIAN_LITTLE) == 0x06054b50) {
+            eocd = pos;
+            break;
+        }
+        if (pos == 0 || len - pos > 22 + 65535) break;
+    }
+    if (eocd == len) {
+        log_error("%s is not a zip file", src);
+        unload_archive(&zip);
+        return 0;
+    }
+    uint64_t count = d[eocd + 10] | (d[eocd + 11] << 8);
+    uint64_t cd_offset = read_uint32(&d[eocd + 16], ENDIAN_LITTLE);
+    if (eocd >= 20 && read_uint32(&d[eocd - 20], ENDIAN_LITTLE) == 0x07064b50) {
+        uint64_t z64 = read_uint64(&d[eocd - 12], ENDIAN_LITTLE); // zip64 end of central directory
+        if (z64 + 56 <= len && read_uint32(&d[z64], ENDIAN_LITTLE) == 0x06064b50) {
+            count = read_uint64(&d[z64 + 32], ENDIAN_LITTLE);
+            cd_offset = read_uint64(&d[z64 + 48], ENDIAN_LITTLE);
+        }
+    }
+
+    int ok = 1;
+    size_t pos = cd_offset;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        if (pos + 46 > len || read_uint32(&d[pos], ENDIAN_LITTLE) != 0x02014b50) {
+            log_error("Corrupt zip central directory in %s", src);
+            ok = 0;
+            break;
+        }
+        uint16_t flags = d[pos + 8] | (d[pos + 9] << 8);
+        uint16_t method = d[pos + 10] | (d[pos + 11] << 8);
+        uint32_t crc = read_uint32(&d[pos + 16], ENDIAN_LITTLE);
+        uint64_t csize = read_uint32(&d[pos + 20], ENDIAN_LITTLE);
+        uint64_t usize = read_uint32(&d[pos + 24], ENDIAN_LITTLE);
+        size_t name_len = d[pos + 28] | (d[pos + 29] << 8);
+        size_t extra_len = d[pos + 30] | (d[pos + 31] << 8);
+        size_t comment_len = d[pos + 32] | (d[pos + 33] << 8);
+        uint64_t local = read_uint32(&d[pos + 42], ENDIAN_LITTLE);
+        if (pos + 46 + name_len + extra_len > len) {
+            log_error("Corrupt zip central directory in %s", src);
+            ok = 0;
+            break;
+        }
+        // zip64 fields appear only for the values saturated at 0xFFFFFFFF, in this order
+        const uint8_t *z64 = zip64_extra(&d[pos + 46 + name_len], extra_len);
+        if (z64 && usize == 0xFFFFFFFF) usize = read_uint64(z64, ENDIAN_LITTLE), z64 += 8;
+        if (z64 && csize == 0xFFFFFFFF) csize = read_uint64(z64, ENDIAN_LITTLE), z64 += 8;
+        if (z64 && local == 0xFFFFFFFF) local = read_uint64(z64, ENDIAN_LITTLE);
+        char full[MAX_PATH + 64];
+        snprintf(full, sizeof(full), "%.*s", (int)(name_len < MAX_PATH + 32 ? name_len : MAX_PATH + 32), &d[pos + 46]);
+        pos += 46 + name_len + extra_len + comment_len;
+        if (name_len > 0 && full[strlen(full) - 1] == '/') continue; // Directory
+
+        // The data follows the local header, whose name and extra field may differ in length
+        if (local + 30 > len || read_uint32(&d[local], ENDIAN_LITTLE) != 0x04034b50) {
+            log_error("Corrupt zip member %s", full);
+            ok = 0;
+            break;
+        }
+        uint64_t data = local + 30 + (d[local + 26] | (d[local + 27] << 8)) + (d[local + 28] | (d[local + 29] << 8));
+        char name[MAX_PATH];
+        if (data > len || csize > len - data) {
+            log_error("Corrupt zip member %s", full);
+            ok = 0;
+        } else if (flags & 1) {
+            log_error("Zip member %s is encrypted", full);
+            ok = 0;
+        } else if (method != 0 && method != 8) {
+            log_error("Zip member %s uses unsupported method %u", full, method);
+            ok = 0;
+        } else if (method == 0 && csize != usize) {
+            log_error("Corrupt zip member %s", full);
+            ok = 0;
+        } else if (!archive_name(full, name) || name[0] == '\0' || name_len >= MAX_PATH) {
+            log_error("Name too long for archive: %s", full);
+            ok = 0;
+        } else {
+            PackItem it;
+            memset(&it, 0, sizeof(it));
+            snprintf(it.name, sizeof(it.name), "%s", name);
+            it.data = &d[data];
+            it.len = csize;
+            it.orig_size = usize;
+            it.raw_deflate = method == 8;
+            it.crc = crc;
+            ok = writer_queue(aw, &it);
+        }
+    }
+    // Members point into the mapping, so they are written before it is released
+    if (ok) ok = writer_flush_batch(aw);
+    unload_archive(&zip);
+    return ok;
+}
+
+// Function to convert a tar or zip file into an archive (--from-tar, --from-zip)
+int convert_archive(const char *path, const char *src, int is_zip, Method method, const char *base) {
+    ArchiveWriter aw;
+    if (!writer_open(&aw, path, method)) return 0;
+    int ok = !base || writer_set_base(&aw, base);
+    if (ok) ok = is_zip ? import_zip(&aw, src) : import_tar(&aw, src);
+    return writer_close(&aw, ok);
+}
+
+// Comparison function ordering entry indices by decreasing access count, then by archive position.
+// A shadowed entry sorts by the access count of the entry that replaces it, so it stays ahead of it.
+const Entry *reorder_sort_entries = NULL; // Entry table seen by compare_entry_accesses
+int compare_entry_accesses(const void *a, const void *b) {
+    size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+    const Entry *ea = &reorder_sort_entries[ia], *eb = &reorder_sort_entries[ib];
+    if (ea->shadowed_by >= 0) ea = &reorder_sort_entries[ea->shadowed_by];
+    if (eb->shadowed_by >= 0) eb = &reorder_sort_entries[eb->shadowed_by];
+    uint64_t ca = ea->accesses, cb = eb->accesses;
+    if (ca != cb) return ca > cb ? -1 : 1;
+    return ia < ib ? -1 : (ia > ib);
+}
+
+// Function to rewrite an archive with its most read entries first, by their access stats (--reorder).
+// Payloads are copied as they are; entries read equally often keep their relative order, and older
+// copies of a path move with its last copy, so the same copy still wins. The new archive gets a
+// copy of the access stats.
+int reorder_archive(const char *input, const char *path) {
+    ArchiveWriter aw;
+    if (!writer_open(&aw, path, NO_PROCESSING)) return 0;
+    int ok = open_local_archive(input, &aw.base, &aw.base_entries, &aw.base_count);
+    if (ok) aw.base_fd = open(input, O_RDONLY);
+    char stats[MAX_PATH];
+    sidecar_path(input, ACCESS_SUFFIX, stats, sizeof(stats));
+    if (ok) ok = load_access_counts(stats, aw.base_entries, aw.base_count);
+    if (ok) ok = mark_shadowed_entries(aw.base_entries, aw.base_count);
+    size_t *order = ok ? mem_alloc(MEM_PARSE, (aw.base_count ? aw.base_count : 1) * sizeof(size_t)) : NULL;
+    if (ok && !order) {
+        log_error("Memory allocation failed");
+        ok = 0;
+    }
+    size_t hot = 0;
+    uint64_t hot_bytes = 0;
+    if (ok) {
+        for (size_t i = 0; i < aw.base_count; i++) order[i] = i;
+        reorder_sort_entries = aw.base_entries;
+        qsort(order, aw.base_count, sizeof(size_t), compare_entry_accesses);
+    }
+    for (size_t i = 0; ok && i < aw.base_count; i++) {
+        const Entry *e = &aw.base_entries[order[i]];
+        if (e->accesses) {
+            hot++;
+            hot_bytes += e->proc_size;
+        }
+        PackItem it;
+        memset(&it, 0, sizeof(it));
+        memcpy(it.name, e->filename, sizeof(it.name));
+        it.orig_size = e->orig_size;
+        it.mtime = e->mtime;
+        it.hash = e->hash;
+        it.hashed = 1;
+        it.reuse = e;
+        ok = writer_queue(&aw, &it);
+    }
+    mem_free(MEM_PARSE, order);
+    if (ok) ok = writer_flush_batch(&aw);
+    if (ok) {
+        char msg[MAX_PATH + 96];
+        snprintf(msg, sizeof(msg), "Moved %zu accessed entries (%llu bytes) to the front of %s", hot,
+                 (unsigned long long)hot_bytes, path);
+        log_message_always(msg);
+        sidecar_path(path, ACCESS_SUFFIX, stats, sizeof(stats));
+        if (stats[0]) save_access_counts(stats, aw.base_entries, aw.base_count);
+    }
+    return writer_close(&aw, ok);
+}
+
+#ifndef ARCHEX_NO_MAIN // Defined by archex_bench.c, which links the primitives into its own main
+// Main function to parse arguments and process the archive
+int main(int argc, char *argv[]) {
+    // Initialize default parameters
+    char *input_file = NULL;
+    char *first_spec = NULL;
+    char *only_spec = NULL;
+    char *read_name = NULL;
+    char *serve_path = NULL;
+    char *pack_path = NULL;
+    char *pack_get_name = NULL;
+    char *reorder_path = NULL;
+    int resume = 0;
+    char *create_path = NULL;
+    char *convert_src = NULL;
+    char *base_path = NULL;
+    int convert_zip = 0;
+    char *create_inputs[argc];
+    int create_input_count = 0;
+    Method create_method = NO_PROCESSING;
+    unsigned long long range_offset = 0, range_len = UINT64_MAX;
+    int index_only = 0;
+    verbose = 0;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) input_file = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            if (output_root_count == MAX_ROOTS) {
+                fprintf(stderr, "At most %d output directories are supported\n", MAX_ROOTS);
+                return 1;
+            }
+            output_roots[output_root_count++].path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--root-depth") == 0 && i + 1 < argc) root_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v") == 0) verbose = (i + 1 < argc && isdigit(argv[i + 1][0])) ? atoi(argv[++i]) : 1;
+        else if (strcmp(argv[i], "--stats") == 0) stats_enabled = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) num_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--pool-budget") == 0 && i + 1 < argc) pool_budget = (size_t)atol(argv[++i]) << 20;
+        else if (strcmp(argv[i], "--keep-duplicates") == 0) keep_duplicates = 1;
+        else if (strcmp(argv[i], "--first") == 0 && i + 1 < argc) first_spec = argv[++i];
+        else if (strcmp(argv[i], "--notify-touch") == 0 && i + 1 < argc) notify_touch = argv[++i];
+        else if (strcmp(argv[i], "--notify-fd") == 0 && i + 1 < argc) notify_fd = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d/%d", &shard_index, &shard_count) != 2 || shard_count < 1 ||
+                shard_index < 0 || shard_index >= shard_count) {
+                fprintf(stderr, "Invalid shard '%s' (expected i/N with 0 <= i < N)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--shard-by") == 0 && i + 1 < argc) shard_by_size = strcmp(argv[++i], "size") == 0;
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) only_spec = argv[++i];
+        else if (strcmp(argv[i], "--add-index") == 0) index_only = 1;
+        else if (strcmp(argv[i], "--inline-max") == 0 && i + 1 < argc) inline_max = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (!parse_filter_spec(argv[++i], &filter_chain)) {
+                fprintf(stderr, "Invalid filter list '%s' (expected up to %d of delta[:<distance>], shuffle[:<size>], "
+                        "bitshuffle[:<size>], bcj)\n", argv[i], FILTER_MAX);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fetch-jobs") == 0 && i + 1 < argc) fetch_jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--checkpoint-span") == 0 && i + 1 < argc) checkpoint_span = (size_t)atol(argv[++i]) << 20;
+        else if (strcmp(argv[i], "--read") == 0 && i + 1 < argc) read_name = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) serve_path = argv[++i];
+        else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) pack_path = argv[++i];
+        else if (strcmp(argv[i], "--pack-get") == 0 && i + 1 < argc) pack_get_name = argv[++i];
+        else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) reorder_path = argv[++i];
+        else if (strcmp(argv[i], "--no-access-stats") == 0) record_access = 0;
+        else if (strcmp(argv[i], "--resume") == 0) resume = 1;
+        else if (strcmp(argv[i], "--locality") == 0) locality = 1;
+        else if (strcmp(argv[i], "--drain-timeout") == 0 && i + 1 < argc) drain_timeout = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--io-limit") == 0 && i + 1 < argc) bucket_init(&io_bytes, atof(argv[++i]) * (1 << 20), IO_CHUNK);
+        else if (strcmp(argv[i], "--iops-limit") == 0 && i + 1 < argc) bucket_init(&io_ops, atof(argv[++i]), 1);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) create_path = argv[++i];
+        else if (strcmp(argv[i], "--base") == 0 && i + 1 < argc) base_path = argv[++i];
+        else if (strcmp(argv[i], "--from-tar") == 0 && i + 1 < argc) convert_src = argv[++i], convert_zip = 0;
+        else if (strcmp(argv[i], "--from-zip") == 0 && i + 1 < argc) convert_src = argv[++i], convert_zip = 1;
+        else if (strcmp(argv[i], "--xz-threads") == 0 && i + 1 < argc) xz_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) xz_block_size = (size_t)atol(argv[++i]) << 20;
+        else if (strcmp(argv[i], "--method") == 0 && i + 1 < argc) {
+            if (!parse_method_spec(argv[++i], &create_method, &method_chain)) {
+                fprintf(stderr, "Invalid method '%s' (expected none, zlib, lzma, fernet, brotli or bzip2, or up to %d of zlib, "
+                        "lzma and fernet separated by commas)\n", argv[i], CHAIN_MAX);
+                return 1;
+            }
+        }
+        else if (argv[i][0] != '-') create_inputs[create_input_count++] = argv[i];
+        else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%llu:%llu", &range_offset, &range_len) < 1) {
+                fprintf(stderr, "Invalid range '%s' (expected <offset>[:<length>])\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    if (inline_max > INLINE_MAX_LIMIT) {
+        fprintf(stderr, "Inline payload size must be at most %d bytes\n", INLINE_MAX_LIMIT);
+        return 1;
+    }
+
+    // Create an archive instead of extracting one
+    if (create_path) {
+        if (filter_chain.count) {
+            // The first --method compresses the filtered data; before a cipher, the filters get a stage of their own
+            Method *first = method_chain.count ? &method_chain.stages[method_chain.count - 1] : &create_method;
+            if (*first == BROTLI || *first == BZIP2) {
+                fprintf(stderr, "--filter works with none, zlib, lzma and fernet only\n");
+                return 1;
+            } else if (*first != FERNET) {
+                filter_chain.inner = *first;
+                *first = FILTERED;
+            } else if (method_chain.count < CHAIN_MAX) {
+                if (!method_chain.count) method_chain.stages[method_chain.count++] = FERNET;
+                filter_chain.inner = NO_PROCESSING;
+                method_chain.stages[method_chain.count++] = FILTERED;
+                create_method = CHAIN;
+            } else {
+                fprintf(stderr, "--filter allows at most %d methods in --method\n", CHAIN_MAX - 1);
+                return 1;
+            }
+        }
+        if ((create_input_count == 0) == (convert_src == NULL) || xz_block_size == 0 || num_workers < 1 ||
+            num_workers > MAX_WORKERS) {
+            fprintf(stderr, "Usage: %s -c <archive.arch|.hex|.txt> [--method <method,...>] [--block-size <MB>] [--xz-threads <n>]\n"
+                    "       [-j <workers>] [--base <previous archive>] [--inline-max <bytes>]\n"
+                    "       [--filter <filter,...>] <path>... | --from-tar <file.tar|-> | --from-zip <file.zip>\n", argv[0]);
+            return 1;
+        }
+        log_fp = fopen(LOG_FILE, "a");
+        if (!log_fp) {
+            fprintf(stderr, "Failed to open log file\n");
+            return 1;
+        }
+        int ok = convert_src ? convert_archive(create_path, convert_src, convert_zip, create_method, base_path)
+                             : create_archive(create_path, create_inputs, create_input_count, create_method, base_path);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Write one entry of a pack file to stdout
+    if (pack_get_name && pack_path) {
+        log_fp = fopen(LOG_FILE, "a");
+        if (!log_fp) {
+            fprintf(stderr, "Failed to open log file\n");
+            return 1;
+        }
+        int ok = packfile_get(pack_path, pack_get_name);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Check if input file is provided
+    if (!input_file || (pack_path && (output_root_count > 1 || resume))) {
+        fprintf(stderr, "Usage: %s -i <input_file> [-o <output_dir>]... [--root-depth <n>] [-v [0|1|2]] [-j <workers>] [--pool-budget <MB>] [--keep-duplicates]\n"
+                "       [--first <glob,...|@file>] [--notify-touch <file>] [--notify-fd <fd>]\n"
+                "       [--shard <i>/<N>] [--shard-by hash|size] [--only <glob,...|@file>] [--fetch-jobs <n>] [--stats]\n"
+                "       [--checkpoint-span <MB>] [--xz-threads <n>] [--pack <file>] [--no-access-stats]\n"
+                "       [--io-limit <MB/s>] [--iops-limit <ops/s>] [--resume] [--drain-timeout <seconds>] [--locality]\n"
+                "       %s --pack <file> --pack-get <name>\n"
+                "       %s -i <archive.arch> --add-index [--inline-max <bytes>]\n"
+                "       %s -i <archive> --reorder <new archive> [--inline-max <bytes>]\n"
+                "       %s -i <input_file> --read <name> [--range <offset>[:<length>]]\n"
+                "       %s -i <archive> --serve <socket> [-j <threads>]\n"
+                "       %s -c <archive> [--method <method,...>] [--filter <filter,...>] [-j <workers>] <path>... | --from-tar <file> | --from-zip <file>\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (fetch_jobs < 1 || fetch_jobs > MAX_WORKERS) {
+        fprintf(stderr, "Fetch job count must be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
+    if (num_workers < 1 || num_workers > MAX_WORKERS) {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
+
+    // Open log file in append mode
+    log_fp = fopen(LOG_FILE, "a");
+    if (!log_fp) {
+        fprintf(stderr, "Failed to open log file\n");
+        return 1;
+    }
+
+    // Append an index to the archive instead of extracting it
+    if (index_only) {
+        int ok = add_index(input_file);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Rewrite the archive with its most read entries first
+    if (reorder_path) {
+        int ok = reorder_archive(input_file, reorder_path);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Write part of one entry to stdout instead of extracting
+    if (read_name) {
+        verbose = 0; // stdout carries the data
+        int ok = read_entry(input_file, read_name, range_offset, range_len);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Hand decoded entries to local consumers instead of extracting
+    if (serve_path) {
+        int ok = serve_archive(input_file, serve_path);
+        fclose(log_fp);
+        return ok ? 0 : 1;
+    }
+
+    // Create the output directories if they don’t exist
+    if (output_root_count == 0) output_roots[output_root_count++].path = "./extracted";
+    for (int r = 0; r < output_root_count; r++) {
+        if (mkdir(output_roots[r].path, 0755) && errno != EEXIST) {
+            log_error("Failed to create output directory");
             fclose(log_fp);
-            fclose(report_fp);
             return 1;
         }
-        endian = ENDIAN_LITTLE;
+        pthread_mutex_init(&output_roots[r].lock, NULL);
+        pthread_cond_init(&output_roots[r].slot, NULL);
+    }
+    const char *output_dir = output_roots[0].path; // Holds the metadata report
+
+    // Open metadata report file (one per shard, so shard reports can be concatenated)
+    char report_path[MAX_PATH];
+    if (shard_count > 1) snprintf(report_path, MAX_PATH, "%s/metadata.shard-%d-of-%d.txt", output_dir, shard_index, shard_count);
+    else snprintf(report_path, MAX_PATH, "%s/%s", output_dir, REPORT_FILE);
+    report_fp = fopen(report_path, "w");
+    if (!report_fp) {
+        log_error("Failed to open report file");
+        fclose(log_fp);
+        return 1;
     }
 
-    // Read the version number directly from the archive (at offset 0x04)
-    uint8_t version = data[4];
+    // Load the input archive (hex and xxd into memory, binary by mapping it, remote through its index)
+    Archive ar;
+    Entry *entries = NULL;
+    size_t entry_count = 0;
+    if (!open_archive(input_file, &ar, &entries, &entry_count)) {
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+    sample_rss(STAGE_INGEST);
     char version_msg[64];
-    snprintf(version_msg, 64, "Read version 0x%02x from archive", version);
+    snprintf(version_msg, 64, "Read version 0x%02x from archive", ar.version);
     log_message(version_msg); // Log the version read from the file
 
-    // Process each file entry in the archive
-    size_t offset = 5; // Start after magic number and version
-    while (offset < data_len) {
-        if (!process_file_entry(data, &offset, data_len, output_dir, endian)) {
-            log_message("Continuing after error in file entry");
+    // Select the entries matching --only
+    if (only_spec) {
+        PatternList only = {0};
+        if (!load_patterns(only_spec, &only)) {
+            free_patterns(&only);
+            mem_free(MEM_PARSE, entries);
+            unload_archive(&ar);
+            fclose(log_fp);
+            fclose(report_fp);
+            return 1;
+        }
+        for (size_t i = 0; i < entry_count; i++) entries[i].selected = match_patterns(&only, entries[i].filename);
+        free_patterns(&only);
+    }
+
+    // Find entries that a later entry with the same path would overwrite
+    if (!mark_shadowed_entries(entries, entry_count)) {
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+    if (!keep_duplicates) report_shadowed_entries(entries, entry_count);
+
+    // Split the entries between the shards
+    if (!assign_shards(entries, entry_count)) {
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+
+    // Place the entries on the output roots
+    if (!assign_roots(entries, entry_count) || (output_root_count > 1 && !write_manifest(entries, entry_count))) {
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+
+    // Write file details to the metadata report, in archive order
+    for (size_t i = 0; i < entry_count; i++) {
+        const char *method_str = method_name(entries[i].method);
+        if (!method_str) continue; // Reported as an error during extraction
+        if (!is_extracted(&entries[i])) continue; // Skipped duplicate or another shard's entry
+        fprintf(report_fp, "%s\t%llu\t%llu\t%s\n", entries[i].filename, (unsigned long long)entries[i].orig_size,
+                (unsigned long long)entries[i].proc_size, method_str);
+    }
+
+    // Skip the entries an interrupted run finished
+    char journal[MAX_PATH + 32];
+    journal_path(journal, sizeof(journal));
+    size_t resumed = resume ? load_journal(journal, &ar, entries, entry_count) : 0;
+    if (resume) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "Resuming: %zu entries were already extracted", resumed);
+        log_message_always(msg);
+    }
+
+    // Schedule the entries, putting those matching --first ahead of the rest
+    PatternList first = {0};
+    if (first_spec && !load_patterns(first_spec, &first)) {
+        free_patterns(&first);
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+    size_t order_count = 0;
+    size_t *order = build_schedule(entries, entry_count, &first, &order_count);
+    free_patterns(&first);
+    if (!order) {
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+    fflush(report_fp); // The report is complete before any entry is extracted
+
+    // Download only the data of the scheduled entries of a remote archive
+    if (ar.remote && !fetch_scheduled_entries(&ar, entries, order, order_count)) {
+        mem_free(MEM_PARSE, order);
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+
+    // Lay the entries out in a single pack file instead of a file tree, or journal the finished files
+    if (pack_path ? !open_packfile(pack_path, entries, order, order_count) : !open_journal(journal, &ar, resumed > 0)) {
+        mem_free(MEM_PARSE, order);
+        mem_free(MEM_PARSE, entries);
+        unload_archive(&ar);
+        fclose(log_fp);
+        fclose(report_fp);
+        return 1;
+    }
+
+    // Decode and write every scheduled entry
+    size_t priority_count = 0;
+    for (size_t i = 0; i < order_count; i++) priority_count += entries[order[i]].priority;
+    if (first_spec && priority_count == 0) notify_first_ready(0); // Nothing to wait for
+#ifdef HAVE_ZLIB
+    // Large ZLIB entries record checkpoints for later range reads into a sidecar of the archive
+    char sidecar[MAX_PATH];
+    sidecar_path(input_file, CHECKPOINT_SUFFIX, sidecar, sizeof(sidecar));
+    if (sidecar[0] && checkpoint_span) load_checkpoints(sidecar, ar.len);
+#endif
+    // SIGINT and SIGTERM stop admitting entries and let the ones in flight finish; a second one kills
+    struct sigaction stop_action = {0}, default_action = {0};
+    stop_action.sa_handler = request_stop;
+    stop_action.sa_flags = SA_RESTART | SA_RESETHAND;
+    default_action.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    extract_entries(&ar, entries, entry_count, order, order_count);
+    sigaction(SIGINT, &default_action, NULL);
+    sigaction(SIGTERM, &default_action, NULL);
+    report_roots();
+#ifdef HAVE_ZLIB
+    if (sidecar[0] && checkpoint_span) save_checkpoints(sidecar, ar.len);
+    free_checkpoints();
+#endif
+    if (packfile_fd >= 0) {
+        write_packfile_index(pack_path, entries, order, order_count);
+        close(packfile_fd);
+    }
+
+    // The journal is only kept while there is something left to resume
+    if (journal_fp) {
+        size_t left = 0;
+        for (size_t i = 0; i < order_count; i++) left += entries[order[i]].failed;
+        fclose(journal_fp);
+        journal_fp = NULL;
+        if (left == 0) unlink(journal);
+        if (stop_signal) {
+            char msg[160];
+            snprintf(msg, sizeof(msg), "Stopped by signal %d with %zu entries left; run again with --resume to finish them",
+                     (int)stop_signal, left);
+            log_message_always(msg);
         }
     }
 
+    // A selective extraction counts as a read of each entry in the archive's access stats
+    if (only_spec) {
+        for (size_t i = 0; i < order_count; i++) entries[order[i]].accesses = !entries[order[i]].failed;
+        flush_accesses(input_file, entries, entry_count);
+    }
+
     // Clean up resources
-    free(data);
+    mem_free(MEM_PARSE, order);
+    mem_free(MEM_PARSE, entries);
+    unload_archive(&ar);
+    if (stats_enabled) print_stats();
     fclose(log_fp);
     fclose(report_fp);
-    return 0; // Success
+    return stop_signal ? 128 + stop_signal : 0; // Success, or the status of the signal that stopped the run
 }
+#endif
@@ -0,0 +1,687 @@
+// Microbenchmarks for the archex primitives.
+// Build: gcc -O2 -o archex_bench archex_bench.c
+//        (add -DHAVE_ZLIB -DHAVE_LZMA -lz -llzma for the native codec cases,
+//         -DHAVE_OPENSSL -lcrypto for the method chain cases, and
+//         -DHAVE_BROTLI -DHAVE_BZIP2 -lbrotlidec -lbrotlienc -lbz2 for the brotli and bzip2 cases)
+// Run:   ./archex_bench [-c <cpu>] [-w <warmup_ms>] [-t <target_ms>] [filter]
+#define _GNU_SOURCE
+#define ARCHEX_NO_MAIN // Pull in the primitives without archex's main()
+#include "archex.c"
+
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // For __rdtsc
+#define HAVE_RDTSC 1
+#endif
+
+#define BENCH_MAX_SIZE (1 << 20) // Largest input size measured
+#define BENCH_MAX_ALIGN 64 // Extra room for misaligned inputs
+#define TREE_DIRS 64 // Directories of the extracted tree in the layout cases
+#define TREE_FILES 4096 // Files of the extracted tree, spread round-robin over the directories
+#define TREE_FILE_SIZE 16384 // Size of each file of the tree
+#define TREE_READS 3 // Cold-cache walks timed per layout
+#define TABLE_ENTRIES 4096 // Entries of the synthetic archive in the entry table cases
+#define TABLE_PAYLOAD 64 // Payload bytes of each of those entries
+#include <dirent.h>
+
+// Benchmark settings (overridable from the command line)
+int bench_cpu = 0; // CPU to pin to (-1: no pinning)
+double bench_warmup_ms = 20.0; // Time spent warming up each case
+double bench_target_ms = 100.0; // Time spent measuring each case
+const char *bench_filter = NULL; // Only run cases whose name contains this
+volatile uint64_t bench_sink = 0; // Keeps results alive so loops are not optimized away
+
+// Context shared by the benchmark cases
+typedef struct {
+    uint8_t *buf; // Input bytes, offset by the alignment under test
+    size_t size; // Input size in bytes
+    char *text; // Hex text input for the line decoder
+    size_t text_len; // Length of the hex text
+    int is_xxd; // Line format for the hex decoder
+    const char *dir; // Directory argument for the path cases
+    const char *name; // File name argument for the path cases
+    uint8_t *packed; // Compressed input for the codec cases
+    size_t packed_len; // Length of the compressed input
+    uint8_t *out; // Output buffer for the codec cases
+    Worker *worker; // Worker whose codec state the codec cases reuse
+    Archive *ar; // Indexed archive for the entry table cases
+    uint8_t *mid; // Intermediate buffer of the staged chain case
+    size_t mid_len; // Bytes the first stage of the staged chain case decodes to
+} BenchCtx;
+
+typedef void (*BenchFn)(BenchCtx *ctx);
+
+// Function to read a monotonic clock in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Function to read the cycle counter (0 if the platform has none)
+static uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Function to pin the benchmark to a single CPU to reduce noise
+static void pin_cpu(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        fprintf(stderr, "warning: could not pin to CPU %d: %s\n", cpu, strerror(errno));
+}
+
+// Function to run one case: warm up, then time batches until the target time is reached
+static void run_case(const char *name, size_t bytes, size_t align, BenchFn fn, BenchCtx *ctx) {
+    if (bench_filter && !strstr(name, bench_filter)) return;
+
+    // Warm up caches, branch predictors and CPU frequency
+    double start = now_ns();
+    while (now_ns() - start < bench_warmup_ms * 1e6) fn(ctx);
+
+    // Measure in growing batches to keep timer overhead negligible
+    uint64_t ops = 0, batch = 1;
+    uint64_t c0 = now_cycles();
+    double t0 = now_ns(), elapsed = 0;
+    while (elapsed < bench_target_ms * 1e6) {
+        for (uint64_t i = 0; i < batch; i++) fn(ctx);
+        ops += batch;
+        if (batch < (1u << 20)) batch *= 2;
+        elapsed = now_ns() - t0;
+    }
+    uint64_t cycles = now_cycles() - c0;
+
+    double ns_op = elapsed / ops;
+    double cyc_byte = bytes ? (double)cycles / ops / bytes : 0;
+    printf("%-24s %9zu %5zu %12.1f %10.3f\n", name, bytes, align, ns_op, cyc_byte);
+    fflush(stdout);
+}
+
+// Cases for the integer readers: decode every word of the buffer
+static void bench_read_uint32_le(BenchCtx *ctx) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i + 4 <= ctx->size; i += 4) acc += read_uint32(&ctx->buf[i], ENDIAN_LITTLE);
+    bench_sink += acc;
+}
+
+static void bench_read_uint32_be(BenchCtx *ctx) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i + 4 <= ctx->size; i += 4) acc += read_uint32(&ctx->buf[i], ENDIAN_BIG);
+    bench_sink += acc;
+}
+
+static void bench_read_uint64_le(BenchCtx *ctx) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i + 8 <= ctx->size; i += 8) acc += read_uint64(&ctx->buf[i], ENDIAN_LITTLE);
+    bench_sink += acc;
+}
+
+static void bench_read_uint64_be(BenchCtx *ctx) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i + 8 <= ctx->size; i += 8) acc += read_uint64(&ctx->buf[i], ENDIAN_BIG);
+    bench_sink += acc;
+}
+
+// Case for the file hash create mode uses to recognize unchanged files
+static void bench_hash_data(BenchCtx *ctx) {
+    bench_sink += hash_data(ctx->buf, ctx->size);
+}
+
+// Case for the hex line decoder: decode a whole in-memory text file
+static void bench_hex_lines(BenchCtx *ctx) {
+    FILE *fp = fmemopen(ctx->text, ctx->text_len, "r");
+    uint8_t line_buf[MAX_LINE / 2];
+    size_t line_len, total = 0;
+    while (read_hex_line(fp, line_buf, &line_len, ctx->is_xxd)) total += line_len;
+    fclose(fp);
+    bench_sink += total;
+}
+
+// Case for the output path builder used by process_file_entry
+static void bench_build_path(BenchCtx *ctx) {
+    char path[MAX_PATH];
+    bench_sink += build_output_path(path, MAX_PATH, ctx->dir, ctx->name);
+}
+
+// Case for create_directories on an already existing tree (the common case)
+static void bench_create_dirs(BenchCtx *ctx) {
+    bench_sink += create_directories(ctx->name);
+}
+
+#ifdef HAVE_ZLIB
+// Case for the native ZLIB decoder
+static void bench_decode_zlib(BenchCtx *ctx) {
+    bench_sink += decode_zlib(ctx->worker, ctx->packed, ctx->packed_len, ctx->out, ctx->size, NULL);
+}
+#endif
+
+#ifdef HAVE_LZMA
+// Case for the native LZMA decoder
+static void bench_decode_lzma(BenchCtx *ctx) {
+    bench_sink += decode_lzma(ctx->worker, ctx->packed, ctx->packed_len, ctx->out, ctx->size);
+}
+#endif
+
+#ifdef HAVE_BROTLI
+// Case for the native BROTLI decoder
+static void bench_decode_brotli(BenchCtx *ctx) {
+    bench_sink += decode_brotli(ctx->packed, ctx->packed_len, ctx->out, ctx->size);
+}
+#endif
+
+#ifdef HAVE_BZIP2
+// Case for the native BZIP2 decoder (blocks in parallel unless xz_threads is 1)
+static void bench_decode_bzip2(BenchCtx *ctx) {
+    bench_sink += decode_bzip2(ctx->packed, ctx->packed_len, ctx->out, ctx->size);
+}
+#endif
+
+#if defined(HAVE_ZLIB) && defined(HAVE_OPENSSL)
+// Cases for a ZLIB then FERNET chain: the stages fused through small buffers, then the same
+// payload decrypted whole into an intermediate buffer before it is inflated
+static void bench_chain_fused(BenchCtx *ctx) {
+    MethodChain chain = {2, {FERNET, ZLIB}};
+    bench_sink += decode_chain(ctx->worker, &chain, ctx->packed, ctx->packed_len, ctx->out, ctx->size);
+}
+
+static void bench_chain_staged(BenchCtx *ctx) {
+    MethodChain chain = {1, {FERNET}};
+    bench_sink += decode_chain(ctx->worker, &chain, ctx->packed, ctx->packed_len, ctx->mid, ctx->mid_len) &&
+                  decode_zlib(ctx->worker, ctx->mid, ctx->mid_len, ctx->out, ctx->size, NULL);
+}
+#endif
+
+// Case for a scratch pool round trip of a buffer of the case size
+static void bench_pool(BenchCtx *ctx) {
+    void *buf = pool_get(&ctx->worker->pool, ctx->size, MEM_CODEC_NONE);
+    bench_sink += (uintptr_t)buf;
+    pool_put(&ctx->worker->pool, buf, ctx->size, MEM_CODEC_NONE);
+}
+
+// Case for the header walk of an archive without an index
+static void bench_scan_entries(BenchCtx *ctx) {
+    Entry *entries = NULL;
+    size_t count = 0;
+    if (scan_entries(ctx->ar, 5, ctx->ar->endian, &entries, &count)) mem_free(MEM_PARSE, entries);
+    bench_sink += count;
+}
+
+// Case for building the entry table from the fixed-width index records
+static void bench_load_index(BenchCtx *ctx) {
+    Entry *entries = NULL;
+    size_t count = 0;
+    const Archive *ar = ctx->ar;
+    if (load_index(ar, &ar->data[ar->index_offset], ar->len - INDEX_FOOTER_SIZE - ar->index_offset, &entries, &count))
+        mem_free(MEM_PARSE, entries);
+    bench_sink += count;
+}
+
+// Case for a size and method filter run straight over the mapped index records
+static void bench_filter_table(BenchCtx *ctx) {
+    const Archive *ar = ctx->ar;
+    const uint8_t *table = &ar->data[ar->index_offset + index_table_pad(ar->index_offset)];
+    uint64_t hits = 0;
+    for (uint64_t i = 0; i < ar->index_count; i++) {
+        const uint8_t *rec = &table[i * INDEX_RECORD_V3];
+        hits += rec[48] == ZLIB && read_uint64(&rec[8], ar->endian) > TABLE_PAYLOAD;
+    }
+    bench_sink += hits;
+}
+
+// Cases for the filter decoders of FILTERED entries; the input is filtered once up front
+static void bench_undelta(BenchCtx *ctx) {
+    memcpy(ctx->out, ctx->packed, ctx->size);
+    delta_decode(ctx->out, ctx->size, 4);
+    bench_sink += ctx->out[ctx->size - 1];
+}
+
+static void bench_unshuffle4(BenchCtx *ctx) {
+    shuffle_decode(ctx->packed, ctx->out, ctx->size / 4, 4);
+    bench_sink += ctx->out[0];
+}
+
+static void bench_unshuffle8(BenchCtx *ctx) {
+    shuffle_decode(ctx->packed, ctx->out, ctx->size / 8, 8);
+    bench_sink += ctx->out[0];
+}
+
+static void bench_unbitshuffle(BenchCtx *ctx) {
+    memcpy(ctx->out, ctx->packed, ctx->size);
+    bitshuffle_decode(ctx->out, ctx->out + BENCH_MAX_SIZE, ctx->size, 4);
+    bench_sink += ctx->out[0];
+}
+
+static void bench_unbcj(BenchCtx *ctx) {
+    memcpy(ctx->out, ctx->packed, ctx->size);
+    bcj_x86(ctx->out, ctx->size, 0);
+    bench_sink += ctx->out[0];
+}
+
+// Function to run one filter decoder with the AVX2 kernels and with scalar code only, and report
+// whether the outputs differ. The decoder works on out, which starts as a copy of len bytes of in.
+static int filter_kernels_differ(const char *name, const uint8_t *in, size_t len, int param, uint8_t *simd,
+                                 uint8_t *scalar, size_t cmp_len) {
+    for (int k = 0; k <= 1; k++) {
+        uint8_t *out = k ? scalar : simd;
+        simd_kernels = !k;
+        memcpy(out, in, len);
+        if (strcmp(name, "undelta") == 0) delta_decode(out, len, param);
+        else if (strcmp(name, "unshuffle") == 0) shuffle_decode(in, out, len / param, param);
+        else if (strcmp(name, "unbitshuf") == 0) bitshuffle_decode(out, out + len, len, param);
+        else bcj_x86(out, len, 0);
+    }
+    simd_kernels = 1;
+    if (memcmp(simd, scalar, cmp_len) == 0) return 0;
+    fprintf(stderr, "filter/%s: AVX2 and scalar outputs differ (length %zu, parameter %d)\n", name, len, param);
+    return 1;
+}
+
+// Function to check that the filter decoders give the same bytes with the AVX2 kernels as with
+// scalar code, for lengths that are not multiples of the vector width and every delta distance
+// and (bit)shuffle element size. Returns the number of mismatches.
+static int check_filter_kernels(const uint8_t *base) {
+    static const size_t lens[] = {1, 7, 31, 33, 63, 65, 97, 127, 129, 255, 257, 1031, 4099, 65543};
+    size_t max = 65543;
+    uint8_t *in = malloc(max), *simd = malloc(2 * max), *scalar = malloc(2 * max);
+    if (!in || !simd || !scalar) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(in);
+        free(simd);
+        free(scalar);
+        return 1;
+    }
+    // Random bytes with an E8/E9 opcode every 9 bytes, half of them with a convertible operand
+    memcpy(in, base, max);
+    for (size_t i = 0; i + 5 <= max; i += 9) {
+        in[i] = 0xe8 | (i & 1);
+        if (i & 2) in[i + 4] = i & 4 ? 0x00 : 0xff;
+    }
+    int bad = 0;
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        size_t len = lens[l];
+        for (int dist = 1; dist <= 255; dist++) bad += filter_kernels_differ("undelta", in, len, dist, simd, scalar, len);
+        for (int size = 2; size <= 255; size++) {
+            bad += filter_kernels_differ("unshuffle", in, len, size, simd, scalar, len / size * size);
+            bad += filter_kernels_differ("unbitshuf", in, len, size, simd, scalar, len);
+        }
+        bad += filter_kernels_differ("unbcj", in, len, 0, simd, scalar, len);
+    }
+    free(in);
+    free(simd);
+    free(scalar);
+    return bad;
+}
+
+// Function to build an indexed archive of small entries in memory for the entry table cases
+static int make_table_archive(Archive *ar) {
+    memset(ar, 0, sizeof(*ar));
+    ar->endian = ENDIAN_BIG;
+    ar->version = 1;
+    char *data = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&data, &len);
+    Entry *entries = calloc(TABLE_ENTRIES, sizeof(Entry));
+    if (!mem || !entries) return 0;
+    uint8_t rec[4 + MAX_PATH + 17 + TABLE_PAYLOAD] = {0};
+    write_uint32(rec, MAGIC_NUMBER, ar->endian);
+    rec[4] = ar->version;
+    fwrite(rec, 1, 5, mem);
+    uint64_t offset = 5;
+    for (size_t i = 0; i < TABLE_ENTRIES; i++) {
+        Entry *e = &entries[i];
+        uint32_t name_len = snprintf(e->filename, MAX_PATH, "d%02zu/f%05zu", i % TREE_DIRS, i);
+        e->header_offset = offset;
+        e->orig_size = TABLE_PAYLOAD * (1 + i % 4);
+        e->proc_size = TABLE_PAYLOAD;
+        e->method = i % 2 ? ZLIB : NO_PROCESSING;
+        write_uint32(rec, name_len, ar->endian);
+        memcpy(&rec[4], e->filename, name_len);
+        write_uint64(&rec[4 + name_len], e->orig_size, ar->endian);
+        write_uint64(&rec[12 + name_len], e->proc_size, ar->endian);
+        rec[20 + name_len] = e->method;
+        fwrite(rec, 1, 21 + name_len + TABLE_PAYLOAD, mem);
+        offset += 21 + name_len + TABLE_PAYLOAD;
+    }
+    int ok = write_index(mem, entries, TABLE_ENTRIES, ar, offset, NULL);
+    if (fclose(mem) != 0) ok = 0;
+    free(entries);
+    ar->data = (uint8_t *)data;
+    ar->len = len;
+    ar->entries_end = offset;
+    return ok && parse_index_footer(&ar->data[len - INDEX_FOOTER_SIZE], len, ar);
+}
+
+// Function to render buffer bytes as raw hex or xxd text, 16 bytes per line
+static size_t make_hex_text(char *out, const uint8_t *buf, size_t size, int is_xxd) {
+    size_t pos = 0;
+    for (size_t i = 0; i < size; i += 16) {
+        size_t n = size - i < 16 ? size - i : 16;
+        if (is_xxd) pos += sprintf(&out[pos], "%08zx: ", i);
+        for (size_t j = 0; j < n; j++) {
+            pos += sprintf(&out[pos], "%02x", buf[i + j]);
+            if (is_xxd && j % 2 == 1) out[pos++] = ' ';
+        }
+        out[pos++] = '\n';
+    }
+    out[pos] = '\0';
+    return pos;
+}
+
+// Function to walk a tree reading every file in directory order, as a consumer of an extraction
+// would; with drop set, the files' pages are evicted instead. Returns the bytes read.
+static uint64_t walk_tree(const char *dir, int drop, uint8_t *buf, size_t buf_len) {
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    uint64_t total = 0;
+    struct dirent *de;
+    char path[MAX_PATH + 256];
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            total += walk_tree(path, drop, buf, buf_len);
+            continue;
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+        if (drop) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        } else {
+            ssize_t n;
+            while ((n = read(fd, buf, buf_len)) > 0) total += n;
+        }
+        close(fd);
+    }
+    closedir(d);
+    return total;
+}
+
+// Function to extract a synthetic tree whose archive order interleaves its directories, in archive
+// order or with --locality, then time cold-cache walks of the result
+static void bench_tree_layout(const char *name, const char *root, int use_locality) {
+    if (bench_filter && !strstr(name, bench_filter)) return;
+    Entry *entries = calloc(TREE_FILES, sizeof(Entry));
+    uint8_t *data = malloc(TREE_FILE_SIZE);
+    if (!entries || !data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(data, 0x5a, TREE_FILE_SIZE);
+    for (size_t i = 0; i < TREE_FILES; i++) {
+        snprintf(entries[i].filename, MAX_PATH, "d%02zu/f%05zu", i % TREE_DIRS, i);
+        entries[i].orig_size = TREE_FILE_SIZE;
+        entries[i].shadowed_by = entries[i].prev_copy = -1;
+        entries[i].selected = 1;
+    }
+    output_roots[0].path = root;
+    locality = use_locality;
+    PatternList none = {0};
+    size_t count = 0;
+    size_t *order = build_schedule(entries, TREE_FILES, &none, &count);
+    char path[2 * MAX_PATH];
+    for (size_t i = 0; order && i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, entries[order[i]].filename);
+        create_directories(path);
+        write_output(&entries[order[i]], path, data, TREE_FILE_SIZE);
+    }
+    mem_free(MEM_PARSE, order);
+    locality = 0;
+    sync();
+
+    // Evict the tree before each walk: all caches if allowed (root), else the file pages
+    double elapsed = 0;
+    uint64_t cycles = 0, bytes = 0;
+    for (int r = 0; r < TREE_READS; r++) {
+        FILE *fp = fopen("/proc/sys/vm/drop_caches", "w");
+        if (!fp || fputs("3", fp) < 0 || fclose(fp) != 0) walk_tree(root, 1, data, TREE_FILE_SIZE);
+        else fp = NULL;
+        double t0 = now_ns();
+        uint64_t c0 = now_cycles();
+        bytes = walk_tree(root, 0, data, TREE_FILE_SIZE);
+        cycles += now_cycles() - c0;
+        elapsed += now_ns() - t0;
+    }
+    printf("%-24s %9llu %5d %12.1f %10.3f\n", name, (unsigned long long)bytes, 0, elapsed / TREE_READS,
+           bytes ? (double)cycles / TREE_READS / bytes : 0);
+    fflush(stdout);
+    free(entries);
+    free(data);
+}
+
+int main(int argc, char *argv[]) {
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) bench_cpu = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) bench_warmup_ms = atof(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) bench_target_ms = atof(argv[++i]);
+        else if (argv[i][0] != '-') bench_filter = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s [-c <cpu>] [-w <warmup_ms>] [-t <target_ms>] [filter]\n", argv[0]);
+            return 1;
+        }
+    }
+    pin_cpu(bench_cpu);
+
+    // Fill the input buffer with deterministic pseudo-random bytes
+    uint8_t *base = malloc(BENCH_MAX_SIZE + BENCH_MAX_ALIGN);
+    char *text = malloc(BENCH_MAX_SIZE * 4 + 64);
+    if (!base || !text) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    uint32_t seed = 0x9e3779b9;
+    for (size_t i = 0; i < BENCH_MAX_SIZE + BENCH_MAX_ALIGN; i++) {
+        seed = seed * 1664525 + 1013904223;
+        base[i] = seed >> 24;
+    }
+
+    static const size_t sizes[] = {64, 4096, 65536, BENCH_MAX_SIZE};
+    static const size_t aligns[] = {0, 1, 3, 8};
+    BenchCtx ctx = {0};
+
+    printf("%-24s %9s %5s %12s %10s\n", "case", "bytes", "align", "ns/op", "cyc/byte");
+#ifndef HAVE_RDTSC
+    printf("(no cycle counter on this platform; cyc/byte reported as 0)\n");
+#endif
+
+    // Integer readers across sizes and alignments
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+            ctx.buf = base + aligns[a];
+            ctx.size = sizes[s];
+            run_case("read_uint32/le", ctx.size, aligns[a], bench_read_uint32_le, &ctx);
+            run_case("read_uint32/be", ctx.size, aligns[a], bench_read_uint32_be, &ctx);
+            run_case("read_uint64/le", ctx.size, aligns[a], bench_read_uint64_le, &ctx);
+            run_case("read_uint64/be", ctx.size, aligns[a], bench_read_uint64_be, &ctx);
+            run_case("hash_data", ctx.size, aligns[a], bench_hash_data, &ctx);
+        }
+    }
+
+    // Hex line decoder in both formats (bytes = decoded bytes per op)
+    for (int is_xxd = 0; is_xxd <= 1; is_xxd++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (size_t a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+                ctx.text = text + aligns[a];
+                ctx.text_len = make_hex_text(ctx.text, base, sizes[s], is_xxd);
+                ctx.is_xxd = is_xxd;
+                run_case(is_xxd ? "read_hex_line/xxd" : "read_hex_line/raw", sizes[s], aligns[a], bench_hex_lines, &ctx);
+            }
+        }
+    }
+
+    // Output path builder with short and long names
+    static const char *names[] = {"a.txt", "dir/sub/file.bin",
+        "very/deep/directory/structure/with/many/levels/and/a/long/file_name_here.dat"};
+    for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+        ctx.dir = "./extracted";
+        ctx.name = names[n];
+        run_case("build_output_path", strlen(names[n]), 0, bench_build_path, &ctx);
+    }
+
+    // Native codecs and the scratch pool; the input is compressible text-like data
+    static Worker worker;
+    worker_init(&worker, 0, NULL);
+    ctx.worker = &worker;
+    uint8_t *plain = malloc(BENCH_MAX_SIZE);
+    ctx.packed = malloc(BENCH_MAX_SIZE * 2 + 1024);
+    ctx.out = malloc(BENCH_MAX_SIZE + 1);
+    if (!plain || !ctx.packed || !ctx.out) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < BENCH_MAX_SIZE; i++) plain[i] = "archex primitives "[base[i] % 7 + i % 11];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ctx.size = sizes[s];
+#ifdef HAVE_ZLIB
+        uLongf zlen = BENCH_MAX_SIZE * 2 + 1024;
+        compress2(ctx.packed, &zlen, plain, ctx.size, 6);
+        ctx.packed_len = zlen;
+        run_case("codec/zlib", ctx.size, 0, bench_decode_zlib, &ctx);
+#endif
+#ifdef HAVE_LZMA
+        size_t xlen = 0;
+        lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, plain, ctx.size, ctx.packed, &xlen, BENCH_MAX_SIZE * 2 + 1024);
+        ctx.packed_len = xlen;
+        run_case("codec/lzma", ctx.size, 0, bench_decode_lzma, &ctx);
+
+        // Eight-block .xz as written by create mode, decoded one block per thread
+        uint8_t *blocks = NULL;
+        xz_block_size = ctx.size / 8;
+        if (ctx.size >= 65536 && encode_xz(plain, ctx.size, &blocks, &xlen)) {
+            memcpy(ctx.packed, blocks, xlen);
+            ctx.packed_len = xlen;
+            mem_free(MEM_CODEC_LZMA, blocks);
+            run_case("codec/lzma-blocks", ctx.size, 0, bench_decode_lzma, &ctx);
+        }
+#endif
+#ifdef HAVE_BROTLI
+        size_t blen = BENCH_MAX_SIZE * 2 + 1024;
+        BrotliEncoderCompress(BROTLI_CREATE_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, ctx.size, plain, &blen, ctx.packed);
+        ctx.packed_len = blen;
+        run_case("codec/brotli", ctx.size, 0, bench_decode_brotli, &ctx);
+#endif
+#ifdef HAVE_BZIP2
+        // 100 kB blocks, so the largest size has ten of them: one per thread, then one after the other
+        unsigned int bzlen = BENCH_MAX_SIZE * 2 + 1024;
+        BZ2_bzBuffToBuffCompress((char *)ctx.packed, &bzlen, (char *)plain, ctx.size, 1, 0, 0);
+        ctx.packed_len = bzlen;
+        run_case("codec/bzip2", ctx.size, 0, bench_decode_bzip2, &ctx);
+        xz_threads = 1;
+        run_case("codec/bzip2/sequential", ctx.size, 0, bench_decode_bzip2, &ctx);
+        xz_threads = 0;
+#endif
+#if defined(HAVE_ZLIB) && defined(HAVE_OPENSSL)
+        // Compressed then encrypted, as create mode writes with --method zlib,fernet
+        uint8_t *sealed = NULL;
+        size_t sealed_len = 0;
+        uLongf mid_len = BENCH_MAX_SIZE * 2 + 1024;
+        ctx.mid = malloc(mid_len + 1);
+        if (ctx.mid && compress2(ctx.mid, &mid_len, plain, ctx.size, Z_DEFAULT_COMPRESSION) == Z_OK &&
+            encode_fernet(ctx.mid, mid_len, &sealed, &sealed_len) && sealed_len <= BENCH_MAX_SIZE * 2 + 1024) {
+            memcpy(ctx.packed, sealed, sealed_len);
+            ctx.packed_len = sealed_len;
+            ctx.mid_len = mid_len;
+            run_case("chain/zlib+fernet", ctx.size, 0, bench_chain_fused, &ctx);
+            run_case("chain/zlib+fernet/staged", ctx.size, 0, bench_chain_staged, &ctx);
+        }
+        mem_free(MEM_CODEC_FERNET, sealed);
+        free(ctx.mid);
+        ctx.mid = NULL;
+#endif
+        run_case("scratch_pool", ctx.size, 0, bench_pool, &ctx);
+    }
+
+    // Filter decoders with the AVX2 kernels (where the CPU has them), then scalar only, once both
+    // are known to give the same output
+    if (check_filter_kernels(base)) {
+        fprintf(stderr, "Filter kernels disagree; not timing them\n");
+        return 1;
+    }
+    uint8_t *filter_out = malloc(2 * BENCH_MAX_SIZE);
+    if (filter_out) {
+        uint8_t *codec_out = ctx.out;
+        ctx.out = filter_out;
+        for (int scalar = 0; scalar <= 1; scalar++) {
+            simd_kernels = !scalar;
+            for (size_t s = 1; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                ctx.size = sizes[s];
+                memcpy(ctx.packed, plain, ctx.size);
+                delta_encode(ctx.packed, ctx.size, 4);
+                run_case(scalar ? "filter/undelta/scalar" : "filter/undelta", ctx.size, 0, bench_undelta, &ctx);
+                shuffle_encode(base, ctx.packed, ctx.size / 4, 4);
+                run_case(scalar ? "filter/unshuffle4/scalar" : "filter/unshuffle4", ctx.size, 0, bench_unshuffle4, &ctx);
+                shuffle_encode(base, ctx.packed, ctx.size / 8, 8);
+                run_case(scalar ? "filter/unshuffle8/scalar" : "filter/unshuffle8", ctx.size, 0, bench_unshuffle8, &ctx);
+                memcpy(ctx.packed, base, ctx.size);
+                bitshuffle_encode(ctx.packed, filter_out, ctx.size, 4);
+                run_case(scalar ? "filter/unbitshuf/scalar" : "filter/unbitshuf", ctx.size, 0, bench_unbitshuffle, &ctx);
+                memcpy(ctx.packed, base, ctx.size);
+                bcj_x86(ctx.packed, ctx.size, 1);
+                run_case(scalar ? "filter/unbcj/scalar" : "filter/unbcj", ctx.size, 0, bench_unbcj, &ctx);
+            }
+        }
+        simd_kernels = 1;
+        ctx.out = codec_out;
+        free(filter_out);
+    }
+    worker_destroy(&worker);
+    free(plain);
+    free(ctx.packed);
+    free(ctx.out);
+
+    // Entry table of an archive of small entries: header walk, index records, filter over the records
+    Archive table_ar;
+    if (make_table_archive(&table_ar)) {
+        ctx.ar = &table_ar;
+        run_case("entry_table/scan", table_ar.entries_end, 0, bench_scan_entries, &ctx);
+        run_case("entry_table/index", table_ar.len - table_ar.index_offset, 0, bench_load_index, &ctx);
+        run_case("entry_table/filter", table_ar.index_count * INDEX_RECORD_V3, 0, bench_filter_table, &ctx);
+    }
+    free(table_ar.data);
+
+    // Directory creation on an existing tree of increasing depth
+    char tmpl[] = "/tmp/archex_bench.XXXXXX";
+    char *root = mkdtemp(tmpl);
+    if (root) {
+        char path[MAX_PATH];
+        static const int depths[] = {1, 4, 8};
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            int pos = snprintf(path, MAX_PATH, "%s", root);
+            for (int k = 0; k < depths[d]; k++) pos += snprintf(&path[pos], MAX_PATH - pos, "/d%d", k);
+            snprintf(&path[pos], MAX_PATH - pos, "/file");
+            create_directories(path); // Build the tree once so the case measures the lookups
+            char case_name[32];
+            snprintf(case_name, sizeof(case_name), "create_directories/d%d", depths[d]);
+            ctx.name = path;
+            run_case(case_name, strlen(path), 0, bench_create_dirs, &ctx);
+        }
+        char cmd[MAX_PATH + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+        if (system(cmd) != 0) fprintf(stderr, "warning: could not remove %s\n", root);
+    }
+
+    // Layout of an extracted tree: cold-cache walk after extracting in archive order vs --locality
+    static const char *layouts[] = {"tree_walk/archive-order", "tree_walk/locality"};
+    for (int l = 0; l < 2; l++) {
+        char tree_tmpl[] = "/tmp/archex_tree.XXXXXX";
+        char *tree = mkdtemp(tree_tmpl);
+        if (!tree) continue;
+        bench_tree_layout(layouts[l], tree, l);
+        char cmd[MAX_PATH + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", tree);
+        if (system(cmd) != 0) fprintf(stderr, "warning: could not remove %s\n", tree);
+    }
+
+    free(base);
+    free(text);
+    return 0;
+}
@@ -1,10 +1,17 @@
 import sys
 import zlib
 import lzma
+import bz2
 from cryptography.fernet import Fernet
 import base64
 import logging
+import mmap
 import os
+import re
+from itertools import accumulate
+import queue
+import threading
+from concurrent.futures import ThreadPoolExecutor
 
 # Configure logging to write to archextract.log with a simple format
 logging.basicConfig(filename='archextract.log', level=logging.INFO, format='%(message)s')
@@ -31,8 +38,9 @@ def validate_fernet_key(key):
         return False  # Return False if decoding fails
 
 # Function to process data with no compression or encryption
+# (expected_size is None inside a method chain, where only the last stage's size is known)
 def process_none(data, expected_size):
-    if len(data) != expected_size:  # Check if data matches expected size
+    if expected_size is not None and len(data) != expected_size:  # Check if data matches expected size
         log_error("Data size mismatch for no processing")
         return None
     return data  # Return original data if sizes match
@@ -41,7 +49,7 @@ def process_none(data, expected_size):
 def process_zlib(data, expected_size):
     try:
         decompressed = zlib.decompress(data)  # Decompress the data
-        if len(decompressed) != expected_size:  # Verify decompressed size
+        if expected_size is not None and len(decompressed) != expected_size:  # Verify decompressed size
             log_error("Zlib decompressed size mismatch")
             return None
         return decompressed  # Return decompressed data
@@ -53,7 +61,7 @@ def process_zlib(data, expected_size):
 def process_lzma(data, expected_size):
     try:
         decompressed = lzma.decompress(data)  # Decompress the data
-        if len(decompressed) != expected_size:  # Verify decompressed size
+        if expected_size is not None and len(decompressed) != expected_size:  # Verify decompressed size
             log_error("LZMA decompressed size mismatch")
             return None
         return decompressed  # Return decompressed data
@@ -61,6 +69,35 @@ def process_lzma(data, expected_size):
         log_error(f"LZMA decompression failed: {e}")
         return None
 
+# Function to decompress data using brotli (the module is only needed for archives that use it)
+def process_brotli(data, expected_size):
+    try:
+        import brotli
+    except ImportError:
+        log_error("Brotli decompression needs the brotli module")
+        return None
+    try:
+        decompressed = brotli.decompress(bytes(data))  # Decompress the data
+        if expected_size is not None and len(decompressed) != expected_size:  # Verify decompressed size
+            log_error("Brotli decompressed size mismatch")
+            return None
+        return decompressed  # Return decompressed data
+    except brotli.error as e:  # Handle decompression errors
+        log_error(f"Brotli decompression failed: {e}")
+        return None
+
+# Function to decompress data using bzip2 (concatenated streams included)
+def process_bzip2(data, expected_size):
+    try:
+        decompressed = bz2.decompress(data)  # Decompress the data
+        if expected_size is not None and len(decompressed) != expected_size:  # Verify decompressed size
+            log_error("Bzip2 decompressed size mismatch")
+            return None
+        return decompressed  # Return decompressed data
+    except (OSError, ValueError) as e:  # Handle decompression errors
+        log_error(f"Bzip2 decompression failed: {e}")
+        return None
+
 # Function to decrypt data using Fernet
 def process_fernet(data, expected_size):
     if len(data) < 44:  # Check if data contains a valid key (minimum 44 bytes)
@@ -73,7 +110,7 @@ def process_fernet(data, expected_size):
     try:
         f = Fernet(key)  # Create Fernet object with the key
         decrypted = f.decrypt(data[44:])  # Decrypt the remaining data
-        if len(decrypted) != expected_size:  # Verify decrypted size
+        if expected_size is not None and len(decrypted) != expected_size:  # Verify decrypted size
             log_error("Fernet decrypted size mismatch")
             return None
         log_message(f"Decrypted file with key: {key.decode()}")  # Log decryption success
@@ -82,14 +119,191 @@ def process_fernet(data, expected_size):
         log_error(f"Fernet decryption failed: {e}")
         return None
 
+# Function to undo a delta filter: each byte was stored as its difference from the byte dist before
+def undo_delta(buf, dist):
+    for r in range(dist):
+        buf[r::dist] = bytes(accumulate(buf[r::dist], lambda a, b: (a + b) & 0xFF))
+
+# Function to undo a byte shuffle of size-byte elements (byte j of every element was stored in plane j)
+def undo_shuffle(buf, size, n):
+    out = bytearray(buf)
+    for j in range(size):
+        out[j:n * size:size] = buf[j * n:(j + 1) * n]
+    return out
+
+# Function to undo a bit shuffle: each byte plane of the first multiple of 8 elements was split into
+# 8 rows holding one bit of every element (bit i of a row, least significant first, is element i)
+def undo_bitshuffle(buf, size):
+    n = len(buf) // size & ~7
+    row_len = n // 8
+    planes = bytearray(n * size)
+    # Spread every bit of a row byte to its own byte, weighted by the bit's position in the element
+    spreads = [[bytes(((b >> m) & 1) << k for m in range(8)) for b in range(256)] for k in range(8)]
+    for j in range(size):
+        acc = 0
+        for k in range(8):
+            row = buf[(j * 8 + k) * row_len:(j * 8 + k + 1) * row_len]
+            acc |= int.from_bytes(b"".join(spreads[k][b] for b in row), 'little')
+        planes[j * n:(j + 1) * n] = acc.to_bytes(n, 'little')
+    buf[:n * size] = undo_shuffle(planes, size, n)
+
+# Function to undo the x86 BCJ filter, which made the rel32 operands of E8/E9 instructions absolute.
+# Mirrors bcj_x86 in archex.c, including the candidates it left alone.
+def undo_bcj_x86(buf):
+    candidate = re.compile(b"[\xe8\xe9]")
+    blocked = 0
+    m = candidate.search(buf)
+    while m and m.start() + 5 <= len(buf):
+        i = m.start()
+        v = int.from_bytes(buf[i + 1:i + 5], 'little')
+        if i < blocked or ((v >> 24) + 1) & 0xFE:
+            blocked = i + 4
+            m = candidate.search(buf, i + 1)
+            continue
+        v = (v - (i + 5)) & 0x1FFFFFF
+        v = v | 0xFE000000 if v & 0x1000000 else v  # Sign-extend bit 24 back over the top byte
+        buf[i + 1:i + 5] = v.to_bytes(4, 'little')
+        m = candidate.search(buf, i + 5)
+
+# Function to decode a filtered entry: the inner method, then the filters in reverse order.
+# The data starts with the inner method, the filter count and an id and parameter byte per filter.
+def process_filtered(data, expected_size):
+    if len(data) < 2 or data[1] == 0 or len(data) < 2 + 2 * data[1] or data[0] not in (0, 1, 2):
+        log_error("Corrupt filter chain")
+        return None
+    filters = [(data[2 + 2 * i], data[3 + 2 * i]) for i in range(data[1])]
+    result = process(data[0], data[2 + 2 * len(filters):], expected_size)
+    if result is None:
+        return None
+    buf = bytearray(result)
+    for filter_id, param in reversed(filters):
+        if filter_id == 1 and param >= 1:
+            undo_delta(buf, param)
+        elif filter_id == 2 and param >= 2:
+            buf = undo_shuffle(buf, param, len(buf) // param)
+        elif filter_id == 3 and param >= 2:
+            undo_bitshuffle(buf, param)
+        elif filter_id == 4:
+            undo_bcj_x86(buf)
+        else:
+            log_error("Corrupt filter chain")
+            return None
+    return bytes(buf)
+
+# Function to decode a method chain: the stages in the order listed, each decoding the output of
+# the one before. The data starts with the stage count and a method byte per stage.
+def process_chain(data, expected_size):
+    if len(data) < 1 or not 2 <= data[0] <= 4 or len(data) < 1 + data[0]:
+        log_error("Corrupt method chain")
+        return None
+    stages = list(data[1:1 + data[0]])
+    if any(m not in (1, 2, 3) for m in stages[:-1]) or stages[-1] not in (1, 2, 3, 4):
+        log_error("Corrupt method chain")
+        return None
+    result = data[1 + len(stages):]
+    for i, stage in enumerate(stages):
+        result = process(stage, result, expected_size if i == len(stages) - 1 else None)
+        if result is None:
+            return None
+    return result
+
+# Function to decode data with the given method, returning None on failure
+def process(method, data, expected_size):
+    if method == 0:
+        return process_none(data, expected_size)
+    elif method == 1:
+        return process_zlib(data, expected_size)
+    elif method == 2:
+        return process_lzma(data, expected_size)
+    elif method == 3:
+        return process_fernet(bytes(data), expected_size)  # Fernet needs the key as bytes
+    elif method == 4:
+        return process_filtered(bytes(data), expected_size)
+    elif method == 5:
+        return process_chain(bytes(data), expected_size)
+    elif method == 6:
+        return process_brotli(data, expected_size)
+    elif method == 7:
+        return process_bzip2(data, expected_size)
+    log_error("Unknown processing method")  # Handle invalid method
+    return None
+
+# Function to decode one manifest entry from the mapped input and write its output file
+def process_entry(view, entry):
+    offset, length, method, expected_size, output_file = entry
+    result = process(method, view[offset:offset + length], expected_size)
+    if result is None:
+        return False
+    try:
+        os.makedirs(os.path.dirname(output_file) or ".", exist_ok=True)
+        with open(output_file, 'wb') as f:
+            f.write(result)  # Save the processed data
+    except Exception as e:  # Handle file writing errors
+        log_error(f"Failed to write output file {output_file}: {e}")
+        return False
+    return True
+
+# Function to decode every entry of a manifest against one mapped input with a thread pool.
+# Each manifest line is "<offset>\t<length>\t<method>\t<expected_size>\t<output_file>"; zlib, lzma, bz2
+# and the Fernet cipher release the GIL on large buffers, so the entries decode on several cores.
+# A manifest of "-" is read from stdin as archex feeds it, and each entry starts as soon as its line
+# arrives. One "OK <n>" or "FAILED <n>" line is printed per entry, in manifest order (n counts
+# manifest lines from 0).
+def process_manifest(manifest_file, input_file, threads):
+    with open(input_file, 'rb') as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            view = memoryview(b"")
+        else:
+            view = memoryview(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+    manifest = sys.stdin if manifest_file == '-' else open(manifest_file, 'r')
+    pending = queue.Queue()  # Futures in manifest order, then None
+    malformed = []
+
+    # Function run by the thread that reads the manifest and submits its entries
+    def submit_entries(pool):
+        try:
+            for line in manifest:
+                fields = line.rstrip('\n').split('\t', 4)
+                try:
+                    if len(fields) != 5:
+                        raise ValueError
+                    entry = (int(fields[0]), int(fields[1]), int(fields[2]), int(fields[3]), fields[4])
+                except ValueError:
+                    log_error(f"Malformed manifest line: {line.strip()}")
+                    malformed.append(line)
+                    break
+                pending.put(pool.submit(process_entry, view, entry))
+        finally:
+            pending.put(None)  # Always sent, so the results loop below ends
+
+    with ThreadPoolExecutor(max_workers=threads) as pool:
+        threading.Thread(target=submit_entries, args=(pool,), daemon=True).start()
+        n = 0
+        while True:
+            future = pending.get()
+            if future is None:
+                break
+            print(f"{'OK' if future.result() else 'FAILED'} {n}", flush=True)
+            n += 1
+    if manifest is not sys.stdin:
+        manifest.close()
+    return not malformed
+
 if __name__ == "__main__":
+    # Decode a whole manifest of entries in one invocation
+    if len(sys.argv) in (4, 5) and sys.argv[1] == "--manifest":
+        verbose = 0  # stdout carries the per-entry results
+        threads = int(sys.argv[4]) if len(sys.argv) == 5 else os.cpu_count() or 1
+        sys.exit(0 if process_manifest(sys.argv[2], sys.argv[3], threads) else 1)
+
     # Check if the correct number of arguments is provided
     if len(sys.argv) != 5:
-        print("Usage: python3 process_data.py <method> <input_file> <output_file> <expected_size>", file=sys.stderr)
+        print("Usage: python3 process_data.py <method> <input_file> <output_file> <expected_size>\n"
+              "       python3 process_data.py --manifest <manifest_file|-> <input_file> [<threads>]", file=sys.stderr)
         sys.exit(1)
 
     # Extract command-line arguments
-    method = int(sys.argv[1])  # Processing method (0: none, 1: zlib, 2: lzma, 3: fernet)
+    method = int(sys.argv[1])  # Processing method (0: none, 1: zlib, 2: lzma, 3: fernet, 4: filtered, 5: chain, 6: brotli, 7: bzip2)
     input_file = sys.argv[2]   # Input file path
     output_file = sys.argv[3]  # Output file path
     expected_size = int(sys.argv[4])  # Expected size of processed data
@@ -100,18 +314,10 @@ if __name__ == "__main__":
         data = f.read()
 
     # Process the data based on the specified method
-    result = None
-    if method == 0:
-        result = process_none(data, expected_size)
-    elif method == 1:
-        result = process_zlib(data, expected_size)
-    elif method == 2:
-        result = process_lzma(data, expected_size)
-    elif method == 3:
-        result = process_fernet(data, expected_size)
-    else:
+    if method not in (0, 1, 2, 3, 4, 5, 6, 7):
         log_error("Unknown processing method")  # Handle invalid method
         sys.exit(1)
+    result = process(method, data, expected_size)
 
     # Exit if processing failed
     if result is None: